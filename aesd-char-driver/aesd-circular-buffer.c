@@ -54,6 +54,8 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
 * new start location.
 * Any necessary locking must be handled by the caller
 * Any memory referenced in @param add_entry must be allocated by and/or must have a lifetime managed by the caller.
+* In ring mode the contents are copied into the ring and nothing is handed back to free: the return
+* value is where they were stored, or NULL if the entry is larger than the ring and was not added.
 */
 const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
 {
@@ -61,6 +63,16 @@ const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
     * TODO: implement per description
     */
    const char* ret = buffer->entry[buffer->in_offs].buffptr;
+   char *dst;
+   if(buffer->data) {
+      dst = aesd_circular_buffer_reserve(buffer, add_entry->size, false);
+      if(dst == NULL) {
+         return NULL;
+      }
+      memcpy(dst, add_entry->buffptr, add_entry->size);
+      aesd_circular_buffer_commit(buffer, add_entry->size, false);
+      return dst;
+   }
    memcpy(&buffer->entry[buffer->in_offs], add_entry, sizeof(struct aesd_buffer_entry));
    buffer->in_offs = (buffer->in_offs+1)%AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
    if(buffer->full) {
@@ -81,3 +93,77 @@ void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
 }
+
+/**
+* Initializes @param buffer to store entry contents in the byte ring @param storage of @param size bytes,
+* a power of two.  The caller must map the same memory again directly after the first @param size
+* bytes, so an entry which wraps around the end of the ring can be accessed through one pointer.
+*/
+void aesd_circular_buffer_init_ring(struct aesd_circular_buffer *buffer, char *storage, size_t size)
+{
+    aesd_circular_buffer_init(buffer);
+    buffer->data = storage;
+    buffer->data_size = size;
+}
+
+static void aesd_circular_buffer_evict_oldest(struct aesd_circular_buffer *buffer)
+{
+    buffer->data_tail += buffer->entry[buffer->out_offs].size;
+    buffer->entry[buffer->out_offs].buffptr = NULL;
+    buffer->entry[buffer->out_offs].size = 0;
+    buffer->out_offs = (buffer->out_offs+1)%AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->full = false;
+}
+
+/**
+* Makes room for @param size bytes at the head of a byte ring buffer, evicting the oldest entries as
+* needed, and returns where those bytes should be written.  When @param extend is set the bytes will be
+* appended to the newest entry, otherwise an entry slot is freed up as well.  Bytes of evicted entries
+* are reused without further notice, data_tail tells how far eviction got.
+* Any necessary locking must be handled by the caller
+* @return the location to write to, or NULL if the resulting entry would not fit in the ring
+*/
+char *aesd_circular_buffer_reserve(struct aesd_circular_buffer *buffer, size_t size, bool extend)
+{
+    size_t held = 0;
+
+    if(extend && (buffer->in_offs != buffer->out_offs || buffer->full)) {
+        held = buffer->entry[(buffer->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 1)
+                % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].size;
+    }
+    if(held + size > buffer->data_size) {
+        return NULL;
+    }
+    while(buffer->data_head + size - buffer->data_tail > buffer->data_size) {
+        aesd_circular_buffer_evict_oldest(buffer);
+    }
+    if(!extend && buffer->full) {
+        aesd_circular_buffer_evict_oldest(buffer);
+    }
+    return buffer->data + (buffer->data_head & (buffer->data_size - 1));
+}
+
+/**
+* Publishes @param size bytes written to the location returned by aesd_circular_buffer_reserve(), either
+* as a new entry or, when @param extend is set, appended to the newest entry.
+* Any necessary locking must be handled by the caller
+*/
+void aesd_circular_buffer_commit(struct aesd_circular_buffer *buffer, size_t size, bool extend)
+{
+    struct aesd_buffer_entry *entry;
+
+    if(extend) {
+        entry = &buffer->entry[(buffer->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 1)
+                % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    } else {
+        entry = &buffer->entry[buffer->in_offs];
+        entry->buffptr = buffer->data + (buffer->data_head & (buffer->data_size - 1));
+        entry->size = 0;
+        buffer->in_offs = (buffer->in_offs+1)%AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        if(buffer->in_offs == buffer->out_offs) {
+            buffer->full = true;
+        }
+    }
+    entry->size += size;
+    buffer->data_head += size;
+}
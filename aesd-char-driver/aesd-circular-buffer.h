@@ -16,7 +16,13 @@
 #include <stdbool.h>
 #endif
 
+/*
+ * May be overridden at build time, e.g. by the user space benchmark, up to 255 since
+ * in_offs and out_offs are uint8_t
+ */
+#ifndef AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+#endif
 
 struct aesd_buffer_entry
 {
@@ -49,6 +55,22 @@ struct aesd_circular_buffer
      * set to true when the buffer entry structure is full
      */
     bool full;
+    /**
+     * Byte ring set up by aesd_circular_buffer_init_ring(), NULL when entries reference
+     * memory managed by the caller.  In ring mode entries are packed back to back from
+     * data_tail, and each entry's buffptr is simply data + its ring offset.
+     */
+    char *data;
+    /**
+     * Size of the byte ring, a power of two
+     */
+    size_t data_size;
+    /**
+     * Free running byte positions of the next write and of the oldest entry, taken
+     * modulo data_size to index data
+     */
+    size_t data_head;
+    size_t data_tail;
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
@@ -58,6 +80,12 @@ extern const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *b
 
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern void aesd_circular_buffer_init_ring(struct aesd_circular_buffer *buffer, char *storage, size_t size);
+
+extern char *aesd_circular_buffer_reserve(struct aesd_circular_buffer *buffer, size_t size, bool extend);
+
+extern void aesd_circular_buffer_commit(struct aesd_circular_buffer *buffer, size_t size, bool extend);
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
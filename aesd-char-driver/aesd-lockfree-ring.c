@@ -0,0 +1,180 @@
+/**
+ * @file aesd-lockfree-ring.c
+ * @brief Lock-free single and multi producer rings of aesd_buffer_entry
+ *
+ * Positions are free running counters taken modulo the ring size, so
+ * head - tail is always the number of entries held.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aesd-lockfree-ring.h"
+
+static void *aesd_ring_slots(size_t size, size_t slot_size)
+{
+    size_t bytes = size * slot_size;
+
+    if(size == 0 || (size & (size - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    /* aligned_alloc wants a multiple of the alignment */
+    bytes = (bytes + AESD_CACHELINE - 1) & ~(size_t)(AESD_CACHELINE - 1);
+    return aligned_alloc(AESD_CACHELINE, bytes);
+}
+
+int aesd_spsc_init(struct aesd_spsc_ring *ring, size_t size)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->slot = aesd_ring_slots(size, sizeof(struct aesd_buffer_entry));
+    if(ring->slot == NULL) {
+        return -1;
+    }
+    ring->size = size;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return 0;
+}
+
+void aesd_spsc_destroy(struct aesd_spsc_ring *ring)
+{
+    free(ring->slot);
+    ring->slot = NULL;
+}
+
+/**
+* Stores up to @param count entries from @param entries and publishes them all with one release store.
+* Only the producer thread may call this.
+* @return the number of entries stored, less than @param count if the ring filled up
+*/
+size_t aesd_spsc_push(struct aesd_spsc_ring *ring, const struct aesd_buffer_entry *entries, size_t count)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t room = ring->size - (head - ring->tail_cache);
+    size_t i;
+
+    if(room < count) {
+        ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        room = ring->size - (head - ring->tail_cache);
+    }
+    if(count > room) {
+        count = room;
+    }
+    for(i = 0; i < count; i++) {
+        ring->slot[(head + i) & (ring->size - 1)] = entries[i];
+    }
+    atomic_store_explicit(&ring->head, head + count, memory_order_release);
+    return count;
+}
+
+/**
+* Copies up to @param max of the oldest entries into @param entries and releases their slots at once.
+* Only the consumer thread may call this.
+* @return the number of entries copied, 0 if the ring is empty
+*/
+size_t aesd_spsc_pop(struct aesd_spsc_ring *ring, struct aesd_buffer_entry *entries, size_t max)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t avail = ring->head_cache - tail;
+    size_t i;
+
+    if(avail < max) {
+        ring->head_cache = atomic_load_explicit(&ring->head, memory_order_acquire);
+        avail = ring->head_cache - tail;
+    }
+    if(max > avail) {
+        max = avail;
+    }
+    for(i = 0; i < max; i++) {
+        entries[i] = ring->slot[(tail + i) & (ring->size - 1)];
+    }
+    atomic_store_explicit(&ring->tail, tail + max, memory_order_release);
+    return max;
+}
+
+int aesd_mpsc_init(struct aesd_mpsc_ring *ring, size_t size)
+{
+    size_t i;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->slot = aesd_ring_slots(size, sizeof(struct aesd_mpsc_slot));
+    if(ring->slot == NULL) {
+        return -1;
+    }
+    ring->size = size;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    for(i = 0; i < size; i++) {
+        atomic_init(&ring->slot[i].ready, 0);
+    }
+    return 0;
+}
+
+void aesd_mpsc_destroy(struct aesd_mpsc_ring *ring)
+{
+    free(ring->slot);
+    ring->slot = NULL;
+}
+
+/**
+* Claims up to @param count consecutive positions with a single compare and swap, then stores
+* @param entries in them.  Producers fill their claims concurrently and mark each slot ready on its own,
+* so a batch from one producer is never interleaved with another's.
+* @return the number of entries stored, less than @param count if the ring filled up
+*/
+size_t aesd_mpsc_push(struct aesd_mpsc_ring *ring, const struct aesd_buffer_entry *entries, size_t count)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail;
+    size_t room;
+    size_t n;
+    size_t i;
+
+    do {
+        /*
+         * tail only grows, so room computed from a stale tail is too small,
+         * never too big.  Acquire pairs with the consumer's release so its
+         * reads of the slots we are about to reuse are complete.
+         */
+        tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        room = ring->size - (head - tail);
+        n = count < room ? count : room;
+        if(n == 0) {
+            return 0;
+        }
+    } while(!atomic_compare_exchange_weak_explicit(&ring->head, &head, head + n,
+                memory_order_relaxed, memory_order_relaxed));
+
+    for(i = 0; i < n; i++) {
+        struct aesd_mpsc_slot *slot = &ring->slot[(head + i) & (ring->size - 1)];
+        slot->entry = entries[i];
+        atomic_store_explicit(&slot->ready, head + i + 1, memory_order_release);
+    }
+    return n;
+}
+
+/**
+* Copies up to @param max consecutive ready entries into @param entries and releases their slots at once.
+* A producer which claimed a position but has not stored it yet holds back everything behind it.
+* Only the consumer thread may call this.
+* @return the number of entries copied
+*/
+size_t aesd_mpsc_pop(struct aesd_mpsc_ring *ring, struct aesd_buffer_entry *entries, size_t max)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t i;
+
+    for(i = 0; i < max; i++) {
+        struct aesd_mpsc_slot *slot = &ring->slot[(tail + i) & (ring->size - 1)];
+        if(atomic_load_explicit(&slot->ready, memory_order_acquire) != tail + i + 1) {
+            break;
+        }
+        entries[i] = slot->entry;
+    }
+    if(i > 0) {
+        atomic_store_explicit(&ring->tail, tail + i, memory_order_release);
+    }
+    return i;
+}
@@ -0,0 +1,91 @@
+/*
+ * aesd-lockfree-ring.h
+ *
+ * Lock-free rings of struct aesd_buffer_entry for handing records between
+ * user space threads.  Unlike aesd_circular_buffer nothing is overwritten:
+ * a push into a full ring stores fewer entries than asked for and the caller
+ * decides whether to retry.  Entry contents are owned by the caller, the
+ * consumer receives exactly the pointers the producer pushed.
+ *
+ * aesd_spsc_ring takes one producer thread and one consumer thread.
+ * aesd_mpsc_ring takes any number of producer threads and one consumer.
+ * Both publish and consume in batches: a push or pop of n entries costs
+ * a constant number of atomic operations on shared cache lines.
+ */
+
+#ifndef AESD_LOCKFREE_RING_H
+#define AESD_LOCKFREE_RING_H
+
+#ifdef __KERNEL__
+#error "aesd-lockfree-ring is user space only, the driver uses aesd_circular_buffer"
+#endif
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "aesd-circular-buffer.h"
+
+#define AESD_CACHELINE 64
+
+struct aesd_spsc_ring
+{
+    /**
+     * Entries pushed so far, written by the producer only
+     */
+    _Alignas(AESD_CACHELINE) atomic_size_t head;
+    /**
+     * The producer's last view of tail, so a push only reads the consumer's
+     * cache line when the ring looks full
+     */
+    size_t tail_cache;
+    /**
+     * Entries popped so far, written by the consumer only
+     */
+    _Alignas(AESD_CACHELINE) atomic_size_t tail;
+    size_t head_cache;
+    _Alignas(AESD_CACHELINE) struct aesd_buffer_entry *slot;
+    /**
+     * Number of slots, a power of two
+     */
+    size_t size;
+};
+
+struct aesd_mpsc_slot
+{
+    struct aesd_buffer_entry entry;
+    /**
+     * Position + 1 once the entry for that position is stored
+     */
+    atomic_size_t ready;
+};
+
+struct aesd_mpsc_ring
+{
+    /**
+     * Positions claimed by producers so far
+     */
+    _Alignas(AESD_CACHELINE) atomic_size_t head;
+    /**
+     * Entries popped so far, written by the consumer only
+     */
+    _Alignas(AESD_CACHELINE) atomic_size_t tail;
+    _Alignas(AESD_CACHELINE) struct aesd_mpsc_slot *slot;
+    size_t size;
+};
+
+/**
+ * Allocate a ring of @param size slots, a power of two
+ * @return 0 on success, -1 with errno set otherwise
+ */
+extern int aesd_spsc_init(struct aesd_spsc_ring *ring, size_t size);
+extern void aesd_spsc_destroy(struct aesd_spsc_ring *ring);
+extern size_t aesd_spsc_push(struct aesd_spsc_ring *ring, const struct aesd_buffer_entry *entries, size_t count);
+extern size_t aesd_spsc_pop(struct aesd_spsc_ring *ring, struct aesd_buffer_entry *entries, size_t max);
+
+extern int aesd_mpsc_init(struct aesd_mpsc_ring *ring, size_t size);
+extern void aesd_mpsc_destroy(struct aesd_mpsc_ring *ring);
+extern size_t aesd_mpsc_push(struct aesd_mpsc_ring *ring, const struct aesd_buffer_entry *entries, size_t count);
+extern size_t aesd_mpsc_pop(struct aesd_mpsc_ring *ring, struct aesd_buffer_entry *entries, size_t max);
+
+#endif /* AESD_LOCKFREE_RING_H */
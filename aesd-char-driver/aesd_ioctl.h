@@ -33,14 +33,80 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * Argument of AESDCHAR_IOCSEEKREAD: seek like AESDCHAR_IOCSEEKTO, then copy out
+ * everything from that point on, up to len bytes, from one consistent view
+ * of the buffer
+ */
+struct aesd_seekread {
+    /**
+     * The zero referenced write command and offset within it to start from
+     */
+    uint32_t write_cmd;
+    uint32_t write_cmd_offset;
+    /**
+     * User space destination and its size in bytes
+     */
+    uint64_t buf;
+    uint64_t len;
+};
+
+/**
+ * One record as returned by AESDCHAR_IOCRECORDS
+ */
+struct aesd_record_info {
+    /**
+     * File position of the first byte, usable with pread() or lseek() on a file
+     * which is not in stream mode
+     */
+    uint64_t start;
+    /**
+     * Sequence number of the record, incremented for each new record
+     */
+    uint64_t seq;
+    uint32_t size;
+    /**
+     * AESD_RECORD_COMPLETE once the terminating newline was written
+     */
+    uint32_t flags;
+};
+
+#define AESD_RECORD_COMPLETE 0x1
+
+/**
+ * Argument of AESDCHAR_IOCRECORDS
+ */
+struct aesd_records {
+    /**
+     * User space array of struct aesd_record_info and the number of members it holds
+     */
+    uint64_t records;
+    uint32_t max;
+    /**
+     * Set to the number of records stored, oldest first
+     */
+    uint32_t count;
+    /**
+     * Set to the number of bytes evicted since the device was created, which is the
+     * stream mode file position of the oldest byte
+     */
+    uint64_t base;
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Non zero value switches the file to streaming reads (blocking, complete records only)
+#define AESDCHAR_IOCSTREAM _IOW(AESD_IOC_MAGIC, 2, uint32_t)
+// Returns the number of bytes copied and leaves the file position after them
+#define AESDCHAR_IOCSEEKREAD _IOW(AESD_IOC_MAGIC, 3, struct aesd_seekread)
+// Returns the number of records stored
+#define AESDCHAR_IOCRECORDS _IOWR(AESD_IOC_MAGIC, 4, struct aesd_records)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 4
 
 #endif /* AESD_IOCTL_H */
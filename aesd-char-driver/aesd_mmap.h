@@ -0,0 +1,77 @@
+/*
+ * aesd_mmap.h
+ *
+ *  @brief Layout of the read only mapping exported by aesdchar when loaded
+ *  with mmap_ring=1
+ *
+ *  The mapping starts with one control page holding struct aesd_mmap_ctrl,
+ *  followed by the data ring mapped twice back to back, so a record which
+ *  wraps past the end of the ring can still be read as one contiguous run.
+ *  A record's bytes are found at (offset % data_size) after the control page.
+ */
+
+#ifndef AESD_MMAP_H
+#define AESD_MMAP_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#endif
+
+#include "aesd-circular-buffer.h"
+
+#define AESD_MMAP_MAGIC     0x41455344  /* "AESD" */
+#define AESD_MMAP_VERSION   1
+
+/**
+ * Set in aesd_mmap_entry.flags once the record's terminating newline was written
+ */
+#define AESD_MMAP_ENTRY_COMPLETE 0x1
+
+struct aesd_mmap_entry {
+    /**
+     * Absolute position of the first byte, counting every byte ever written
+     */
+    uint64_t offset;
+    /**
+     * Sequence number of the record, incremented for each new record
+     */
+    uint64_t seq;
+    /**
+     * Number of bytes currently in the record
+     */
+    uint32_t size;
+    uint32_t flags;
+};
+
+struct aesd_mmap_ctrl {
+    uint32_t magic;
+    uint32_t version;
+    /**
+     * Odd while the kernel is updating this page.  Readers must sample it
+     * before and after using the table and retry when it changed.
+     */
+    uint32_t seq;
+    /**
+     * Size in bytes of the data ring, always a power of two
+     */
+    uint32_t data_size;
+    /**
+     * Absolute position of the oldest byte still held in the ring.  Bytes
+     * before tail may already have been overwritten.
+     */
+    uint64_t tail;
+    /**
+     * Absolute position where the next byte will be written
+     */
+    uint64_t head;
+    /**
+     * Number of valid members of entry, oldest first
+     */
+    uint32_t count;
+    uint32_t reserved;
+    struct aesd_mmap_entry entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+};
+
+#endif /* AESD_MMAP_H */
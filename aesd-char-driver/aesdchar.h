@@ -9,8 +9,9 @@
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
 #include "aesd-circular-buffer.h"
+#include "aesd_mmap.h"
 
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
+/* AESD_DEBUG is defined by building with DEBUG=y, see Makefile */
 
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
@@ -25,16 +26,80 @@
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+#define AESD_PARTS_BUCKETS 8
+
+/**
+ * Counters shown in /sys/kernel/debug/aesdchar/stats
+ */
+struct aesd_stats
+{
+    atomic64_t bytes_in;
+    atomic64_t bytes_out;
+    atomic64_t records_committed;
+    atomic64_t records_evicted;
+    atomic64_t lock_contended;   /* writers which found dev->mu taken */
+    atomic64_t lock_wait_ns;     /* time those writers waited for it */
+    /* records committed after 1, 2, ... writes, the last bucket holds the rest */
+    atomic64_t parts[AESD_PARTS_BUCKETS];
+};
+
+/**
+ * Header placed in front of every record buffer so evicted or resized records
+ * can be freed after an SRCU grace period.  aesd_buffer_entry.buffptr points
+ * at data.
+ */
+struct aesd_record
+{
+    struct rcu_head rcu;
+    u32 capacity;         /* bytes available in data, at least the record size */
+    u8 cache;             /* index of the kmem_cache it came from, or AESD_RECORD_KMALLOC */
+    char data[];
+};
+
 struct aesd_dev
 {
     /**
      * TODO: Add structure(s) and locks needed to complete assignment requirements
      */
-    struct mutex mu;
+    struct mutex mu;      /* serialises writers */
+    seqcount_mutex_t seq; /* bumped whenever cbuffer is modified */
+    struct srcu_struct srcu; /* keeps record buffers alive for lock-free readers */
     struct aesd_circular_buffer cbuffer;
     int working_index;
+    loff_t base_pos;      /* bytes evicted from cbuffer since the device was created */
+    u64 record_seq;       /* records started since the device was created */
+    unsigned int working_parts; /* writes stored into the partial record so far */
+    /**
+     * Module wide commit sequence number of each complete entry, indexed like
+     * cbuffer.entry, used to interleave devices on the merged reader
+     */
+    u64 entry_commit[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    /**
+     * Page backed data ring used when loaded with mmap_ring=1, NULL otherwise.
+     * ring_data maps ring_pages twice in a row so every record is contiguous.
+     */
+    struct page **ring_pages;
+    char *ring_data;
+    size_t ring_size;
+    struct aesd_mmap_ctrl *ctrl;
+    wait_queue_head_t readq; /* woken each time a record is completed */
+    struct aesd_stats stats;
     struct cdev cdev;     /* Char device structure      */
 };
 
+/**
+ * Per open file state
+ */
+struct aesd_file
+{
+    struct aesd_dev *dev;
+    /**
+     * Set through AESDCHAR_IOCSTREAM.  Stream readers only see complete
+     * records, block at the end of data unless O_NONBLOCK is set, and use an
+     * f_pos which counts from base_pos 0 so it survives eviction.
+     */
+    bool stream;
+};
+
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
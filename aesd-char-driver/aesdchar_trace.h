@@ -0,0 +1,120 @@
+/*
+ * aesdchar_trace.h
+ *
+ * Static tracepoints for the aesdchar driver, enabled through
+ * /sys/kernel/tracing/events/aesdchar or perf record -e 'aesdchar:*'.
+ * Each event carries the minor number of the device it happened on.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(_AESDCHAR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _AESDCHAR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* bytes stored by one write(), extend is set when it continues a partial record */
+TRACE_EVENT(aesdchar_write,
+    TP_PROTO(unsigned int minor, size_t count, bool extend),
+    TP_ARGS(minor, count, extend),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(size_t, count)
+        __field(bool, extend)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->count = count;
+        __entry->extend = extend;
+    ),
+    TP_printk("minor=%u count=%zu extend=%d",
+        __entry->minor, __entry->count, __entry->extend)
+);
+
+/* a record got its newline after parts writes */
+TRACE_EVENT(aesdchar_commit,
+    TP_PROTO(unsigned int minor, u64 commit, size_t size, unsigned int parts),
+    TP_ARGS(minor, commit, size, parts),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(u64, commit)
+        __field(size_t, size)
+        __field(unsigned int, parts)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->commit = commit;
+        __entry->size = size;
+        __entry->parts = parts;
+    ),
+    TP_printk("minor=%u commit=%llu size=%zu parts=%u",
+        __entry->minor, __entry->commit, __entry->size, __entry->parts)
+);
+
+/* records dropped from the tail to make room, base is the new base_pos */
+TRACE_EVENT(aesdchar_evict,
+    TP_PROTO(unsigned int minor, unsigned int records, size_t bytes, loff_t base),
+    TP_ARGS(minor, records, bytes, base),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(unsigned int, records)
+        __field(size_t, bytes)
+        __field(loff_t, base)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->records = records;
+        __entry->bytes = bytes;
+        __entry->base = base;
+    ),
+    TP_printk("minor=%u records=%u bytes=%zu base=%lld",
+        __entry->minor, __entry->records, __entry->bytes, __entry->base)
+);
+
+/* bytes copied out of one record starting at pos, counted from base_pos 0 */
+TRACE_EVENT(aesdchar_read,
+    TP_PROTO(unsigned int minor, loff_t pos, size_t count),
+    TP_ARGS(minor, pos, count),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(loff_t, pos)
+        __field(size_t, count)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->pos = pos;
+        __entry->count = count;
+    ),
+    TP_printk("minor=%u pos=%lld count=%zu",
+        __entry->minor, __entry->pos, __entry->count)
+);
+
+/* a write_cmd/write_cmd_offset seek resolved to pos, or a negative error */
+TRACE_EVENT(aesdchar_seek,
+    TP_PROTO(unsigned int minor, u32 write_cmd, u32 write_cmd_offset, loff_t pos),
+    TP_ARGS(minor, write_cmd, write_cmd_offset, pos),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(u32, write_cmd)
+        __field(u32, write_cmd_offset)
+        __field(loff_t, pos)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->write_cmd = write_cmd;
+        __entry->write_cmd_offset = write_cmd_offset;
+        __entry->pos = pos;
+    ),
+    TP_printk("minor=%u write_cmd=%u write_cmd_offset=%u pos=%lld",
+        __entry->minor, __entry->write_cmd, __entry->write_cmd_offset, __entry->pos)
+);
+
+#endif /* _AESDCHAR_TRACE_H */
+
+/* the header lives next to main.c rather than in include/trace/events */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesdchar_trace
+#include <trace/define_trace.h>
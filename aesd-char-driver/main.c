@@ -18,187 +18,801 @@
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
 #include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/srcu.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/version.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "aesdchar_trace.h"
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
 
 MODULE_AUTHOR("Bo Lin TW"); /** TODO: fill in your name **/
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+static bool mmap_ring = false;
+module_param(mmap_ring, bool, 0444);
+MODULE_PARM_DESC(mmap_ring, "Store records in a page backed ring which can be mmap'ed read only");
+
+static uint ring_pages = 16;
+module_param(ring_pages, uint, 0444);
+MODULE_PARM_DESC(ring_pages, "Data ring size in pages when mmap_ring is set, a power of two");
+
+static bool slab_pools = true;
+module_param(slab_pools, bool, 0444);
+MODULE_PARM_DESC(slab_pools, "Allocate small records from dedicated kmem_cache pools instead of kmalloc");
+
+/*
+ * Size classes for record allocations, header included.  Records too big for
+ * the largest class, or all records when slab_pools is off, use kmalloc.
+ */
+static const unsigned int aesd_record_class_size[] = { 64, 256, 1024, 4096 };
+static const char * const aesd_record_class_name[] = {
+    "aesdchar-64", "aesdchar-256", "aesdchar-1k", "aesdchar-4k"
+};
+#define AESD_RECORD_CLASSES ARRAY_SIZE(aesd_record_class_size)
+#define AESD_RECORD_KMALLOC AESD_RECORD_CLASSES
+
+static struct kmem_cache *aesd_record_cache[AESD_RECORD_CLASSES];
+static atomic_long_t aesd_record_allocs[AESD_RECORD_CLASSES + 1];
+static atomic_long_t aesd_record_frees[AESD_RECORD_CLASSES + 1];
+static struct dentry *aesd_debugfs;
+
+static uint aesd_nr_devs = 1;
+module_param(aesd_nr_devs, uint, 0444);
+MODULE_PARM_DESC(aesd_nr_devs, "Number of independent aesdchar devices, each with its own ring and lock");
+
+#define AESD_MAX_DEVS 64
+
+struct aesd_dev *aesd_devices;
+/* minor aesd_nr_devs reads every device interleaved by commit order */
+static struct cdev aesd_merged_cdev;
+static atomic64_t aesd_commit_seq = ATOMIC64_INIT(0);
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
     struct aesd_dev* dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
-    filp->private_data = (void *)dev;
+    struct aesd_file *file;
 
     PDEBUG("open");
 
+    file = kzalloc(sizeof(struct aesd_file), GFP_KERNEL);
+    if(file == NULL) {
+        return -ENOMEM;
+    }
+    file->dev = dev;
+    filp->private_data = (void *)file;
+
     return 0;
 }
 
 int aesd_release(struct inode *inode, struct file *filp)
 {
     PDEBUG("release");
-    
+
+    kfree(filp->private_data);
     return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+static unsigned int aesd_dev_minor(struct aesd_dev *dev)
 {
-    unsigned long res;
+    return MINOR(dev->cdev.dev);
+}
+
+/**
+ * Take dev->mu, accounting the time spent waiting when another writer holds it
+ */
+static int aesd_lock(struct aesd_dev *dev)
+{
+    u64 start;
+    int retval;
+
+    if(mutex_trylock(&dev->mu)) {
+        return 0;
+    }
+    start = ktime_get_ns();
+    retval = mutex_lock_interruptible(&dev->mu);
+    atomic64_inc(&dev->stats.lock_contended);
+    atomic64_add(ktime_get_ns() - start, &dev->stats.lock_wait_ns);
+    return retval;
+}
+
+static int aesd_entry_count(struct aesd_dev *dev)
+{
+    if(dev->cbuffer.full) {
+        return AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+    return (dev->cbuffer.in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - dev->cbuffer.out_offs)
+        % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+/**
+ * @return the number of bytes held in the buffer.  Unless @param partial is set, a
+ * record still waiting for its terminating newline is left out.  Caller holds
+ * dev->mu or samples dev->seq.
+ */
+static size_t aesd_buffered_size(struct aesd_dev *dev, bool partial)
+{
+    size_t total = 0;
+    int index = dev->cbuffer.out_offs;
+    int entries = aesd_entry_count(dev);
+
+    if(!partial && dev->working_index != dev->cbuffer.in_offs) {
+        entries--;
+    }
+    while(entries-- > 0) {
+        total += dev->cbuffer.entry[index].size;
+        index = (index+1)%AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+    return total;
+}
+
+/**
+ * @return true if a complete record is available at @param pos, which is
+ * absolute for stream files and relative to the oldest entry otherwise.
+ */
+static bool aesd_read_ready(struct aesd_file *file, loff_t pos)
+{
+    struct aesd_dev *dev = file->dev;
+    loff_t end;
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        end = aesd_buffered_size(dev, false);
+        if(file->stream) {
+            end += dev->base_pos;
+        }
+    } while(read_seqcount_retry(&dev->seq, seq));
+
+    return end > pos;
+}
+
+/**
+ * @return a record buffer with room for at least @param size bytes, from the
+ * smallest pool it fits in, or NULL
+ */
+static char *aesd_record_alloc(size_t size)
+{
+    struct aesd_record *rec;
+    size_t total = sizeof(*rec) + size;
+    unsigned int cache = AESD_RECORD_KMALLOC;
+    unsigned int i;
+
+    for(i = 0; slab_pools && i < AESD_RECORD_CLASSES; i++) {
+        if(total <= aesd_record_class_size[i]) {
+            cache = i;
+            break;
+        }
+    }
+    if(cache == AESD_RECORD_KMALLOC) {
+        rec = kmalloc(total, GFP_KERNEL);
+    } else {
+        rec = kmem_cache_alloc(aesd_record_cache[cache], GFP_KERNEL);
+        total = aesd_record_class_size[cache];
+    }
+    if(rec == NULL) {
+        return NULL;
+    }
+    rec->capacity = total - sizeof(*rec);
+    rec->cache = cache;
+    atomic_long_inc(&aesd_record_allocs[cache]);
+    return rec->data;
+}
+
+static struct aesd_record *aesd_record_of(const char *buffptr)
+{
+    return (struct aesd_record *)(buffptr - offsetof(struct aesd_record, data));
+}
+
+static void aesd_record_free(struct aesd_record *rec)
+{
+    atomic_long_inc(&aesd_record_frees[rec->cache]);
+    if(rec->cache == AESD_RECORD_KMALLOC) {
+        kfree(rec);
+    } else {
+        kmem_cache_free(aesd_record_cache[rec->cache], rec);
+    }
+}
+
+static void aesd_record_free_rcu(struct rcu_head *head)
+{
+    aesd_record_free(container_of(head, struct aesd_record, rcu));
+}
+
+/**
+ * Free a record which is no longer reachable from dev->cbuffer once every
+ * reader which might still be copying from it has left its SRCU section.
+ */
+static void aesd_record_retire(struct aesd_dev *dev, const char *buffptr)
+{
+    if(buffptr) {
+        call_srcu(&dev->srcu, &aesd_record_of(buffptr)->rcu, aesd_record_free_rcu);
+    }
+}
+
+/**
+ * Rewrite the mmap control page from cbuffer.  Records are packed in the
+ * ring from base_pos onwards, so each offset follows from the sizes before it.
+ */
+static void aesd_ctrl_fill(struct aesd_dev *dev)
+{
+    struct aesd_mmap_ctrl *ctrl = dev->ctrl;
+    int entries = aesd_entry_count(dev);
+    int index = dev->cbuffer.out_offs;
+    bool partial = dev->working_index != dev->cbuffer.in_offs;
+    u64 pos = dev->base_pos;
+    int i;
+
+    for(i = 0; i < entries; i++) {
+        ctrl->entry[i].offset = pos;
+        ctrl->entry[i].seq = dev->record_seq - entries + i;
+        ctrl->entry[i].size = dev->cbuffer.entry[index].size;
+        ctrl->entry[i].flags = (partial && i == entries - 1) ? 0 : AESD_MMAP_ENTRY_COMPLETE;
+        pos += dev->cbuffer.entry[index].size;
+        index = (index+1)%AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+    ctrl->count = entries;
+    ctrl->tail = dev->base_pos;
+    ctrl->head = pos;
+}
+
+/**
+ * Bracket every change to cbuffer, working_index or base_pos.  Caller holds
+ * dev->mu.  Both the in kernel seqcount and the one in the mmap control page
+ * are kept odd for the duration of the change.
+ */
+static void aesd_publish_begin(struct aesd_dev *dev)
+{
+    write_seqcount_begin(&dev->seq);
+    if(dev->ctrl) {
+        WRITE_ONCE(dev->ctrl->seq, dev->ctrl->seq + 1);
+        smp_wmb();
+    }
+}
+
+static void aesd_publish_end(struct aesd_dev *dev)
+{
+    if(dev->ctrl) {
+        aesd_ctrl_fill(dev);
+        smp_wmb();
+        WRITE_ONCE(dev->ctrl->seq, dev->ctrl->seq + 1);
+    }
+    write_seqcount_end(&dev->seq);
+}
+
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct file *filp = iocb->ki_filp;
+    loff_t *f_pos = &iocb->ki_pos;
     size_t entry_offset = 0;
+    size_t entry_size = 0;
+    size_t limit;
+    size_t copied;
+    size_t n;
+    const char *entry_buf = NULL;
+    struct aesd_file *file;
     struct aesd_dev *data;
     struct aesd_buffer_entry *entry;
+    unsigned int seq;
+    loff_t base;
+    loff_t tail;
+    loff_t pos;
     ssize_t retval = 0;
+    int idx;
 
-    PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
+    PDEBUG("read %zu bytes with offset %lld",iov_iter_count(to),*f_pos);
 
-    data = (struct aesd_dev *)filp->private_data;
-    if(data == NULL) {
+    file = (struct aesd_file *)filp->private_data;
+    if(file == NULL) {
         return -EFAULT;
     }
+    data = file->dev;
 
-    retval = mutex_lock_interruptible(&data->mu);
-    if (retval != 0) {
-        return -EINTR;
+    /*
+     * Readers never take data->mu.  The entry table is sampled under the
+     * seqcount and the record it points at stays allocated until we leave
+     * the SRCU read section, so copy_to_iter() may fault and sleep safely.
+     * Each pass copies from one entry, until the iterator is full or the
+     * data runs out.
+     */
+next:
+    idx = srcu_read_lock(&data->srcu);
+    do {
+        seq = read_seqcount_begin(&data->seq);
+        tail = data->base_pos;
+        base = 0;
+        pos = *f_pos;
+        limit = SIZE_MAX;
+        if(file->stream) {
+            /* a reader which fell behind eviction resumes at the oldest record */
+            base = data->base_pos;
+            pos = (*f_pos > base) ? *f_pos - base : 0;
+            limit = aesd_buffered_size(data, false);
+        }
+        entry_buf = NULL;
+        entry = NULL;
+        if(pos < limit) {
+            entry = aesd_circular_buffer_find_entry_offset_for_fpos(&data->cbuffer, pos, &entry_offset);
+        }
+        if(entry) {
+            entry_buf = entry->buffptr;
+            entry_size = entry->size;
+        }
+    } while(read_seqcount_retry(&data->seq, seq));
+
+    if(entry_buf == NULL && file->stream && retval == 0) {
+        srcu_read_unlock(&data->srcu, idx);
+        if((filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT)) {
+            return -EAGAIN;
+        }
+        if(wait_event_interruptible(data->readq, aesd_read_ready(file, base + pos))) {
+            return -ERESTARTSYS;
+        }
+        goto next;
     }
-    
-    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&data->cbuffer, *f_pos, &entry_offset);
-    
-    if(entry) {
-        retval = entry->size - entry_offset;
-        if(retval <= 0) {
-            mutex_unlock(&data->mu);
-            return -EFAULT;
-        } else if (retval > count) {
-            retval = count;
-        }
-        
-        res = copy_to_user(buf, &entry->buffptr[entry_offset], retval);
-        retval -= res;
-        if(retval <= 0) {
-            mutex_unlock(&data->mu);
-            return -EFAULT;
+    if(entry_buf == NULL || entry_size <= entry_offset) {
+        srcu_read_unlock(&data->srcu, idx);
+        return retval;
+    }
+
+    n = min(entry_size - entry_offset, iov_iter_count(to));
+    copied = copy_to_iter(&entry_buf[entry_offset], n, to);
+    /*
+     * Page backed ring bytes are reused without a grace period.  Writers
+     * evict before overwriting, so the copy is good unless the oldest
+     * byte moved past where we started copying.
+     */
+    if(data->ring_data) {
+        loff_t now_tail;
+        smp_rmb();
+        do {
+            seq = read_seqcount_begin(&data->seq);
+            now_tail = data->base_pos;
+        } while(read_seqcount_retry(&data->seq, seq));
+        if(now_tail > tail + pos) {
+            iov_iter_revert(to, copied);
+            srcu_read_unlock(&data->srcu, idx);
+            goto next;
         }
-        *f_pos += retval;
     }
+    srcu_read_unlock(&data->srcu, idx);
 
-    mutex_unlock(&data->mu);
+    if(copied == 0) {
+        return retval ? retval : -EFAULT;
+    }
+    atomic64_add(copied, &data->stats.bytes_out);
+    trace_aesdchar_read(aesd_dev_minor(data), tail + pos, copied);
+    retval += copied;
+    *f_pos = base + pos + copied;
+    if(copied == n && iov_iter_count(to) > 0) {
+        goto next;
+    }
     return retval;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+/**
+ * Append @param count bytes from @param from to kmalloc'ed records.  Bytes past a record's
+ * published size are never read, so a partial record with spare capacity is
+ * extended in place.  Otherwise new contents are built in a fresh record which
+ * readers cannot see yet, then published under the seqcount.  Records replaced
+ * or evicted here are freed only after an SRCU grace period.
+ * @return bytes stored or a negative error.  Caller holds dev->mu.
+ */
+static ssize_t aesd_store_kmalloc(struct aesd_dev *dev, struct iov_iter *from, size_t count)
 {
-    unsigned long res = 0;
-    char* working_buf;
-    struct aesd_dev *data;
+    unsigned long res;
+    size_t evicted;
+    char *working_buf;
+    const char *old_buf;
     struct aesd_buffer_entry *working_entry;
-    ssize_t retval = -ENOMEM;
-    
-    PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
-
-    data = (struct aesd_dev *)filp->private_data;
-    if(data == NULL) {
-        return -EFAULT;
-    }
+    struct aesd_buffer_entry new_entry;
 
-    retval = mutex_lock_interruptible(&data->mu);
-    if (retval != 0) {
-        return -EINTR;
-    }
+    if(dev->working_index != dev->cbuffer.in_offs &&
+            aesd_record_of(dev->cbuffer.entry[dev->working_index].buffptr)->capacity -
+                dev->cbuffer.entry[dev->working_index].size >= count) {
+        working_entry = &dev->cbuffer.entry[dev->working_index];
+        res = count - copy_from_iter((char *)working_entry->buffptr + working_entry->size, count, from);
+        if(res == count) {
+            return -EFAULT;
+        }
+        aesd_publish_begin(dev);
+        working_entry->size += (count - res);
+        aesd_publish_end(dev);
 
-    if(data->working_index != data->cbuffer.in_offs) {
-        working_entry = &data->cbuffer.entry[data->working_index];
-        working_buf = kmalloc((working_entry->size + count), GFP_KERNEL);
+    } else if(dev->working_index != dev->cbuffer.in_offs) {
+        working_entry = &dev->cbuffer.entry[dev->working_index];
+        working_buf = aesd_record_alloc(working_entry->size + count);
         if(working_buf == NULL) {
-            mutex_unlock(&data->mu);
-            return ENOMEM;
+            return -ENOMEM;
         }
-        memset(working_buf, '\0', (working_entry->size + count));
         memcpy(working_buf, working_entry->buffptr, working_entry->size);
-        kfree((char *)working_entry->buffptr);
+        res = count - copy_from_iter((working_buf + working_entry->size), count, from);
+        if(res == count) {
+            aesd_record_free(aesd_record_of(working_buf));
+            return -EFAULT;
+        }
+
+        old_buf = working_entry->buffptr;
+        aesd_publish_begin(dev);
         working_entry->buffptr = working_buf;
-        res = copy_from_user((working_buf + working_entry->size), buf, count);
         working_entry->size += (count - res);
+        aesd_publish_end(dev);
+        aesd_record_retire(dev, old_buf);
 
     } else {
-        working_entry = kmalloc(sizeof(struct aesd_buffer_entry), GFP_KERNEL);
-        if(working_entry == NULL) {
-            mutex_unlock(&data->mu);
-            return ENOMEM;
+        working_buf = aesd_record_alloc(count);
+        if(working_buf == NULL) {
+            return -ENOMEM;
         }
-        working_entry->buffptr = kmalloc(count, GFP_KERNEL);
-        if(working_entry->buffptr == NULL) {
-            kfree(data);
-            mutex_unlock(&data->mu);
-            return ENOMEM;
+        res = count - copy_from_iter(working_buf, count, from);
+        if(res == count) {
+            aesd_record_free(aesd_record_of(working_buf));
+            return -EFAULT;
         }
-        res = copy_from_user((char *)working_entry->buffptr, buf, count);
-        working_entry->size = count - res;
+        new_entry.buffptr = working_buf;
+        new_entry.size = count - res;
 
-        working_buf = (char*)aesd_circular_buffer_add_entry(&data->cbuffer, working_entry);
-        if(working_buf) {
-            kfree(working_buf);
+        evicted = 0;
+        aesd_publish_begin(dev);
+        if(dev->cbuffer.full) {
+            evicted = dev->cbuffer.entry[dev->cbuffer.in_offs].size;
+            dev->base_pos += evicted;
+        }
+        old_buf = aesd_circular_buffer_add_entry(&dev->cbuffer, &new_entry);
+        dev->record_seq++;
+        aesd_publish_end(dev);
+        aesd_record_retire(dev, old_buf);
+        if(old_buf) {
+            atomic64_inc(&dev->stats.records_evicted);
+            trace_aesdchar_evict(aesd_dev_minor(dev), 1, evicted, dev->base_pos);
         }
-        kfree(working_entry);
-        working_entry = &data->cbuffer.entry[data->working_index];
     }
+    return count - res;
+}
+
+/**
+ * Append @param count bytes from @param from to the page backed ring.  The ring makes room
+ * by evicting the oldest records when the bytes are reserved, so readers stop
+ * resolving into them before copy_from_iter() overwrites them.  A record never
+ * grows past the ring size.
+ * @return bytes stored or a negative error.  Caller holds dev->mu.
+ */
+static ssize_t aesd_store_ring(struct aesd_dev *dev, struct iov_iter *from, size_t count)
+{
+    unsigned long res;
+    bool partial = dev->working_index != dev->cbuffer.in_offs;
+    size_t tail;
+    int entries;
+    char *dst;
+
+    aesd_publish_begin(dev);
+    tail = dev->cbuffer.data_tail;
+    entries = aesd_entry_count(dev);
+    dst = aesd_circular_buffer_reserve(&dev->cbuffer, count, partial);
+    dev->base_pos += dev->cbuffer.data_tail - tail;
+    entries -= aesd_entry_count(dev);
+    aesd_publish_end(dev);
+    if(entries > 0) {
+        atomic64_add(entries, &dev->stats.records_evicted);
+        trace_aesdchar_evict(aesd_dev_minor(dev), entries, dev->cbuffer.data_tail - tail, dev->base_pos);
+    }
+    if(dst == NULL) {
+        return -EFBIG;
+    }
+
+    res = count - copy_from_iter(dst, count, from);
+    if(res == count) {
+        return -EFAULT;
+    }
+
+    aesd_publish_begin(dev);
+    aesd_circular_buffer_commit(&dev->cbuffer, count - res, partial);
+    if(!partial) {
+        dev->record_seq++;
+    }
+    aesd_publish_end(dev);
+    return count - res;
+}
+
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct file *filp = iocb->ki_filp;
+    size_t count = iov_iter_count(from);
+    struct aesd_dev *data;
+    struct aesd_buffer_entry *working_entry;
+    ssize_t retval = -ENOMEM;
+    bool extend;
+    u64 commit;
+
+    PDEBUG("write %zu bytes with offset %lld",count,iocb->ki_pos);
+
+    if(filp->private_data == NULL) {
+        return -EFAULT;
+    }
+    data = ((struct aesd_file *)filp->private_data)->dev;
+    if(count == 0) {
+        return 0;
+    }
+
+    retval = aesd_lock(data);
+    if (retval != 0) {
+        return -EINTR;
+    }
+
+    extend = data->working_index != data->cbuffer.in_offs;
+    if(data->ring_data) {
+        retval = aesd_store_ring(data, from, count);
+    } else {
+        retval = aesd_store_kmalloc(data, from, count);
+    }
+    if(retval < 0) {
+        mutex_unlock(&data->mu);
+        return retval;
+    }
+    atomic64_add(retval, &data->stats.bytes_in);
+    data->working_parts++;
+    trace_aesdchar_write(aesd_dev_minor(data), retval, extend);
 
+    working_entry = &data->cbuffer.entry[data->working_index];
     if(working_entry->buffptr[working_entry->size-1] == '\n') {
+        commit = atomic64_inc_return(&aesd_commit_seq);
+        aesd_publish_begin(data);
+        data->entry_commit[data->working_index] = commit;
         data->working_index = data->cbuffer.in_offs;
+        aesd_publish_end(data);
+        /* only a completed record is worth waking streaming readers for */
+        wake_up_interruptible(&data->readq);
+
+        atomic64_inc(&data->stats.records_committed);
+        atomic64_inc(&data->stats.parts[min_t(unsigned int, data->working_parts, AESD_PARTS_BUCKETS) - 1]);
+        trace_aesdchar_commit(aesd_dev_minor(data), commit, working_entry->size, data->working_parts);
+        data->working_parts = 0;
     }
 
-    retval = count - res;
     mutex_unlock(&data->mu);
 
     return retval;
 }
 
-static long aesd_move_the_pos(struct file *filp, struct aesd_seekto *seekto)
+/**
+ * A consistent copy of the entry table, oldest entry first
+ */
+struct aesd_snapshot {
+    int count;
+    bool partial;         /* the newest entry is still waiting for its newline */
+    loff_t base;          /* base_pos when the copy was taken */
+    u64 first_seq;        /* sequence number of the oldest entry */
+    const char *buf[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    size_t size[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+};
+
+static void aesd_snapshot(struct aesd_dev *dev, struct aesd_snapshot *snap)
+{
+    unsigned int seq;
+    int index;
+    int i;
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        snap->count = aesd_entry_count(dev);
+        snap->partial = dev->working_index != dev->cbuffer.in_offs;
+        snap->base = dev->base_pos;
+        snap->first_seq = dev->record_seq - snap->count;
+        index = dev->cbuffer.out_offs;
+        for(i = 0; i < snap->count; i++) {
+            snap->buf[i] = dev->cbuffer.entry[index].buffptr;
+            snap->size[i] = dev->cbuffer.entry[index].size;
+            index = (index+1)%AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        }
+    } while(read_seqcount_retry(&dev->seq, seq));
+}
+
+/**
+ * @return the position relative to the oldest entry of @param seekto in @param snap,
+ * or -EINVAL if it is outside the buffered data
+ */
+static loff_t aesd_snapshot_resolve(struct aesd_snapshot *snap, struct aesd_seekto *seekto)
 {
-    int count = 0;
+    loff_t count = 0;
     int cmd;
-    int tmp_out;
-    struct aesd_dev *data;
+
+    if(snap->count == 0) {
+        printk(KERN_ERR "ring buffer empty");
+        return -EINVAL;
+    }
+    if(seekto->write_cmd >= snap->count) {
+        printk(KERN_ERR "not enough data 1");
+        return -EINVAL;
+    }
+    for(cmd = 0; cmd < seekto->write_cmd; cmd++) {
+        count += snap->size[cmd];
+    }
+    if(snap->size[seekto->write_cmd] < seekto->write_cmd_offset) {
+        printk(KERN_ERR "not enough data 2");
+        return -EINVAL;
+    }
+    return count + seekto->write_cmd_offset;
+}
+
+static long aesd_move_the_pos(struct file *filp, struct aesd_seekto *seekto)
+{
+    struct aesd_file *file;
+    struct aesd_snapshot snap;
+    loff_t pos;
 
     PDEBUG("aesd_move_the_pos: %d %d", seekto->write_cmd, seekto->write_cmd_offset);
 
-    data = (struct aesd_dev *)filp->private_data;
-    if(data == NULL) {
+    file = (struct aesd_file *)filp->private_data;
+    if(file == NULL) {
         printk(KERN_ERR "data retrieve error");
         return -EFAULT;
     }
-    if(data->cbuffer.in_offs == data->cbuffer.out_offs && !data->cbuffer.full) {
-        printk(KERN_ERR "ring buffer empty");
-        return -EINVAL;
+    aesd_snapshot(file->dev, &snap);
+    pos = aesd_snapshot_resolve(&snap, seekto);
+    trace_aesdchar_seek(aesd_dev_minor(file->dev), seekto->write_cmd, seekto->write_cmd_offset, pos);
+    if(pos < 0) {
+        return pos;
+    }
+    filp->f_pos = pos;
+    if(file->stream) {
+        filp->f_pos += snap.base;
     }
+    return 0;
+}
 
-    tmp_out = data->cbuffer.out_offs;
-    for(cmd = 0; cmd < seekto->write_cmd; cmd++) {
-        count += data->cbuffer.entry[tmp_out].size;
-        tmp_out = (tmp_out+1)%AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-        if(tmp_out == data->cbuffer.in_offs) {
-            printk(KERN_ERR "not enough data 1");
-            return -EINVAL;
+/**
+ * Resolve a seek and copy everything after it from a single snapshot.  Records
+ * in the snapshot stay allocated for the SRCU read section; with the page backed
+ * ring the copy is retried if eviction reached the copied bytes meanwhile.
+ * @return bytes copied or a negative error
+ */
+static long aesd_seek_read(struct file *filp, struct aesd_seekread *req)
+{
+    struct aesd_file *file = (struct aesd_file *)filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    struct aesd_seekto seekto = {
+        .write_cmd = req->write_cmd,
+        .write_cmd_offset = req->write_cmd_offset,
+    };
+    struct aesd_snapshot snap;
+    char __user *dst = u64_to_user_ptr(req->buf);
+    size_t copied;
+    size_t skip;
+    size_t n;
+    loff_t start;
+    loff_t tail;
+    unsigned int seq;
+    int idx;
+    int i;
+
+retry:
+    idx = srcu_read_lock(&dev->srcu);
+    aesd_snapshot(dev, &snap);
+    start = aesd_snapshot_resolve(&snap, &seekto);
+    if(start < 0) {
+        srcu_read_unlock(&dev->srcu, idx);
+        trace_aesdchar_seek(aesd_dev_minor(dev), req->write_cmd, req->write_cmd_offset, start);
+        return start;
+    }
+
+    copied = 0;
+    skip = start;
+    for(i = 0; i < snap.count && copied < req->len; i++) {
+        if(skip >= snap.size[i]) {
+            skip -= snap.size[i];
+            continue;
+        }
+        n = min_t(size_t, snap.size[i] - skip, req->len - copied);
+        if(copy_to_user(dst + copied, snap.buf[i] + skip, n) != 0) {
+            srcu_read_unlock(&dev->srcu, idx);
+            return -EFAULT;
         }
+        copied += n;
+        skip = 0;
     }
-    if(data->cbuffer.entry[tmp_out].size < seekto->write_cmd_offset) {
-        printk(KERN_ERR "not enough data 2");
-        return -EINVAL;
+
+    if(dev->ring_data) {
+        smp_rmb();
+        do {
+            seq = read_seqcount_begin(&dev->seq);
+            tail = dev->base_pos;
+        } while(read_seqcount_retry(&dev->seq, seq));
+        if(tail > snap.base + start) {
+            srcu_read_unlock(&dev->srcu, idx);
+            goto retry;
+        }
+    }
+    srcu_read_unlock(&dev->srcu, idx);
+
+    trace_aesdchar_seek(aesd_dev_minor(dev), req->write_cmd, req->write_cmd_offset, start);
+    if(copied > 0) {
+        atomic64_add(copied, &dev->stats.bytes_out);
+        trace_aesdchar_read(aesd_dev_minor(dev), snap.base + start, copied);
+    }
+    filp->f_pos = start + copied;
+    if(file->stream) {
+        filp->f_pos += snap.base;
+    }
+    return copied;
+}
+
+/**
+ * Copy the record table out as struct aesd_record_info entries.
+ * @return the number of records stored
+ */
+static long aesd_get_records(struct file *filp, struct aesd_records __user *arg)
+{
+    struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+    struct aesd_records req;
+    struct aesd_record_info info;
+    struct aesd_record_info __user *dst;
+    struct aesd_snapshot snap;
+    u64 start = 0;
+    int i;
+
+    if(copy_from_user(&req, arg, sizeof(req)) != 0) {
+        return -EFAULT;
+    }
+    dst = u64_to_user_ptr(req.records);
+    aesd_snapshot(dev, &snap);
+
+    req.count = 0;
+    for(i = 0; i < snap.count && req.count < req.max; i++) {
+        info.start = start;
+        info.seq = snap.first_seq + i;
+        info.size = snap.size[i];
+        info.flags = (snap.partial && i == snap.count - 1) ? 0 : AESD_RECORD_COMPLETE;
+        if(copy_to_user(&dst[req.count], &info, sizeof(info)) != 0) {
+            return -EFAULT;
+        }
+        start += snap.size[i];
+        req.count++;
     }
-    count += seekto->write_cmd_offset;
-    filp->f_pos = count;
+    req.base = snap.base;
+    if(copy_to_user(arg, &req, sizeof(req)) != 0) {
+        return -EFAULT;
+    }
+    return req.count;
+}
+
+static long aesd_set_stream(struct file *filp, bool stream)
+{
+    struct aesd_file *file = (struct aesd_file *)filp->private_data;
+    struct aesd_dev *data = file->dev;
+
+    if(aesd_lock(data)) {
+        return -ERESTARTSYS;
+    }
+    /* keep pointing at the same byte when switching between relative and absolute f_pos */
+    if(stream && !file->stream) {
+        filp->f_pos += data->base_pos;
+    } else if(!stream && file->stream) {
+        filp->f_pos = (filp->f_pos > data->base_pos) ? filp->f_pos - data->base_pos : 0;
+    }
+    file->stream = stream;
+    mutex_unlock(&data->mu);
     return 0;
 }
 
 long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-	int retval = 0;
+	long retval = 0;
     struct aesd_seekto seekto;
+    struct aesd_seekread seekread;
+    uint32_t stream;
 
 	if (_IOC_TYPE(cmd) != AESD_IOC_MAGIC) return -ENOTTY;
 	if (_IOC_NR(cmd) > AESDCHAR_IOC_MAXNR) return -ENOTTY;
@@ -207,63 +821,571 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
         case AESDCHAR_IOCSEEKTO:
             if( copy_from_user(&seekto, (const void __user *)arg, sizeof(seekto)) != 0) {
                 printk(KERN_ERR "AESDCHAR_IOCSEEKTO: copy_from_user failed");
-                retval = EFAULT;
+                retval = -EFAULT;
             } else {
                 retval = aesd_move_the_pos(filp, &seekto);
             }
             break;
 
+        case AESDCHAR_IOCSTREAM:
+            if(get_user(stream, (uint32_t __user *)arg) != 0) {
+                retval = -EFAULT;
+            } else {
+                retval = aesd_set_stream(filp, stream != 0);
+            }
+            break;
+
+        case AESDCHAR_IOCSEEKREAD:
+            if(copy_from_user(&seekread, (const void __user *)arg, sizeof(seekread)) != 0) {
+                retval = -EFAULT;
+            } else {
+                retval = aesd_seek_read(filp, &seekread);
+            }
+            break;
+
+        case AESDCHAR_IOCRECORDS:
+            retval = aesd_get_records(filp, (struct aesd_records __user *)arg);
+            break;
+
         default:
             return -ENOTTY;
     }
     return retval;
 }
 
+__poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+    struct aesd_file *file = (struct aesd_file *)filp->private_data;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(filp, &file->dev->readq, wait);
+    if(aesd_read_ready(file, filp->f_pos)) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    return mask;
+}
+
+/**
+ * Map the control page followed by the data ring twice, read only.
+ * Only available when records live in the page backed ring.
+ */
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_dev *dev = ((struct aesd_file *)filp->private_data)->dev;
+    unsigned long npages = dev->ring_size >> PAGE_SHIFT;
+    unsigned long len = vma->vm_end - vma->vm_start;
+    unsigned long addr = vma->vm_start;
+    unsigned long i;
+    int err;
+
+    if(dev->ring_data == NULL) {
+        return -ENODEV;
+    }
+    if(vma->vm_pgoff != 0 || len > PAGE_SIZE + 2 * dev->ring_size) {
+        return -EINVAL;
+    }
+    if(vma->vm_flags & VM_WRITE) {
+        return -EPERM;
+    }
+    /* mremap() must not grow it past the inserted pages, and cores need not hold the ring twice */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+#endif
+
+    err = vm_insert_page(vma, addr, virt_to_page(dev->ctrl));
+    for(i = 0; err == 0 && (addr += PAGE_SIZE) < vma->vm_end; i++) {
+        err = vm_insert_page(vma, addr, dev->ring_pages[i % npages]);
+    }
+    return err;
+}
+
+/**
+ * SEEK_END is the end of the buffered data, including a partial record
+ */
+loff_t aesd_llseek(struct file *filp, loff_t off, int whence)
+{
+    struct aesd_file *file = (struct aesd_file *)filp->private_data;
+    struct aesd_dev *dev = file->dev;
+    unsigned int seq;
+    loff_t size;
+
+    do {
+        seq = read_seqcount_begin(&dev->seq);
+        size = aesd_buffered_size(dev, true);
+        if(file->stream) {
+            size += dev->base_pos;
+        }
+    } while(read_seqcount_retry(&dev->seq, seq));
+
+    return fixed_size_llseek(filp, off, whence, size);
+}
+
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
-    .read =     aesd_read,
-    .write =    aesd_write,
+    .llseek =   aesd_llseek,
+    .read_iter =    aesd_read_iter,
+    .write_iter =   aesd_write_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read =  copy_splice_read,
+#else
+    .splice_read =  generic_file_splice_read,
+#endif
+    .splice_write = iter_file_splice_write,
     .unlocked_ioctl = aesd_ioctl,
+    .poll =     aesd_poll,
+    .mmap =     aesd_mmap,
     .open =     aesd_open,
     .release =  aesd_release,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static int aesd_slab_show(struct seq_file *s, void *unused)
+{
+    unsigned int i;
+
+    seq_puts(s, "class,allocs,frees\n");
+    for(i = 0; i <= AESD_RECORD_CLASSES; i++) {
+        seq_printf(s, "%s,%ld,%ld\n",
+                i == AESD_RECORD_KMALLOC ? "kmalloc" : aesd_record_class_name[i],
+                atomic_long_read(&aesd_record_allocs[i]),
+                atomic_long_read(&aesd_record_frees[i]));
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_slab);
+
+static int aesd_stats_show(struct seq_file *s, void *unused)
+{
+    struct aesd_stats *st;
+    unsigned int d;
+    unsigned int i;
+
+    seq_puts(s, "minor,bytes_in,bytes_out,committed,evicted,lock_contended,lock_wait_ns");
+    for(i = 1; i <= AESD_PARTS_BUCKETS; i++) {
+        seq_printf(s, ",parts_%u%s", i, i == AESD_PARTS_BUCKETS ? "+" : "");
+    }
+    seq_putc(s, '\n');
+    for(d = 0; d < aesd_nr_devs; d++) {
+        st = &aesd_devices[d].stats;
+        seq_printf(s, "%u,%lld,%lld,%lld,%lld,%lld,%lld", aesd_dev_minor(&aesd_devices[d]),
+                atomic64_read(&st->bytes_in),
+                atomic64_read(&st->bytes_out),
+                atomic64_read(&st->records_committed),
+                atomic64_read(&st->records_evicted),
+                atomic64_read(&st->lock_contended),
+                atomic64_read(&st->lock_wait_ns));
+        for(i = 0; i < AESD_PARTS_BUCKETS; i++) {
+            seq_printf(s, ",%lld", atomic64_read(&st->parts[i]));
+        }
+        seq_putc(s, '\n');
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(aesd_stats);
+
+static void aesd_record_caches_destroy(void)
+{
+    unsigned int i;
+
+    for(i = 0; i < AESD_RECORD_CLASSES; i++) {
+        kmem_cache_destroy(aesd_record_cache[i]);
+        aesd_record_cache[i] = NULL;
+    }
+}
+
+static int aesd_record_caches_create(void)
+{
+    unsigned int i;
+
+    for(i = 0; i < AESD_RECORD_CLASSES; i++) {
+        aesd_record_cache[i] = kmem_cache_create(aesd_record_class_name[i],
+                aesd_record_class_size[i], 0, SLAB_HWCACHE_ALIGN, NULL);
+        if(aesd_record_cache[i] == NULL) {
+            aesd_record_caches_destroy();
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+static void aesd_ring_free(struct aesd_dev *dev)
+{
+    unsigned long i;
+
+    if(dev->ring_data) {
+        vunmap(dev->ring_data);
+        dev->ring_data = NULL;
+    }
+    if(dev->ring_pages) {
+        for(i = 0; i < (dev->ring_size >> PAGE_SHIFT); i++) {
+            if(dev->ring_pages[i]) {
+                __free_page(dev->ring_pages[i]);
+            }
+        }
+        kfree(dev->ring_pages);
+        dev->ring_pages = NULL;
+    }
+    if(dev->ctrl) {
+        free_page((unsigned long)dev->ctrl);
+        dev->ctrl = NULL;
+    }
+}
+
+/**
+ * Allocate the page backed ring of @param npages pages plus its control page,
+ * and map the ring twice back to back into kernel virtual memory.
+ */
+static int aesd_ring_alloc(struct aesd_dev *dev, unsigned long npages)
+{
+    struct page **mirror;
+    unsigned long i;
+
+    dev->ring_size = npages << PAGE_SHIFT;
+    dev->ring_pages = kcalloc(npages, sizeof(struct page *), GFP_KERNEL);
+    dev->ctrl = (struct aesd_mmap_ctrl *)get_zeroed_page(GFP_KERNEL);
+    mirror = kcalloc(2 * npages, sizeof(struct page *), GFP_KERNEL);
+    if(dev->ring_pages == NULL || dev->ctrl == NULL || mirror == NULL) {
+        goto fail;
+    }
+    for(i = 0; i < npages; i++) {
+        dev->ring_pages[i] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+        if(dev->ring_pages[i] == NULL) {
+            goto fail;
+        }
+        mirror[i] = mirror[i + npages] = dev->ring_pages[i];
+    }
+    dev->ring_data = vmap(mirror, 2 * npages, VM_MAP, PAGE_KERNEL);
+    if(dev->ring_data == NULL) {
+        goto fail;
+    }
+    kfree(mirror);
+
+    aesd_circular_buffer_init_ring(&dev->cbuffer, dev->ring_data, dev->ring_size);
+    dev->ctrl->magic = AESD_MMAP_MAGIC;
+    dev->ctrl->version = AESD_MMAP_VERSION;
+    dev->ctrl->data_size = dev->ring_size;
+    return 0;
+
+fail:
+    kfree(mirror);
+    aesd_ring_free(dev);
+    return -ENOMEM;
+}
+
+/**
+ * One complete record as seen by the merged reader
+ */
+struct aesd_merged_record {
+    const char *buf;
+    size_t size;
+    u64 commit;
+    loff_t pos;           /* position of buf[0] counted from the device's base_pos 0 */
+    struct aesd_dev *dev;
+};
+
+/**
+ * Per open state of the merged reader, sized for aesd_nr_devs at open time
+ */
+struct aesd_merged_file {
+    int *srcu_idx;
+    struct aesd_merged_record *recs;
+};
+
+int aesd_merged_open(struct inode *inode, struct file *filp)
+{
+    struct aesd_merged_file *mf;
+
+    mf = kzalloc(sizeof(*mf), GFP_KERNEL);
+    if(mf == NULL) {
+        return -ENOMEM;
+    }
+    mf->srcu_idx = kcalloc(aesd_nr_devs, sizeof(int), GFP_KERNEL);
+    mf->recs = kcalloc(aesd_nr_devs * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED,
+            sizeof(struct aesd_merged_record), GFP_KERNEL);
+    if(mf->srcu_idx == NULL || mf->recs == NULL) {
+        kfree(mf->srcu_idx);
+        kfree(mf->recs);
+        kfree(mf);
+        return -ENOMEM;
+    }
+    filp->private_data = mf;
+    return 0;
+}
+
+int aesd_merged_release(struct inode *inode, struct file *filp)
+{
+    struct aesd_merged_file *mf = filp->private_data;
+
+    kfree(mf->srcu_idx);
+    kfree(mf->recs);
+    kfree(mf);
+    return 0;
+}
+
+/**
+ * Collect the complete records of every device into mf->recs ordered by commit
+ * sequence number.  Caller holds the SRCU read lock of every device.
+ * @return the number of records collected
+ */
+static int aesd_merged_snapshot(struct aesd_merged_file *mf)
+{
+    struct aesd_merged_record tmp;
+    unsigned int seq;
+    unsigned int d;
+    int total = 0;
+    int count;
+    int index;
+    int i;
+    int j;
+
+    for(d = 0; d < aesd_nr_devs; d++) {
+        struct aesd_dev *dev = &aesd_devices[d];
+        struct aesd_merged_record *recs = &mf->recs[total];
+        do {
+            seq = read_seqcount_begin(&dev->seq);
+            count = aesd_entry_count(dev);
+            if(dev->working_index != dev->cbuffer.in_offs) {
+                count--;
+            }
+            index = dev->cbuffer.out_offs;
+            for(i = 0; i < count; i++) {
+                recs[i].buf = dev->cbuffer.entry[index].buffptr;
+                recs[i].size = dev->cbuffer.entry[index].size;
+                recs[i].commit = dev->entry_commit[index];
+                recs[i].pos = (i == 0) ? dev->base_pos : recs[i-1].pos + recs[i-1].size;
+                recs[i].dev = dev;
+                index = (index+1)%AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+            }
+        } while(read_seqcount_retry(&dev->seq, seq));
+        total += count;
+    }
+
+    /* each device is already in commit order, a simple insertion sort is enough */
+    for(i = 1; i < total; i++) {
+        tmp = mf->recs[i];
+        for(j = i; j > 0 && mf->recs[j-1].commit > tmp.commit; j--) {
+            mf->recs[j] = mf->recs[j-1];
+        }
+        mf->recs[j] = tmp;
+    }
+    return total;
+}
+
+static void aesd_merged_lock(struct aesd_merged_file *mf)
+{
+    unsigned int d;
+
+    for(d = 0; d < aesd_nr_devs; d++) {
+        mf->srcu_idx[d] = srcu_read_lock(&aesd_devices[d].srcu);
+    }
+}
+
+static void aesd_merged_unlock(struct aesd_merged_file *mf)
+{
+    unsigned int d;
+
+    for(d = 0; d < aesd_nr_devs; d++) {
+        srcu_read_unlock(&aesd_devices[d].srcu, mf->srcu_idx[d]);
+    }
+}
+
+/**
+ * Reads the complete records of all devices as one stream ordered by commit
+ * sequence number.  f_pos counts from the oldest record still held by any
+ * device, like a plain aesdchar file.
+ */
+ssize_t aesd_merged_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct aesd_merged_file *mf = iocb->ki_filp->private_data;
+    struct aesd_merged_record *rec;
+    loff_t pos;
+    loff_t tail;
+    size_t offset;
+    size_t copied;
+    size_t n;
+    ssize_t retval = 0;
+    unsigned int seq;
+    int count;
+    int i;
+
+next:
+    aesd_merged_lock(mf);
+    count = aesd_merged_snapshot(mf);
+    pos = iocb->ki_pos;
+    rec = NULL;
+    for(i = 0; i < count; i++) {
+        if(pos < mf->recs[i].size) {
+            rec = &mf->recs[i];
+            break;
+        }
+        pos -= mf->recs[i].size;
+    }
+    if(rec == NULL) {
+        aesd_merged_unlock(mf);
+        return retval;
+    }
+
+    offset = pos;
+    n = min(rec->size - offset, iov_iter_count(to));
+    copied = copy_to_iter(rec->buf + offset, n, to);
+    if(rec->dev->ring_data) {
+        smp_rmb();
+        do {
+            seq = read_seqcount_begin(&rec->dev->seq);
+            tail = rec->dev->base_pos;
+        } while(read_seqcount_retry(&rec->dev->seq, seq));
+        if(tail > rec->pos + offset) {
+            iov_iter_revert(to, copied);
+            aesd_merged_unlock(mf);
+            goto next;
+        }
+    }
+    aesd_merged_unlock(mf);
+
+    if(copied == 0) {
+        return retval ? retval : -EFAULT;
+    }
+    atomic64_add(copied, &rec->dev->stats.bytes_out);
+    trace_aesdchar_read(aesd_dev_minor(rec->dev), rec->pos + offset, copied);
+    retval += copied;
+    iocb->ki_pos += copied;
+    if(copied == n && iov_iter_count(to) > 0) {
+        goto next;
+    }
+    return retval;
+}
+
+struct file_operations aesd_merged_fops = {
+    .owner =    THIS_MODULE,
+    .llseek =   default_llseek,
+    .read_iter =    aesd_merged_read_iter,
+    .open =     aesd_merged_open,
+    .release =  aesd_merged_release,
+};
+
+static int aesd_setup_cdev(struct cdev *cdev, const struct file_operations *fops, int index)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
 
-    cdev_init(&dev->cdev, &aesd_fops);
-    dev->cdev.owner = THIS_MODULE;
-    dev->cdev.ops = &aesd_fops;
-    err = cdev_add (&dev->cdev, devno, 1);
+    cdev_init(cdev, fops);
+    cdev->owner = THIS_MODULE;
+    err = cdev_add (cdev, devno, 1);
     if (err) {
         printk(KERN_ERR "Error %d adding aesd cdev", err);
     }
     return err;
 }
 
+static void aesd_dev_free(struct aesd_dev *dev)
+{
+    int index;
+    struct aesd_buffer_entry *cur;
+
+    if(dev->ring_data) {
+        aesd_ring_free(dev);
+    } else {
+        AESD_CIRCULAR_BUFFER_FOREACH(cur, &dev->cbuffer, index) {
+            if(cur->buffptr) {
+                aesd_record_free(aesd_record_of(cur->buffptr));
+                cur->buffptr = NULL;
+            }
+        }
+    }
+
+    /* wait for records retired by writers to be freed */
+    srcu_barrier(&dev->srcu);
+    cleanup_srcu_struct(&dev->srcu);
+    mutex_destroy(&dev->mu);
+}
+
+static int aesd_dev_init(struct aesd_dev *dev)
+{
+    int result;
+
+    mutex_init(&dev->mu);
+    init_waitqueue_head(&dev->readq);
+    seqcount_mutex_init(&dev->seq, &dev->mu);
+    result = init_srcu_struct(&dev->srcu);
+    if( result ) {
+        mutex_destroy(&dev->mu);
+        return result;
+    }
+
+    if(mmap_ring) {
+        result = aesd_ring_alloc(dev, ring_pages);
+        if( result ) {
+            cleanup_srcu_struct(&dev->srcu);
+            mutex_destroy(&dev->mu);
+        }
+    }
+    return result;
+}
+
 int aesd_init_module(void)
 {
     dev_t dev = 0;
     int result;
+    unsigned int ready = 0;
     printk(KERN_WARNING "Hello from aesdchar bolintw\n");
-    result = alloc_chrdev_region(&dev, aesd_minor, 1,
+    if(aesd_nr_devs < 1 || aesd_nr_devs > AESD_MAX_DEVS) {
+        printk(KERN_ERR "aesdchar: aesd_nr_devs must be between 1 and %d\n", AESD_MAX_DEVS);
+        return -EINVAL;
+    }
+    if(mmap_ring && !is_power_of_2(ring_pages)) {
+        printk(KERN_ERR "aesdchar: ring_pages must be a power of two\n");
+        return -EINVAL;
+    }
+    result = alloc_chrdev_region(&dev, aesd_minor, aesd_nr_devs + 1,
             "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) {
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
         return result;
     }
-    memset(&aesd_device,0,sizeof(struct aesd_dev));
 
-    mutex_init(&aesd_device.mu);
+    aesd_devices = kcalloc(aesd_nr_devs, sizeof(struct aesd_dev), GFP_KERNEL);
+    if(aesd_devices == NULL) {
+        unregister_chrdev_region(dev, aesd_nr_devs + 1);
+        return -ENOMEM;
+    }
+
+    if(slab_pools) {
+        result = aesd_record_caches_create();
+    }
+
+    for(ready = 0; result == 0 && ready < aesd_nr_devs; ready++) {
+        result = aesd_dev_init(&aesd_devices[ready]);
+        if( result ) {
+            break;
+        }
+        result = aesd_setup_cdev(&aesd_devices[ready].cdev, &aesd_fops, ready);
+        if( result ) {
+            aesd_dev_free(&aesd_devices[ready]);
+            break;
+        }
+    }
 
-    result = aesd_setup_cdev(&aesd_device);
+    if( result == 0 ) {
+        result = aesd_setup_cdev(&aesd_merged_cdev, &aesd_merged_fops, aesd_nr_devs);
+    }
 
     if( result ) {
-        mutex_destroy(&aesd_device.mu);
-        unregister_chrdev_region(dev, 1);
+        while(ready-- > 0) {
+            cdev_del(&aesd_devices[ready].cdev);
+            aesd_dev_free(&aesd_devices[ready]);
+        }
+        aesd_record_caches_destroy();
+        kfree(aesd_devices);
+        unregister_chrdev_region(dev, aesd_nr_devs + 1);
+        return result;
     }
+
+    aesd_debugfs = debugfs_create_dir("aesdchar", NULL);
+    debugfs_create_file("slab", 0444, aesd_debugfs, NULL, &aesd_slab_fops);
+    debugfs_create_file("stats", 0444, aesd_debugfs, NULL, &aesd_stats_fops);
     return result;
 
 }
@@ -271,23 +1393,21 @@ int aesd_init_module(void)
 void aesd_cleanup_module(void)
 {
     dev_t devno = MKDEV(aesd_major, aesd_minor);
-    int index;
-    struct aesd_buffer_entry *cur;
+    unsigned int d;
     printk(KERN_WARNING "Goodbye from aesdchar bolintw\n");
 
-    cdev_del(&aesd_device.cdev);
-    
-    AESD_CIRCULAR_BUFFER_FOREACH(cur, &aesd_device.cbuffer, index) {
-        if(cur->buffptr) {
-            kfree(cur->buffptr);
-            cur->buffptr = NULL;
-        }
+    debugfs_remove_recursive(aesd_debugfs);
+    cdev_del(&aesd_merged_cdev);
+    for(d = 0; d < aesd_nr_devs; d++) {
+        cdev_del(&aesd_devices[d].cdev);
     }
+    for(d = 0; d < aesd_nr_devs; d++) {
+        aesd_dev_free(&aesd_devices[d]);
+    }
+    kfree(aesd_devices);
+    aesd_record_caches_destroy();
 
-    mutex_unlock(&aesd_device.mu);
-    mutex_destroy(&aesd_device.mu);
-
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, aesd_nr_devs + 1);
 }
 
 
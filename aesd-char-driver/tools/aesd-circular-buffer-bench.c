@@ -0,0 +1,200 @@
+/**
+ * @file aesd-circular-buffer-bench.c
+ * @brief User space benchmark of the aesd_circular_buffer storage modes
+ *
+ * Compares ingesting records into entries which each own a malloc'ed copy
+ * (what the driver does by default with kmalloc) against the byte ring mode,
+ * where adding an entry is a memcpy into preallocated storage.  Then times
+ * aesd_circular_buffer_find_entry_offset_for_fpos() on a full buffer, walking
+ * the offsets in order the way successive reads do, and at random.
+ *
+ * The entry capacity is fixed at compile time; the Makefile builds one
+ * aesd-circular-buffer-bench-<capacity> per value in BENCH_CAPACITIES.
+ *
+ * usage: aesd-circular-buffer-bench [-n records] [-r ring_bytes]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "aesd-circular-buffer.h"
+
+#define DEFAULT_RECORDS     (1 << 22)
+#define DEFAULT_RING_BYTES  (1 << 20)
+
+#define RANDOM_OFFSETS      4096
+
+static const size_t record_sizes[] = { 16, 64, 256, 1024, 4096 };
+
+/* keeps the compiler from dropping lookups whose result is unused */
+static volatile size_t sink;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Map @param size bytes of shared memory twice back to back, as
+ * aesd_circular_buffer_init_ring() expects.
+ */
+static char *alloc_mirrored(size_t size)
+{
+    int fd = memfd_create("aesd-ring", 0);
+    if(fd == -1 || ftruncate(fd, size) != 0) {
+        perror("memfd");
+        exit(1);
+    }
+    char *base = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED ||
+            mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+            mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    close(fd);
+    return base;
+}
+
+static double bench_malloc(const char *record, size_t record_size, long records)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entry;
+    struct aesd_buffer_entry *cur;
+    uint8_t index;
+    long i;
+
+    aesd_circular_buffer_init(&buffer);
+    double start = now_sec();
+    for(i = 0; i < records; i++) {
+        char *copy = malloc(record_size);
+        memcpy(copy, record, record_size);
+        entry.buffptr = copy;
+        entry.size = record_size;
+        free((char *)aesd_circular_buffer_add_entry(&buffer, &entry));
+    }
+    double elapsed = now_sec() - start;
+    AESD_CIRCULAR_BUFFER_FOREACH(cur, &buffer, index) {
+        free((char *)cur->buffptr);
+    }
+    return elapsed;
+}
+
+static double bench_ring(char *storage, size_t ring_bytes, const char *record, size_t record_size, long records)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entry;
+    long i;
+
+    aesd_circular_buffer_init_ring(&buffer, storage, ring_bytes);
+    entry.buffptr = record;
+    entry.size = record_size;
+    double start = now_sec();
+    for(i = 0; i < records; i++) {
+        aesd_circular_buffer_add_entry(&buffer, &entry);
+    }
+    return now_sec() - start;
+}
+
+/**
+ * Time @param lookups calls of find_entry_offset_for_fpos on a buffer holding
+ * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries of @param record_size bytes.
+ * Sequential lookups step one byte at a time, random ones use offsets drawn
+ * beforehand so the generator stays out of the timed loop.
+ */
+static double bench_find(const char *record, size_t record_size, long lookups, int random)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entry;
+    struct aesd_buffer_entry *found;
+    size_t total = record_size * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    size_t offsets[RANDOM_OFFSETS];
+    size_t entry_offset;
+    size_t offset = 0;
+    uint32_t x = 2463534242u;
+    long i;
+
+    aesd_circular_buffer_init(&buffer);
+    entry.buffptr = record;
+    entry.size = record_size;
+    /* start half way round so the entries wrap past the end of the array */
+    for(i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED / 2; i++) {
+        aesd_circular_buffer_add_entry(&buffer, &entry);
+    }
+    for(i = 0; i < RANDOM_OFFSETS; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        offsets[i] = x % total;
+    }
+
+    double start = now_sec();
+    for(i = 0; i < lookups; i++) {
+        if(random) {
+            offset = offsets[i & (RANDOM_OFFSETS - 1)];
+        } else if(++offset == total) {
+            offset = 0;
+        }
+        found = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, offset, &entry_offset);
+        sink = entry_offset + (found != NULL);
+    }
+    return now_sec() - start;
+}
+
+int main(int argc, char *argv[])
+{
+    long records = DEFAULT_RECORDS;
+    size_t ring_bytes = DEFAULT_RING_BYTES;
+    int opt;
+    size_t i;
+
+    while((opt = getopt(argc, argv, "n:r:")) != -1) {
+        switch(opt) {
+            case 'n': records = atol(optarg); break;
+            case 'r': ring_bytes = strtoul(optarg, NULL, 0); break;
+            default:
+                fprintf(stderr, "usage: %s [-n records] [-r ring_bytes]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(records < 1 || ring_bytes == 0 || (ring_bytes & (ring_bytes - 1)) != 0 ||
+            (ring_bytes % sysconf(_SC_PAGESIZE)) != 0) {
+        fprintf(stderr, "records must be positive, ring_bytes a power of two multiple of the page size\n");
+        return 1;
+    }
+
+    char *storage = alloc_mirrored(ring_bytes);
+    char *record = malloc(record_sizes[sizeof(record_sizes)/sizeof(record_sizes[0]) - 1]);
+    memset(record, 'a', record_sizes[sizeof(record_sizes)/sizeof(record_sizes[0]) - 1]);
+
+    printf("op,capacity,record_bytes,ns_per_op,mb_per_s\n");
+    for(i = 0; i < sizeof(record_sizes)/sizeof(record_sizes[0]); i++) {
+        size_t size = record_sizes[i];
+        double t = bench_malloc(record, size, records);
+        printf("add_malloc,%d,%zu,%.1f,%.1f\n", AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED,
+               size, t * 1e9 / records, size * records / t / 1e6);
+        if(size <= ring_bytes) {
+            t = bench_ring(storage, ring_bytes, record, size, records);
+            printf("add_ring,%d,%zu,%.1f,%.1f\n", AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED,
+                   size, t * 1e9 / records, size * records / t / 1e6);
+        }
+    }
+    for(i = 0; i < sizeof(record_sizes)/sizeof(record_sizes[0]); i++) {
+        size_t size = record_sizes[i];
+        double t = bench_find(record, size, records, 0);
+        printf("find_seq,%d,%zu,%.1f,\n", AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, size, t * 1e9 / records);
+        t = bench_find(record, size, records, 1);
+        printf("find_rand,%d,%zu,%.1f,\n", AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, size, t * 1e9 / records);
+    }
+
+    free(record);
+    munmap(storage, 2 * ring_bytes);
+    return 0;
+}
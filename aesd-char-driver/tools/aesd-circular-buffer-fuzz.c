@@ -0,0 +1,366 @@
+/**
+ * @file aesd-circular-buffer-fuzz.c
+ * @brief Differential fuzzer for aesd_circular_buffer
+ *
+ * Each input is a little program of buffer operations which is run against
+ * aesd-circular-buffer.c and against a plain array model of what the buffer
+ * should hold.  After every operation each entry and a few byte offsets are
+ * looked up through aesd_circular_buffer_find_entry_offset_for_fpos() and
+ * compared with the model, so both the entry bookkeeping and the bytes the
+ * entries point at are checked.  Any mismatch aborts.
+ *
+ * The first input byte picks the storage mode: entries referencing caller
+ * memory as the driver does with kmalloc, or the mirrored byte ring.
+ * Every following operation is one opcode byte plus a two byte argument:
+ *   0  add_entry of a new record
+ *   1  append to the newest record (reserve/commit with extend, ring only)
+ *   2  reserve a new record then commit only part of it (ring only)
+ *   3  look up one byte offset
+ *
+ * Built with -DAESD_LIBFUZZER this is a libFuzzer target:
+ *   clang -fsanitize=fuzzer,address -DAESD_LIBFUZZER ...
+ * Otherwise it runs each file named on the command line, or stdin, as one
+ * input, which suits AFL and replaying crashes, or with -n N it runs N
+ * random inputs:
+ *
+ * usage: aesd-circular-buffer-fuzz [-n inputs] [-s seed] [file...]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "aesd-circular-buffer.h"
+
+#define CAPACITY        AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+#define RING_BYTES      4096
+#define MAX_RECORD      2048
+
+#define CHECK(cond) do { \
+        if(!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s (op %ld)\n", __FILE__, __LINE__, #cond, op_count); \
+            abort(); \
+        } \
+    } while(0)
+
+/**
+ * Reference model, oldest record first.  Record contents are not stored,
+ * byte i of the record with sequence number seq is always pattern(seq, i).
+ */
+struct model_record {
+    unsigned long seq;
+    size_t size;
+    char *mem;            /* what the entry was added with, malloc mode only */
+};
+
+static struct model_record model[CAPACITY];
+static int model_count;
+static unsigned long next_seq;
+static long op_count;
+static char *ring;
+
+static char pattern(unsigned long seq, size_t i)
+{
+    return (char)(seq * 31 + i * 7 + (i >> 8));
+}
+
+static void fill(char *dst, unsigned long seq, size_t from, size_t len)
+{
+    size_t i;
+
+    for(i = 0; i < len; i++) {
+        dst[i] = pattern(seq, from + i);
+    }
+}
+
+static size_t model_total(void)
+{
+    size_t total = 0;
+    int i;
+
+    for(i = 0; i < model_count; i++) {
+        total += model[i].size;
+    }
+    return total;
+}
+
+static void model_evict_oldest(void)
+{
+    free(model[0].mem);
+    memmove(&model[0], &model[1], (model_count - 1) * sizeof(model[0]));
+    model_count--;
+}
+
+/**
+ * Map @param size bytes of shared memory twice back to back, as
+ * aesd_circular_buffer_init_ring() expects.
+ */
+static char *alloc_mirrored(size_t size)
+{
+    int fd = memfd_create("aesd-ring", 0);
+    if(fd == -1 || ftruncate(fd, size) != 0) {
+        perror("memfd");
+        exit(1);
+    }
+    char *base = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED ||
+            mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+            mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    close(fd);
+    return base;
+}
+
+/**
+ * Look up @param offset in both and check they agree on the entry, the
+ * offset within it and the byte found there.
+ */
+static void check_offset(struct aesd_circular_buffer *buffer, size_t offset)
+{
+    struct aesd_buffer_entry *entry;
+    size_t entry_offset = (size_t)-1;
+    size_t rel = offset;
+    int i;
+
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, offset, &entry_offset);
+    for(i = 0; i < model_count && rel >= model[i].size; i++) {
+        rel -= model[i].size;
+    }
+    if(i == model_count) {
+        CHECK(entry == NULL);
+        return;
+    }
+    CHECK(entry == &buffer->entry[(buffer->out_offs + i) % CAPACITY]);
+    CHECK(entry_offset == rel);
+    CHECK(entry->size == model[i].size);
+    CHECK(entry->buffptr[rel] == pattern(model[i].seq, rel));
+}
+
+static void check_all(struct aesd_circular_buffer *buffer, const uint8_t *probe)
+{
+    int count = buffer->full ? CAPACITY : (buffer->in_offs + CAPACITY - buffer->out_offs) % CAPACITY;
+    size_t total = model_total();
+    size_t start = 0;
+    int i;
+
+    CHECK(count == model_count);
+    CHECK(buffer->full == (model_count == CAPACITY));
+    if(buffer->data) {
+        CHECK(buffer->data_head - buffer->data_tail == total);
+        CHECK(total <= buffer->data_size);
+    }
+    for(i = 0; i < model_count; i++) {
+        check_offset(buffer, start);
+        check_offset(buffer, start + model[i].size - 1);
+        start += model[i].size;
+    }
+    check_offset(buffer, total);
+    if(total > 0) {
+        check_offset(buffer, (probe[0] | probe[1] << 8) % total);
+    }
+}
+
+static void op_add(struct aesd_circular_buffer *buffer, size_t size)
+{
+    struct aesd_buffer_entry entry;
+    const char *old;
+    char *mem = malloc(size);
+
+    fill(mem, next_seq, 0, size);
+    entry.buffptr = mem;
+    entry.size = size;
+    old = aesd_circular_buffer_add_entry(buffer, &entry);
+
+    if(buffer->data && size > buffer->data_size) {
+        /* refused whole, the ring is left as it was */
+        CHECK(old == NULL);
+        free(mem);
+        return;
+    }
+    if(buffer->data) {
+        CHECK(old == buffer->data + ((buffer->data_head - size) & (buffer->data_size - 1)));
+        free(mem);
+        mem = NULL;
+        while(model_count > 0 && model_total() + size > buffer->data_size) {
+            model_evict_oldest();
+        }
+    }
+    if(model_count == CAPACITY) {
+        /* malloc mode hands the evicted record back to the caller */
+        CHECK(buffer->data || old == model[0].mem);
+        model_evict_oldest();
+    } else {
+        CHECK(buffer->data || old == NULL);
+    }
+    model[model_count].seq = next_seq++;
+    model[model_count].size = size;
+    model[model_count].mem = mem;
+    model_count++;
+}
+
+/**
+ * Reserve @param size bytes as the driver's ring writer does, then commit
+ * @param commit of them, appending to the newest record if @param extend.
+ */
+static void op_reserve(struct aesd_circular_buffer *buffer, size_t size, size_t commit, bool extend)
+{
+    struct model_record *rec;
+    size_t held = extend ? model[model_count - 1].size : 0;
+    char *dst;
+
+    dst = aesd_circular_buffer_reserve(buffer, size, extend);
+    if(held + size > buffer->data_size) {
+        CHECK(dst == NULL);
+        return;
+    }
+    CHECK(dst != NULL);
+    while(model_total() + size > buffer->data_size) {
+        model_evict_oldest();
+    }
+    if(!extend && model_count == CAPACITY) {
+        model_evict_oldest();
+    }
+    if(extend) {
+        rec = &model[model_count - 1];
+    } else {
+        rec = &model[model_count++];
+        rec->seq = next_seq++;
+        rec->size = 0;
+        rec->mem = NULL;
+    }
+    fill(dst, rec->seq, rec->size, commit);
+    aesd_circular_buffer_commit(buffer, commit, extend);
+    rec->size += commit;
+}
+
+static int run_one(const uint8_t *data, size_t size)
+{
+    struct aesd_circular_buffer buffer;
+    static const uint8_t zero[2];
+    const uint8_t *end = data + size;
+    size_t arg;
+    int i;
+
+    if(size < 1) {
+        return 0;
+    }
+    if((data[0] & 1) && ring == NULL) {
+        ring = alloc_mirrored(RING_BYTES);
+    }
+    if(data[0] & 1) {
+        aesd_circular_buffer_init_ring(&buffer, ring, RING_BYTES);
+    } else {
+        aesd_circular_buffer_init(&buffer);
+    }
+    data++;
+    model_count = 0;
+    next_seq = 0;
+    op_count = 0;
+
+    for(; data + 3 <= end; data += 3, op_count++) {
+        arg = data[1] | data[2] << 8;
+        switch(data[0] % 4) {
+            case 0:
+                /* now and then larger than the ring, which ring mode refuses */
+                op_add(&buffer, arg % MAX_RECORD + 1 + (data[0] / 4 % 32 == 0 ? RING_BYTES : 0));
+                break;
+            case 1:
+                if(buffer.data && model_count > 0) {
+                    op_reserve(&buffer, arg % MAX_RECORD + 1, arg % MAX_RECORD + 1, true);
+                }
+                break;
+            case 2:
+                if(buffer.data) {
+                    size_t len = arg % MAX_RECORD + 1;
+                    op_reserve(&buffer, len, data[0] / 4 % len + 1, false);
+                }
+                break;
+            case 3:
+                check_offset(&buffer, arg);
+                break;
+        }
+        check_all(&buffer, data + 1);
+    }
+    check_all(&buffer, zero);
+
+    for(i = 0; i < model_count; i++) {
+        free(model[i].mem);
+    }
+    return 0;
+}
+
+#ifdef AESD_LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    return run_one(data, size);
+}
+
+#else
+
+static void run_file(FILE *f)
+{
+    static uint8_t input[1 << 20];
+    size_t len = fread(input, 1, sizeof(input), f);
+
+    run_one(input, len);
+}
+
+int main(int argc, char *argv[])
+{
+    uint8_t input[3 * 512 + 1];
+    long inputs = 0;
+    long i;
+    size_t j;
+    int opt;
+
+    srandom(1);
+    while((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch(opt) {
+            case 'n': inputs = atol(optarg); break;
+            case 's': srandom(atol(optarg)); break;
+            default:
+                fprintf(stderr, "usage: %s [-n inputs] [-s seed] [file...]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if(inputs > 0) {
+        for(i = 0; i < inputs; i++) {
+            size_t len = random() % sizeof(input);
+            for(j = 0; j < len; j++) {
+                input[j] = random();
+            }
+            /* favour small records now and then so the entry limit is reached before the byte limit */
+            if(i & 1) {
+                for(j = 3; j < len; j += 3) {
+                    input[j - 1] &= 15;
+                    input[j] = 0;
+                }
+            }
+            run_one(input, len);
+        }
+        printf("%ld inputs ok, capacity %d\n", inputs, CAPACITY);
+        return 0;
+    }
+    if(optind == argc) {
+        run_file(stdin);
+    }
+    for(; optind < argc; optind++) {
+        FILE *f = fopen(argv[optind], "rb");
+        if(f == NULL) {
+            perror(argv[optind]);
+            return 1;
+        }
+        run_file(f);
+        fclose(f);
+    }
+    return 0;
+}
+
+#endif
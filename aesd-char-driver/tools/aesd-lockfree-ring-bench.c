@@ -0,0 +1,287 @@
+/**
+ * @file aesd-lockfree-ring-bench.c
+ * @brief Throughput and latency of handing records between threads
+ *
+ * N producer threads push records to one consumer thread through either
+ * aesd_circular_buffer behind a pthread mutex, aesd_spsc_ring (one producer
+ * only) or aesd_mpsc_ring.  Each push and pop moves up to a batch of entries.
+ * A thread which finds the ring full or empty yields and tries again.
+ *
+ * Every 64th record carries the time it was pushed, and the consumer turns
+ * those into the p50/p99 push to pop latency.  The consumer also checks that
+ * each producer's records arrive complete and in order.
+ *
+ * The mutex version is limited to AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+ * entries, so the Makefile builds this with that set to 255 and the
+ * lock-free rings default to 256 slots.
+ *
+ * usage: aesd-lockfree-ring-bench [-p max_producers] [-n records_per_producer] [-b batch] [-q slots]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "aesd-circular-buffer.h"
+#include "aesd-lockfree-ring.h"
+
+#define LATENCY_EVERY   64
+#define MAX_BATCH       256
+
+enum mode { MODE_MUTEX, MODE_SPSC, MODE_MPSC };
+static const char * const mode_name[] = { "mutex", "spsc", "mpsc" };
+
+struct record {
+    uint64_t pushed_ns;   /* 0 unless this record is a latency sample */
+    uint32_t producer;
+    uint64_t seq;
+};
+
+struct locked_buffer {
+    pthread_mutex_t lock;
+    struct aesd_circular_buffer buffer;
+};
+
+struct bench {
+    enum mode mode;
+    int producers;
+    long records;
+    size_t batch;
+    size_t window;        /* records each producer cycles through */
+    struct locked_buffer locked;
+    struct aesd_spsc_ring spsc;
+    struct aesd_mpsc_ring mpsc;
+    struct record **recs;
+    uint64_t *latency;
+    long samples;
+};
+
+struct producer_arg {
+    struct bench *b;
+    uint32_t id;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static size_t locked_push(struct locked_buffer *l, const struct aesd_buffer_entry *entries, size_t count)
+{
+    size_t i;
+
+    pthread_mutex_lock(&l->lock);
+    for(i = 0; i < count && !l->buffer.full; i++) {
+        aesd_circular_buffer_add_entry(&l->buffer, &entries[i]);
+    }
+    pthread_mutex_unlock(&l->lock);
+    return i;
+}
+
+/* aesd_circular_buffer has no pop, readers normally leave entries in place */
+static size_t locked_pop(struct locked_buffer *l, struct aesd_buffer_entry *entries, size_t max)
+{
+    struct aesd_circular_buffer *buf = &l->buffer;
+    size_t i;
+
+    pthread_mutex_lock(&l->lock);
+    for(i = 0; i < max && (buf->full || buf->out_offs != buf->in_offs); i++) {
+        entries[i] = buf->entry[buf->out_offs];
+        buf->out_offs = (buf->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        buf->full = false;
+    }
+    pthread_mutex_unlock(&l->lock);
+    return i;
+}
+
+static size_t push(struct bench *b, const struct aesd_buffer_entry *entries, size_t count)
+{
+    switch(b->mode) {
+        case MODE_MUTEX: return locked_push(&b->locked, entries, count);
+        case MODE_SPSC: return aesd_spsc_push(&b->spsc, entries, count);
+        default: return aesd_mpsc_push(&b->mpsc, entries, count);
+    }
+}
+
+static size_t pop(struct bench *b, struct aesd_buffer_entry *entries, size_t max)
+{
+    switch(b->mode) {
+        case MODE_MUTEX: return locked_pop(&b->locked, entries, max);
+        case MODE_SPSC: return aesd_spsc_pop(&b->spsc, entries, max);
+        default: return aesd_mpsc_pop(&b->mpsc, entries, max);
+    }
+}
+
+static void *producer(void *argp)
+{
+    struct producer_arg *arg = argp;
+    struct bench *b = arg->b;
+    struct record *recs = b->recs[arg->id];
+    struct aesd_buffer_entry entries[MAX_BATCH];
+    long seq = 0;
+    size_t n;
+    size_t done;
+    size_t i;
+
+    while(seq < b->records) {
+        n = b->batch;
+        if(b->records - seq < (long)n) {
+            n = b->records - seq;
+        }
+        for(i = 0; i < n; i++) {
+            struct record *r = &recs[(seq + i) % b->window];
+            r->producer = arg->id;
+            r->seq = seq + i;
+            r->pushed_ns = ((seq + i) % LATENCY_EVERY == 0) ? now_ns() : 0;
+            entries[i].buffptr = (const char *)r;
+            entries[i].size = sizeof(*r);
+        }
+        for(done = 0; done < n; ) {
+            size_t pushed = push(b, entries + done, n - done);
+            if(pushed == 0) {
+                sched_yield();
+            }
+            done += pushed;
+        }
+        seq += n;
+    }
+    return NULL;
+}
+
+static void consume(struct bench *b)
+{
+    struct aesd_buffer_entry entries[MAX_BATCH];
+    uint64_t *next = calloc(b->producers, sizeof(uint64_t));
+    long remaining = b->records * b->producers;
+    size_t n;
+    size_t i;
+
+    while(remaining > 0) {
+        n = pop(b, entries, b->batch);
+        if(n == 0) {
+            sched_yield();
+            continue;
+        }
+        for(i = 0; i < n; i++) {
+            const struct record *r = (const struct record *)entries[i].buffptr;
+            if(r->producer >= (uint32_t)b->producers || r->seq != next[r->producer]) {
+                fprintf(stderr, "%s: record out of order from producer %u\n", mode_name[b->mode], r->producer);
+                exit(1);
+            }
+            next[r->producer]++;
+            if(r->pushed_ns) {
+                b->latency[b->samples++] = now_ns() - r->pushed_ns;
+            }
+        }
+        remaining -= n;
+    }
+    free(next);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void run(enum mode mode, int producers, long records, size_t batch, size_t slots)
+{
+    struct bench b = {
+        .mode = mode,
+        .producers = producers,
+        .records = records,
+        .batch = batch,
+        /* more than can be in flight, in the consumer's hands included */
+        .window = 2 * ((slots > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED ?
+                    slots : AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) + batch),
+    };
+    pthread_t *threads = calloc(producers, sizeof(pthread_t));
+    struct producer_arg *args = calloc(producers, sizeof(struct producer_arg));
+    int p;
+
+    pthread_mutex_init(&b.locked.lock, NULL);
+    aesd_circular_buffer_init(&b.locked.buffer);
+    if(aesd_spsc_init(&b.spsc, slots) != 0 || aesd_mpsc_init(&b.mpsc, slots) != 0) {
+        perror("ring init");
+        exit(1);
+    }
+    b.recs = calloc(producers, sizeof(struct record *));
+    for(p = 0; p < producers; p++) {
+        b.recs[p] = calloc(b.window, sizeof(struct record));
+    }
+    b.latency = calloc(records * producers / LATENCY_EVERY + producers, sizeof(uint64_t));
+
+    uint64_t start = now_ns();
+    for(p = 0; p < producers; p++) {
+        args[p].b = &b;
+        args[p].id = p;
+        pthread_create(&threads[p], NULL, producer, &args[p]);
+    }
+    consume(&b);
+    for(p = 0; p < producers; p++) {
+        pthread_join(threads[p], NULL);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    qsort(b.latency, b.samples, sizeof(uint64_t), cmp_u64);
+    printf("%s,%d,%zu,%.0f,%llu,%llu\n", mode_name[mode], producers, batch,
+           records * producers / elapsed,
+           (unsigned long long)(b.samples ? b.latency[b.samples / 2] : 0),
+           (unsigned long long)(b.samples ? b.latency[b.samples * 99 / 100] : 0));
+
+    for(p = 0; p < producers; p++) {
+        free(b.recs[p]);
+    }
+    free(b.recs);
+    free(b.latency);
+    free(threads);
+    free(args);
+    aesd_spsc_destroy(&b.spsc);
+    aesd_mpsc_destroy(&b.mpsc);
+    pthread_mutex_destroy(&b.locked.lock);
+}
+
+int main(int argc, char *argv[])
+{
+    int max_producers = sysconf(_SC_NPROCESSORS_ONLN) > 2 ? sysconf(_SC_NPROCESSORS_ONLN) - 1 : 1;
+    long records = 1000000;
+    size_t batch = 16;
+    size_t slots = 256;
+    int opt;
+    int p;
+
+    while((opt = getopt(argc, argv, "p:n:b:q:")) != -1) {
+        switch(opt) {
+            case 'p': max_producers = atoi(optarg); break;
+            case 'n': records = atol(optarg); break;
+            case 'b': batch = strtoul(optarg, NULL, 0); break;
+            case 'q': slots = strtoul(optarg, NULL, 0); break;
+            default:
+                fprintf(stderr, "usage: %s [-p max_producers] [-n records_per_producer] [-b batch] [-q slots]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(max_producers < 1 || records < 1 || batch < 1 || batch > MAX_BATCH ||
+            slots == 0 || (slots & (slots - 1)) != 0) {
+        fprintf(stderr, "producers and records must be positive, batch 1..%d, slots a power of two\n", MAX_BATCH);
+        return 1;
+    }
+
+    printf("mode,producers,batch,records_per_s,p50_ns,p99_ns\n");
+    for(p = 1; p <= max_producers; p++) {
+        run(MODE_MUTEX, p, records, batch, slots);
+        if(p == 1) {
+            run(MODE_SPSC, p, records, batch, slots);
+        }
+        run(MODE_MPSC, p, records, batch, slots);
+    }
+    return 0;
+}
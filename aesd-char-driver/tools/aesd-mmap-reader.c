@@ -0,0 +1,115 @@
+/**
+ * @file aesd-mmap-reader.c
+ * @brief Zero copy reader for the aesdchar mmap_ring mapping
+ *
+ * The control page is published by the kernel with a seqlock style counter:
+ * it is odd while the table is being changed, and any change between two
+ * samples means the copy taken in between must be discarded.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "aesd-mmap-reader.h"
+
+int aesd_mmap_reader_open(struct aesd_mmap_reader *reader, const char *device)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    const struct aesd_mmap_ctrl *ctrl;
+
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = open(device, O_RDONLY);
+    if(reader->fd == -1) {
+        return -1;
+    }
+
+    /* map the control page alone first to learn the ring size */
+    ctrl = mmap(NULL, page_size, PROT_READ, MAP_SHARED, reader->fd, 0);
+    if(ctrl == MAP_FAILED) {
+        goto err;
+    }
+    if(ctrl->magic != AESD_MMAP_MAGIC || ctrl->version != AESD_MMAP_VERSION) {
+        munmap((void *)ctrl, page_size);
+        errno = EPROTO;
+        goto err;
+    }
+    reader->data_size = ctrl->data_size;
+    munmap((void *)ctrl, page_size);
+
+    reader->map_len = page_size + 2 * reader->data_size;
+    reader->map = mmap(NULL, reader->map_len, PROT_READ, MAP_SHARED, reader->fd, 0);
+    if(reader->map == MAP_FAILED) {
+        reader->map = NULL;
+        goto err;
+    }
+    reader->ctrl = reader->map;
+    reader->data = (const char *)reader->map + page_size;
+    return 0;
+
+err:
+    close(reader->fd);
+    reader->fd = -1;
+    return -1;
+}
+
+void aesd_mmap_reader_close(struct aesd_mmap_reader *reader)
+{
+    if(reader->map) {
+        munmap(reader->map, reader->map_len);
+        reader->map = NULL;
+    }
+    if(reader->fd != -1) {
+        close(reader->fd);
+        reader->fd = -1;
+    }
+}
+
+int aesd_mmap_reader_snapshot(struct aesd_mmap_reader *reader,
+            struct aesd_mmap_record *records, int max)
+{
+    const volatile struct aesd_mmap_ctrl *ctrl = reader->ctrl;
+    uint32_t start;
+    uint32_t total;
+    uint32_t count;
+    int i;
+
+    for(;;) {
+        start = __atomic_load_n(&ctrl->seq, __ATOMIC_ACQUIRE);
+        if(start & 1) {
+            sched_yield();
+            continue;
+        }
+        total = ctrl->count;
+        if(total > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+            continue;
+        }
+        count = total;
+        if(count > (uint32_t)max) {
+            /* keep the newest records when the caller has less room */
+            count = max;
+        }
+        for(i = 0; i < (int)count; i++) {
+            const volatile struct aesd_mmap_entry *entry = &ctrl->entry[total - count + i];
+            records[i].offset = entry->offset;
+            records[i].seq = entry->seq;
+            records[i].size = entry->size;
+            records[i].complete = (entry->flags & AESD_MMAP_ENTRY_COMPLETE) != 0;
+            records[i].buf = reader->data + (entry->offset & (reader->data_size - 1));
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&ctrl->seq, __ATOMIC_RELAXED) == start) {
+            return count;
+        }
+    }
+}
+
+bool aesd_mmap_reader_still_valid(const struct aesd_mmap_reader *reader,
+            const struct aesd_mmap_record *record)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&reader->ctrl->tail, __ATOMIC_RELAXED) <= record->offset;
+}
@@ -0,0 +1,63 @@
+/*
+ * aesd-mmap-reader.h
+ *
+ *  @brief Zero copy reader for the aesdchar mmap_ring mapping
+ */
+
+#ifndef AESD_MMAP_READER_H
+#define AESD_MMAP_READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "aesd_mmap.h"
+
+struct aesd_mmap_reader {
+    int fd;
+    void *map;
+    size_t map_len;
+    const volatile struct aesd_mmap_ctrl *ctrl;
+    /**
+     * Start of the data ring, mapped twice back to back
+     */
+    const char *data;
+    size_t data_size;
+};
+
+struct aesd_mmap_record {
+    /**
+     * Record contents inside the mapping, contiguous even when wrapped
+     */
+    const char *buf;
+    size_t size;
+    /**
+     * Absolute position of buf[0] since the device was created
+     */
+    uint64_t offset;
+    uint64_t seq;
+    bool complete;
+};
+
+/**
+ * Open and map @param device read only.
+ * @return 0 on success, -1 with errno set on failure
+ */
+extern int aesd_mmap_reader_open(struct aesd_mmap_reader *reader, const char *device);
+
+extern void aesd_mmap_reader_close(struct aesd_mmap_reader *reader);
+
+/**
+ * Take a consistent copy of the record table, oldest first.
+ * @return the number of records stored in @param records, at most @param max
+ */
+extern int aesd_mmap_reader_snapshot(struct aesd_mmap_reader *reader,
+            struct aesd_mmap_record *records, int max);
+
+/**
+ * Call after consuming @param record to check that the kernel did not
+ * overwrite its bytes while they were being read.
+ */
+extern bool aesd_mmap_reader_still_valid(const struct aesd_mmap_reader *reader,
+            const struct aesd_mmap_record *record);
+
+#endif /* AESD_MMAP_READER_H */
@@ -0,0 +1,532 @@
+/**
+ * @file aesdchar-cuse.c
+ * @brief /dev/aesdchar served from user space through CUSE
+ *
+ * Implements the read, write and ioctl behaviour of the aesdchar driver on
+ * top of aesd-circular-buffer.c and aesd_ioctl.h, so aesdsocket and the
+ * tools can be run and profiled on a machine where the module cannot be
+ * built or loaded.  Needs /dev/cuse (modprobe cuse) and libfuse3.
+ *
+ * Differences from the driver, all imposed by CUSE:
+ *  - lseek() and pread() do not reach the daemon, each open file keeps its
+ *    own position which moves with read() and the seek ioctls only
+ *  - no mmap, no poll, no splice
+ * Records are malloc'ed and the buffer is protected by a mutex, which is
+ * the driver's locking before it went lock-free for readers.
+ *
+ * usage: aesdchar-cuse [-n devname] [-f] [-s] [-d]
+ *   -n   name of the node created under /dev, aesdchar by default
+ *   -f   stay in the foreground, -s single threaded, -d debug
+ */
+
+#define FUSE_USE_VERSION 31
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <cuse_lowlevel.h>
+#include <fuse_opt.h>
+
+#include "aesd-circular-buffer.h"
+#include "aesd_ioctl.h"
+
+/* Largest reply a retried ioctl asks the kernel to copy out */
+#define IOCTL_OUT_MAX   (64 * 1024)
+
+struct aesd_cuse_dev {
+    pthread_mutex_t lock;
+    pthread_cond_t readq;     /* signalled each time a record is completed */
+    struct aesd_circular_buffer cbuffer;
+    int working_index;
+    off_t base_pos;           /* bytes evicted since the daemon started */
+    uint64_t record_seq;      /* records started since the daemon started */
+};
+
+struct aesd_cuse_file {
+    off_t pos;
+    bool stream;
+    bool nonblock;
+};
+
+static struct aesd_cuse_dev dev = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .readq = PTHREAD_COND_INITIALIZER,
+};
+
+static struct aesd_cuse_file *file_of(struct fuse_file_info *fi)
+{
+    return (struct aesd_cuse_file *)(uintptr_t)fi->fh;
+}
+
+static int entry_count(void)
+{
+    if(dev.cbuffer.full) {
+        return AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+    return (dev.cbuffer.in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - dev.cbuffer.out_offs)
+        % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+static bool working_partial(void)
+{
+    return dev.working_index != dev.cbuffer.in_offs;
+}
+
+/**
+ * @return bytes held, leaving out a record still waiting for its newline unless @param partial
+ * is set.  Caller holds dev.lock.
+ */
+static size_t buffered_size(bool partial)
+{
+    size_t total = 0;
+    int index = dev.cbuffer.out_offs;
+    int entries = entry_count();
+
+    if(!partial && working_partial()) {
+        entries--;
+    }
+    while(entries-- > 0) {
+        total += dev.cbuffer.entry[index].size;
+        index = (index+1)%AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+    return total;
+}
+
+/**
+ * Copy up to @param len bytes starting @param pos bytes after the oldest one, stopping at
+ * @param limit.  Caller holds dev.lock.
+ * @return bytes copied
+ */
+static size_t copy_out(char *dst, size_t pos, size_t len, size_t limit)
+{
+    struct aesd_buffer_entry *entry;
+    size_t entry_offset;
+    size_t copied = 0;
+    size_t n;
+
+    if(len > limit - pos) {
+        len = limit - pos;
+    }
+    while(copied < len) {
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(&dev.cbuffer, pos + copied, &entry_offset);
+        if(entry == NULL) {
+            break;
+        }
+        n = entry->size - entry_offset;
+        if(n > len - copied) {
+            n = len - copied;
+        }
+        memcpy(dst + copied, entry->buffptr + entry_offset, n);
+        copied += n;
+    }
+    return copied;
+}
+
+/**
+ * @return the position relative to the oldest entry of @param seekto, or -EINVAL if it is
+ * outside the buffered data.  Caller holds dev.lock.
+ */
+static off_t resolve_seekto(const struct aesd_seekto *seekto)
+{
+    off_t count = 0;
+    int index = dev.cbuffer.out_offs;
+    uint32_t cmd;
+
+    if(seekto->write_cmd >= (uint32_t)entry_count()) {
+        return -EINVAL;
+    }
+    for(cmd = 0; cmd < seekto->write_cmd; cmd++) {
+        count += dev.cbuffer.entry[index].size;
+        index = (index+1)%AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+    if(dev.cbuffer.entry[index].size < seekto->write_cmd_offset) {
+        return -EINVAL;
+    }
+    return count + seekto->write_cmd_offset;
+}
+
+static void aesd_cuse_open(fuse_req_t req, struct fuse_file_info *fi)
+{
+    struct aesd_cuse_file *file = calloc(1, sizeof(*file));
+
+    if(file == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    file->nonblock = (fi->flags & O_NONBLOCK) != 0;
+    fi->fh = (uintptr_t)file;
+    fi->direct_io = 1;
+    fi->nonseekable = 1;
+    fuse_reply_open(req, fi);
+}
+
+static void aesd_cuse_release(fuse_req_t req, struct fuse_file_info *fi)
+{
+    free(file_of(fi));
+    fuse_reply_err(req, 0);
+}
+
+/**
+ * Stream files wait here for a complete record at @param pos, polling for
+ * interrupts since a CUSE request cannot be woken by a signal directly.
+ * Caller holds dev.lock.
+ * @return 0 once data is there or a negative error
+ */
+static int wait_readable(fuse_req_t req, struct aesd_cuse_file *file, off_t pos)
+{
+    struct timespec deadline;
+
+    while((off_t)(dev.base_pos + buffered_size(false)) <= pos) {
+        if(file->nonblock) {
+            return -EAGAIN;
+        }
+        if(fuse_req_interrupted(req)) {
+            return -EINTR;
+        }
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100 * 1000 * 1000;
+        if(deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&dev.readq, &dev.lock, &deadline);
+    }
+    return 0;
+}
+
+static void aesd_cuse_read(fuse_req_t req, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct aesd_cuse_file *file = file_of(fi);
+    char *buf = malloc(size ? size : 1);
+    size_t copied = 0;
+    off_t base = 0;
+    off_t pos;
+    size_t limit;
+    int err;
+
+    (void)off;
+    if(buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    pthread_mutex_lock(&dev.lock);
+    if(file->stream) {
+        err = wait_readable(req, file, file->pos);
+        if(err) {
+            pthread_mutex_unlock(&dev.lock);
+            free(buf);
+            fuse_reply_err(req, -err);
+            return;
+        }
+        /* a reader which fell behind eviction resumes at the oldest record */
+        base = dev.base_pos;
+        pos = (file->pos > base) ? file->pos - base : 0;
+        limit = buffered_size(false);
+    } else {
+        pos = file->pos;
+        limit = buffered_size(true);
+    }
+    if((size_t)pos < limit) {
+        copied = copy_out(buf, pos, size, limit);
+    }
+    file->pos = base + pos + copied;
+    pthread_mutex_unlock(&dev.lock);
+
+    fuse_reply_buf(req, buf, copied);
+    free(buf);
+}
+
+/**
+ * Append to the partial record or start a new one, evicting the oldest when the buffer
+ * is full.  Caller holds dev.lock.
+ * @return 0 or a negative error
+ */
+static int store(const char *buf, size_t size)
+{
+    struct aesd_buffer_entry *working_entry;
+    struct aesd_buffer_entry new_entry;
+    const char *old;
+    char *record;
+
+    if(working_partial()) {
+        working_entry = &dev.cbuffer.entry[dev.working_index];
+        record = realloc((char *)working_entry->buffptr, working_entry->size + size);
+        if(record == NULL) {
+            return -ENOMEM;
+        }
+        memcpy(record + working_entry->size, buf, size);
+        working_entry->buffptr = record;
+        working_entry->size += size;
+        return 0;
+    }
+
+    record = malloc(size);
+    if(record == NULL) {
+        return -ENOMEM;
+    }
+    memcpy(record, buf, size);
+    new_entry.buffptr = record;
+    new_entry.size = size;
+    if(dev.cbuffer.full) {
+        dev.base_pos += dev.cbuffer.entry[dev.cbuffer.in_offs].size;
+    }
+    old = aesd_circular_buffer_add_entry(&dev.cbuffer, &new_entry);
+    free((char *)old);
+    dev.record_seq++;
+    return 0;
+}
+
+static void aesd_cuse_write(fuse_req_t req, const char *buf, size_t size, off_t off,
+        struct fuse_file_info *fi)
+{
+    struct aesd_buffer_entry *working_entry;
+    int err = 0;
+
+    (void)off;
+    (void)fi;
+    if(size == 0) {
+        fuse_reply_write(req, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&dev.lock);
+    err = store(buf, size);
+    if(err == 0) {
+        working_entry = &dev.cbuffer.entry[dev.working_index];
+        if(working_entry->buffptr[working_entry->size-1] == '\n') {
+            dev.working_index = dev.cbuffer.in_offs;
+            pthread_cond_broadcast(&dev.readq);
+        }
+    }
+    pthread_mutex_unlock(&dev.lock);
+
+    if(err) {
+        fuse_reply_err(req, -err);
+    } else {
+        fuse_reply_write(req, size);
+    }
+}
+
+static void ioctl_seekto(fuse_req_t req, struct aesd_cuse_file *file, const struct aesd_seekto *seekto)
+{
+    off_t pos;
+
+    pthread_mutex_lock(&dev.lock);
+    pos = resolve_seekto(seekto);
+    if(pos >= 0) {
+        file->pos = file->stream ? dev.base_pos + pos : pos;
+    }
+    pthread_mutex_unlock(&dev.lock);
+
+    if(pos < 0) {
+        fuse_reply_err(req, -pos);
+    } else {
+        fuse_reply_ioctl(req, 0, NULL, 0);
+    }
+}
+
+static void ioctl_seekread(fuse_req_t req, struct aesd_cuse_file *file, const struct aesd_seekread *sr)
+{
+    struct aesd_seekto seekto = {
+        .write_cmd = sr->write_cmd,
+        .write_cmd_offset = sr->write_cmd_offset,
+    };
+    size_t len = sr->len < IOCTL_OUT_MAX ? sr->len : IOCTL_OUT_MAX;
+    char *buf = malloc(len ? len : 1);
+    size_t copied = 0;
+    off_t pos;
+
+    if(buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    pthread_mutex_lock(&dev.lock);
+    pos = resolve_seekto(&seekto);
+    if(pos >= 0) {
+        copied = copy_out(buf, pos, len, buffered_size(true));
+        file->pos = pos + copied + (file->stream ? dev.base_pos : 0);
+    }
+    pthread_mutex_unlock(&dev.lock);
+
+    if(pos < 0) {
+        fuse_reply_err(req, -pos);
+    } else {
+        fuse_reply_ioctl(req, copied, buf, copied);
+    }
+    free(buf);
+}
+
+static void ioctl_records(fuse_req_t req, const struct aesd_records *in, uint32_t max)
+{
+    struct aesd_records out = *in;
+    struct aesd_record_info *info = calloc(max ? max : 1, sizeof(*info));
+    struct iovec iov[2];
+    uint64_t start = 0;
+    int entries;
+    int index;
+    int i;
+
+    if(info == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    pthread_mutex_lock(&dev.lock);
+    entries = entry_count();
+    index = dev.cbuffer.out_offs;
+    out.count = 0;
+    for(i = 0; i < entries && out.count < max; i++) {
+        info[i].start = start;
+        info[i].seq = dev.record_seq - entries + i;
+        info[i].size = dev.cbuffer.entry[index].size;
+        info[i].flags = (working_partial() && i == entries - 1) ? 0 : AESD_RECORD_COMPLETE;
+        start += info[i].size;
+        index = (index+1)%AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        out.count++;
+    }
+    out.base = dev.base_pos;
+    pthread_mutex_unlock(&dev.lock);
+
+    iov[0].iov_base = &out;
+    iov[0].iov_len = sizeof(out);
+    iov[1].iov_base = info;
+    iov[1].iov_len = out.count * sizeof(*info);
+    fuse_reply_ioctl_iov(req, out.count, iov, 2);
+    free(info);
+}
+
+/**
+ * The daemon runs with unrestricted ioctls since SEEKREAD and RECORDS carry
+ * pointers.  Each command is first retried to fetch its argument, and for
+ * those two again to map the buffer the argument points at.
+ */
+static void aesd_cuse_ioctl(fuse_req_t req, int ioctl_cmd, void *arg, struct fuse_file_info *fi,
+        unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz)
+{
+    unsigned int cmd = ioctl_cmd;
+    struct aesd_cuse_file *file = file_of(fi);
+    struct iovec in_iov;
+    struct iovec out_iov[2];
+    const struct aesd_seekread *sr;
+    const struct aesd_records *recs;
+    uint32_t max;
+
+    if(flags & FUSE_IOCTL_COMPAT) {
+        fuse_reply_err(req, ENOSYS);
+        return;
+    }
+    if(_IOC_TYPE(cmd) != AESD_IOC_MAGIC || _IOC_NR(cmd) > AESDCHAR_IOC_MAXNR) {
+        fuse_reply_err(req, ENOTTY);
+        return;
+    }
+
+    in_iov.iov_base = arg;
+    in_iov.iov_len = _IOC_SIZE(cmd);
+    if(in_bufsz < in_iov.iov_len) {
+        fuse_reply_ioctl_retry(req, &in_iov, 1, NULL, 0);
+        return;
+    }
+
+    switch(cmd) {
+        case AESDCHAR_IOCSEEKTO:
+            ioctl_seekto(req, file, in_buf);
+            break;
+
+        case AESDCHAR_IOCSTREAM:
+            pthread_mutex_lock(&dev.lock);
+            /* keep pointing at the same byte when switching between relative and absolute positions */
+            if(*(const uint32_t *)in_buf && !file->stream) {
+                file->pos += dev.base_pos;
+            } else if(!*(const uint32_t *)in_buf && file->stream) {
+                file->pos = (file->pos > dev.base_pos) ? file->pos - dev.base_pos : 0;
+            }
+            file->stream = *(const uint32_t *)in_buf != 0;
+            pthread_mutex_unlock(&dev.lock);
+            fuse_reply_ioctl(req, 0, NULL, 0);
+            break;
+
+        case AESDCHAR_IOCSEEKREAD:
+            sr = in_buf;
+            out_iov[0].iov_base = (void *)(uintptr_t)sr->buf;
+            out_iov[0].iov_len = sr->len < IOCTL_OUT_MAX ? sr->len : IOCTL_OUT_MAX;
+            if(out_iov[0].iov_len > 0 && out_bufsz == 0) {
+                fuse_reply_ioctl_retry(req, &in_iov, 1, out_iov, 1);
+                return;
+            }
+            ioctl_seekread(req, file, sr);
+            break;
+
+        case AESDCHAR_IOCRECORDS:
+            recs = in_buf;
+            max = recs->max;
+            if(max > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+                max = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+            }
+            out_iov[0].iov_base = arg;
+            out_iov[0].iov_len = sizeof(*recs);
+            out_iov[1].iov_base = (void *)(uintptr_t)recs->records;
+            out_iov[1].iov_len = max * sizeof(struct aesd_record_info);
+            if(out_bufsz == 0) {
+                fuse_reply_ioctl_retry(req, &in_iov, 1, out_iov, max ? 2 : 1);
+                return;
+            }
+            ioctl_records(req, recs, max);
+            break;
+
+        default:
+            fuse_reply_err(req, ENOTTY);
+            break;
+    }
+}
+
+static const struct cuse_lowlevel_ops aesd_cuse_ops = {
+    .open =     aesd_cuse_open,
+    .read =     aesd_cuse_read,
+    .write =    aesd_cuse_write,
+    .release =  aesd_cuse_release,
+    .ioctl =    aesd_cuse_ioctl,
+};
+
+struct aesd_cuse_opts {
+    char *dev_name;
+};
+
+static const struct fuse_opt aesd_cuse_opt_spec[] = {
+    { "-n %s", offsetof(struct aesd_cuse_opts, dev_name), 0 },
+    { "--name=%s", offsetof(struct aesd_cuse_opts, dev_name), 0 },
+    FUSE_OPT_END
+};
+
+int main(int argc, char *argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct aesd_cuse_opts opts = { 0 };
+    struct cuse_info ci;
+    char dev_name[128];
+    const char *dev_info_argv[] = { dev_name };
+    int ret;
+
+    if(fuse_opt_parse(&args, &opts, aesd_cuse_opt_spec, NULL) != 0) {
+        return 1;
+    }
+    snprintf(dev_name, sizeof(dev_name), "DEVNAME=%s", opts.dev_name ? opts.dev_name : "aesdchar");
+
+    aesd_circular_buffer_init(&dev.cbuffer);
+
+    memset(&ci, 0, sizeof(ci));
+    ci.dev_info_argc = 1;
+    ci.dev_info_argv = dev_info_argv;
+    ci.flags = CUSE_UNRESTRICTED_IOCTL;
+
+    ret = cuse_lowlevel_main(args.argc, args.argv, &ci, &aesd_cuse_ops, NULL);
+    fuse_opt_free_args(&args);
+    free(opts.dev_name);
+    return ret;
+}
@@ -0,0 +1,154 @@
+/**
+ * @file aesdchar-readbench.c
+ * @brief Multi-reader throughput benchmark for /dev/aesdchar
+ *
+ * Forks N reader processes which repeatedly open and read the whole device
+ * while a single writer process keeps appending records.  Run it once for
+ * each reader count to check that read throughput scales with cores.
+ *
+ * usage: aesdchar-readbench [-d device] [-r readers] [-s seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define DEFAULT_DEVICE  "/dev/aesdchar"
+#define BUF_SIZE        1024
+
+struct reader_stats {
+    unsigned long long reads;
+    unsigned long long bytes;
+};
+
+static volatile sig_atomic_t stop = 0;
+
+static void stop_handler(int signal_number)
+{
+    stop = 1;
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run_reader(const char *device, struct reader_stats *stats)
+{
+    char buf[BUF_SIZE];
+    while(!stop) {
+        ssize_t len;
+        int fd = open(device, O_RDONLY);
+        if(fd == -1) {
+            perror("open reader");
+            exit(1);
+        }
+        while((len = read(fd, buf, sizeof(buf))) > 0) {
+            stats->bytes += len;
+        }
+        close(fd);
+        stats->reads++;
+    }
+    exit(0);
+}
+
+static void run_writer(const char *device)
+{
+    static const char line[] = "aesdchar-readbench record\n";
+    int fd = open(device, O_WRONLY);
+    if(fd == -1) {
+        perror("open writer");
+        exit(1);
+    }
+    while(!stop) {
+        if(write(fd, line, sizeof(line) - 1) == -1) {
+            perror("write");
+            exit(1);
+        }
+    }
+    close(fd);
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *device = DEFAULT_DEVICE;
+    int readers = 1;
+    int seconds = 5;
+    int opt;
+    int i;
+
+    while((opt = getopt(argc, argv, "d:r:s:")) != -1) {
+        switch(opt) {
+            case 'd': device = optarg; break;
+            case 'r': readers = atoi(optarg); break;
+            case 's': seconds = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-d device] [-r readers] [-s seconds]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(readers < 1 || seconds < 1) {
+        fprintf(stderr, "readers and seconds must be positive\n");
+        return 1;
+    }
+
+    struct reader_stats *stats = mmap(NULL, sizeof(*stats) * readers, PROT_READ | PROT_WRITE,
+                                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(stats == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    memset(stats, 0, sizeof(*stats) * readers);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_handler;
+    sigaction(SIGTERM, &action, NULL);
+
+    pid_t pids[readers + 1];
+    for(i = 0; i <= readers; i++) {
+        pids[i] = fork();
+        if(pids[i] == -1) {
+            perror("fork");
+            return 1;
+        }
+        if(pids[i] == 0) {
+            if(i == readers) {
+                run_writer(device);
+            }
+            run_reader(device, &stats[i]);
+        }
+    }
+
+    double start = now_sec();
+    sleep(seconds);
+    for(i = 0; i <= readers; i++) {
+        kill(pids[i], SIGTERM);
+    }
+    for(i = 0; i <= readers; i++) {
+        waitpid(pids[i], NULL, 0);
+    }
+    double elapsed = now_sec() - start;
+
+    unsigned long long total_reads = 0;
+    unsigned long long total_bytes = 0;
+    for(i = 0; i < readers; i++) {
+        total_reads += stats[i].reads;
+        total_bytes += stats[i].bytes;
+    }
+    printf("readers=%d passes/s=%.0f MB/s=%.2f\n", readers,
+           total_reads / elapsed, total_bytes / elapsed / 1e6);
+
+    munmap(stats, sizeof(*stats) * readers);
+    return 0;
+}
@@ -0,0 +1,134 @@
+/**
+ * @file aesdchar-sendbench.c
+ * @brief Compare read()/send() against sendfile() for streaming a file to TCP
+ *
+ * Streams the whole of the given file (by default /dev/aesdchar) to a
+ * loopback TCP connection again and again, once with the read()/send() loop
+ * aesdsocket used to reply with and once with sendfile(), and reports the
+ * throughput of each.  A child process drains the other end.
+ *
+ * usage: aesdchar-sendbench [-d file] [-s seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/wait.h>
+
+#define DEFAULT_DEVICE  "/dev/aesdchar"
+#define BUF_SIZE        1024
+#define SENDFILE_CHUNK  (1024 * 1024)
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @return a connected loopback socket whose peer is drained by a child, whose pid is
+ * stored in @param drainer
+ */
+static int connect_drainer(pid_t *drainer)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int ld = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(ld == -1 || bind(ld, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(ld, 1) != 0 || getsockname(ld, (struct sockaddr *)&addr, &len) != 0) {
+        perror("listen");
+        exit(1);
+    }
+    fflush(stdout);
+    *drainer = fork();
+    if(*drainer == 0) {
+        static char sink[1 << 16];
+        int cd = accept(ld, NULL, NULL);
+        while(read(cd, sink, sizeof(sink)) > 0);
+        _exit(0);
+    }
+    close(ld);
+    int sd = socket(AF_INET, SOCK_STREAM, 0);
+    if(sd == -1 || connect(sd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("connect");
+        exit(1);
+    }
+    return sd;
+}
+
+static double run(const char *path, int seconds, int use_sendfile)
+{
+    char buf[BUF_SIZE];
+    unsigned long long bytes = 0;
+    pid_t drainer;
+    int sd = connect_drainer(&drainer);
+    double start = now_sec();
+    double elapsed;
+
+    do {
+        int fd = open(path, O_RDONLY);
+        ssize_t len;
+        if(fd == -1) {
+            perror("open");
+            exit(1);
+        }
+        if(use_sendfile) {
+            while((len = sendfile(sd, fd, NULL, SENDFILE_CHUNK)) > 0) {
+                bytes += len;
+            }
+        } else {
+            while((len = read(fd, buf, sizeof(buf))) > 0) {
+                if(send(sd, buf, len, 0) != len) {
+                    perror("send");
+                    exit(1);
+                }
+                bytes += len;
+            }
+        }
+        if(len == -1) {
+            perror(use_sendfile ? "sendfile" : "read");
+            exit(1);
+        }
+        close(fd);
+        elapsed = now_sec() - start;
+    } while(elapsed < seconds);
+
+    close(sd);
+    waitpid(drainer, NULL, 0);
+    return bytes / elapsed / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = DEFAULT_DEVICE;
+    int seconds = 3;
+    int opt;
+
+    while((opt = getopt(argc, argv, "d:s:")) != -1) {
+        switch(opt) {
+            case 'd': path = optarg; break;
+            case 's': seconds = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-d file] [-s seconds]\n", argv[0]);
+                return 1;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("read_send MB/s=%.1f\n", run(path, seconds, 0));
+    printf("sendfile  MB/s=%.1f\n", run(path, seconds, 1));
+    return 0;
+}
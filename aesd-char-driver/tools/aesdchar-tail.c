@@ -0,0 +1,88 @@
+/**
+ * @file aesdchar-tail.c
+ * @brief Follow /dev/aesdchar like tail -f
+ *
+ * Switches the file to streaming reads with AESDCHAR_IOCSTREAM and copies
+ * every completed record to stdout.  With -e the device is opened
+ * O_NONBLOCK and waited on through epoll instead of a blocking read().
+ *
+ * usage: aesdchar-tail [-d device] [-e]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include "aesd_ioctl.h"
+
+#define DEFAULT_DEVICE  "/dev/aesdchar"
+#define BUF_SIZE        1024
+
+int main(int argc, char *argv[])
+{
+    const char *device = DEFAULT_DEVICE;
+    bool use_epoll = false;
+    char buf[BUF_SIZE];
+    int opt;
+
+    while((opt = getopt(argc, argv, "d:e")) != -1) {
+        switch(opt) {
+            case 'd': device = optarg; break;
+            case 'e': use_epoll = true; break;
+            default:
+                fprintf(stderr, "usage: %s [-d device] [-e]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    int fd = open(device, O_RDONLY | (use_epoll ? O_NONBLOCK : 0));
+    if(fd == -1) {
+        perror("open");
+        return 1;
+    }
+    uint32_t stream = 1;
+    if(ioctl(fd, AESDCHAR_IOCSTREAM, &stream) != 0) {
+        perror("AESDCHAR_IOCSTREAM");
+        return 1;
+    }
+
+    int ep = -1;
+    if(use_epoll) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+        ep = epoll_create1(0);
+        if(ep == -1 || epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            perror("epoll");
+            return 1;
+        }
+    }
+
+    while(true) {
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if(len > 0) {
+            if(fwrite(buf, 1, len, stdout) != (size_t)len) {
+                return 1;
+            }
+            fflush(stdout);
+        } else if(len == -1 && errno == EAGAIN && ep != -1) {
+            struct epoll_event ev;
+            if(epoll_wait(ep, &ev, 1, -1) == -1 && errno != EINTR) {
+                perror("epoll_wait");
+                return 1;
+            }
+        } else if(len == -1 && errno == EINTR) {
+            continue;
+        } else {
+            if(len == -1) {
+                perror("read");
+            }
+            break;
+        }
+    }
+
+    close(fd);
+    return 0;
+}
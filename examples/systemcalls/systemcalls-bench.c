@@ -0,0 +1,162 @@
+/**
+ * @file systemcalls-bench.c
+ * @brief Launch latency of do_exec() against fork() + execv() as the parent grows
+ *
+ * For each parent size the memory is allocated and touched, so it is really
+ * resident, then /bin/true is launched the requested number of times both
+ * ways.  fork() copies the page tables of the whole parent, posix_spawn()
+ * does not, so only the fork column should grow with the parent.
+ *
+ * With -j the launches instead go through do_exec_many() with 1, 2, 4 ...
+ * up to max_parallel children at a time.
+ *
+ * usage: systemcalls-bench [-n launches] [-m max_megabytes] [-j max_parallel]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "systemcalls.h"
+
+static const long sizes_mb[] = { 10, 100, 1024, 4096 };
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* how do_exec() launched commands before it used posix_spawn */
+static bool fork_exec(char *command[])
+{
+    int status;
+    pid_t pid = fork();
+    if(pid == -1){
+        return false;
+    }
+    if(pid == 0){
+        execv(command[0], command);
+        _exit(1);
+    }
+    return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static int bench_many(char *command[], int launches, unsigned int max_parallel)
+{
+    struct exec_job *jobs = calloc(launches, sizeof(*jobs));
+    unsigned int parallel;
+    int n;
+
+    if(jobs == NULL){
+        return 1;
+    }
+    for(n = 0; n < launches; n++){
+        jobs[n].argv = command;
+    }
+    printf("parallel,seconds\n");
+    for(parallel = 1; ; parallel *= 2){
+        if(parallel > max_parallel){
+            parallel = max_parallel;
+        }
+        double t0 = now_us();
+        if(!do_exec_many(jobs, launches, parallel)){
+            fprintf(stderr, "do_exec_many failed\n");
+            free(jobs);
+            return 1;
+        }
+        printf("%u,%.3f\n", parallel, (now_us() - t0) / 1e6);
+        fflush(stdout);
+        if(parallel == max_parallel){
+            break;
+        }
+    }
+    free(jobs);
+    return 0;
+}
+
+static long available_mb(void)
+{
+    char line[128];
+    long kb = -1;
+    FILE *f = fopen("/proc/meminfo", "r");
+    if(f == NULL){
+        return -1;
+    }
+    while(fgets(line, sizeof(line), f) != NULL){
+        if(sscanf(line, "MemAvailable: %ld kB", &kb) == 1){
+            break;
+        }
+    }
+    fclose(f);
+    return kb < 0 ? -1 : kb / 1024;
+}
+
+int main(int argc, char *argv[])
+{
+    char *command[] = { "/bin/true", NULL };
+    long max_mb = 4096;
+    unsigned int max_parallel = 0;
+    int launches = 200;
+    size_t i;
+    int opt;
+    int n;
+
+    while((opt = getopt(argc, argv, "n:m:j:")) != -1){
+        switch(opt){
+            case 'n': launches = atoi(optarg); break;
+            case 'm': max_mb = atol(optarg); break;
+            case 'j': max_parallel = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n launches] [-m max_megabytes] [-j max_parallel]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(launches < 1){
+        fprintf(stderr, "usage: %s [-n launches] [-m max_megabytes] [-j max_parallel]\n", argv[0]);
+        return 1;
+    }
+    if(max_parallel > 0){
+        return bench_many(command, launches, max_parallel);
+    }
+
+    printf("parent_mb,method,us_per_launch\n");
+    for(i = 0; i < sizeof(sizes_mb) / sizeof(sizes_mb[0]) && sizes_mb[i] <= max_mb; i++){
+        long avail = available_mb();
+        if(avail >= 0 && sizes_mb[i] > avail * 3 / 4){
+            fprintf(stderr, "skipping %ld MB, only %ld MB available\n", sizes_mb[i], avail);
+            break;
+        }
+        char *ballast = malloc(sizes_mb[i] << 20);
+        if(ballast == NULL){
+            fprintf(stderr, "skipping %ld MB, allocation failed\n", sizes_mb[i]);
+            break;
+        }
+        memset(ballast, 1, sizes_mb[i] << 20);
+
+        double t0 = now_us();
+        for(n = 0; n < launches; n++){
+            if(!fork_exec(command)){
+                fprintf(stderr, "fork + execv failed\n");
+                return 1;
+            }
+        }
+        double t1 = now_us();
+        for(n = 0; n < launches; n++){
+            if(!do_exec(1, command[0])){
+                fprintf(stderr, "do_exec failed\n");
+                return 1;
+            }
+        }
+        double t2 = now_us();
+        printf("%ld,fork,%.1f\n", sizes_mb[i], (t1 - t0) / launches);
+        printf("%ld,posix_spawn,%.1f\n", sizes_mb[i], (t2 - t1) / launches);
+        fflush(stdout);
+        free(ballast);
+    }
+    return 0;
+}
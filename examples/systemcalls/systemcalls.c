@@ -1,9 +1,108 @@
+#define _GNU_SOURCE
 #include "systemcalls.h"
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 
+extern char **environ;
+
+/**
+ * Launch @param command with posix_spawn, stdout going to @param outputfile
+ * if set, else to @param stdout_fd if not -1, with @param sigmask as signal
+ * mask if not NULL.  posix_spawn runs the child on the parent's memory until
+ * it execs, so launching costs the same whatever the size of the parent,
+ * unlike fork which copies its page tables.
+ * @return true if the child was started
+ */
+static bool spawn(pid_t *pid, char *command[], const char *outputfile, int stdout_fd, const sigset_t *sigmask)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_t *file_actions = NULL;
+    posix_spawnattr_t attr;
+    posix_spawnattr_t *attrp = NULL;
+    int rc = 0;
+
+    if(outputfile != NULL || stdout_fd != -1) {
+        posix_spawn_file_actions_init(&actions);
+        if(outputfile != NULL){
+            rc = posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, outputfile,
+                                                  O_WRONLY|O_TRUNC|O_CREAT, 0644);
+        }
+        else{
+            rc = posix_spawn_file_actions_adddup2(&actions, stdout_fd, STDOUT_FILENO);
+        }
+        if(rc != 0){
+            errno = rc;
+            perror("redirect outputfile error");
+            posix_spawn_file_actions_destroy(&actions);
+            return false;
+        }
+        file_actions = &actions;
+    }
+    if(sigmask != NULL){
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setsigmask(&attr, sigmask);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+        attrp = &attr;
+    }
+    rc = posix_spawn(pid, command[0], file_actions, attrp, command, environ);
+    if(file_actions != NULL) {
+        posix_spawn_file_actions_destroy(file_actions);
+    }
+    if(attrp != NULL){
+        posix_spawnattr_destroy(attrp);
+    }
+    if(rc != 0){
+        errno = rc;
+        perror("posix_spawn error");
+        return false;
+    }
+    return true;
+}
+
+static bool exit_success(int status)
+{
+    if(!WIFEXITED(status)){
+        fprintf(stderr, "child exit error\n");
+        return false;
+    }
+    if(WEXITSTATUS(status) != 0){
+        fprintf(stderr, "child exited without success\n");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Launch @param command, stdout going to @param outputfile unless it is
+ * NULL, and wait for that child only.
+ * @return true if the command ran and exited with status 0
+ */
+static bool spawn_and_wait(char *command[], const char *outputfile)
+{
+    pid_t pid;
+    int status;
+
+    if(!spawn(&pid, command, outputfile, -1, NULL)){
+        return false;
+    }
+    while(waitpid(pid, &status, 0) == -1){
+        if(errno != EINTR){
+            perror("waitpid error");
+            return false;
+        }
+    }
+    return exit_success(status);
+}
+
 /**
  * @param cmd the command to execute with system()
  * @return true if the command in @param cmd was executed
@@ -48,8 +147,8 @@ bool do_system(const char *cmd)
 *   The first is always the full path to the command to execute with execv()
 *   The remaining arguments are a list of arguments to pass to the command in execv()
 * @return true if the command @param ... with arguments @param arguments were executed successfully
-*   using the execv() call, false if an error occurred, either in invocation of the
-*   fork, waitpid, or execv() command, or if a non-zero return value was returned
+*   using posix_spawn(), false if an error occurred, either in invocation of the
+*   posix_spawn() or waitpid() call, or if a non-zero return value was returned
 *   by the command issued in @param arguments with the specified arguments.
 */
 
@@ -64,51 +163,9 @@ bool do_exec(int count, ...)
         command[i] = va_arg(args, char *);
     }
     command[count] = NULL;
-    // this line is to avoid a compile warning before your implementation is complete
-    // and may be removed
-    command[count] = command[count];
-
-/*
- * TODO:
- *   Execute a system command by calling fork, execv(),
- *   and wait instead of system (see LSP page 161).
- *   Use the command[0] as the full path to the command to execute
- *   (first argument to execv), and use the remaining arguments
- *   as second argument to the execv() command.
- *
-*/
-    pid_t pid = fork();
-    if(pid == -1){
-        perror("fork error");
-        return false;
-    }
-    else if(pid == 0){ //child
-        execv(command[0], command);
-        perror("execv error");
-        exit(1);
-    }
-    else{ //parent
-        int status;
-        pid_t w = wait(&status);
-        if(w == -1){
-            perror("wait error");
-            return false;
-        }
-        if(WIFEXITED(status)){
-            if(WEXITSTATUS(status) != 0){
-                perror("child exited without success");
-                return false;
-            }
-        }
-        else{
-            perror("child exit error");
-            return false;
-        }
-    }
-
     va_end(args);
 
-    return true;
+    return spawn_and_wait(command, NULL);
 }
 
 /**
@@ -127,53 +184,356 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
         command[i] = va_arg(args, char *);
     }
     command[count] = NULL;
-    // this line is to avoid a compile warning before your implementation is complete
-    // and may be removed
-    command[count] = command[count];
+    va_end(args);
 
+    return spawn_and_wait(command, outputfile);
+}
 
-/*
- * TODO
- *   Call execv, but first using https://stackoverflow.com/a/13784315/1446624 as a refernce,
- *   redirect standard out to a file specified by outputfile.
- *   The rest of the behaviour is same as do_exec()
- *
-*/
-    pid_t pid = fork();
-    if(pid == -1){
-        perror("fork error");
-        return false;
+#define EXEC_READ_SIZE  (64 * 1024)
+#define EXEC_MAX_EVENTS 64
+#define EXEC_SIGCHLD    UINT64_MAX  /* epoll data of the signalfd, no job index */
+/* how often children without pidfd are looked at anyway, SIGCHLD may go to another thread */
+#define EXEC_SWEEP_MS   100
+
+/* what an epoll event of do_exec_many() is about, packed with the job index */
+enum exec_event {
+    EXEC_EXITED,
+    EXEC_OUTPUT,
+};
+
+struct exec_slot {
+    pid_t pid;
+    int pidfd;          /* readable once the child exited, -1 when reaped */
+    int pipe_rd;        /* child stdout, -1 once drained or if not captured */
+    int out_fd;         /* outputfile, spliced into from pipe_rd */
+    size_t cap;         /* allocated size of the job output */
+    int error;          /* errno of the output going astray, the job fails */
+    bool exited;
+};
+
+/* SIGCHLD through a signalfd, for children that got no pidfd */
+struct exec_sigchld {
+    int fd;             /* -1 until a child has no pidfd */
+    sigset_t oldmask;   /* the caller's, restored in later children and on return */
+};
+
+static int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int watch(int epfd, int fd, size_t index, enum exec_event event)
+{
+    struct epoll_event ev = {
+        .events = EPOLLIN,
+        .data.u64 = (uint64_t)index << 1 | event,
+    };
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void close_fd(int epfd, int *fd)
+{
+    if(*fd != -1){
+        epoll_ctl(epfd, EPOLL_CTL_DEL, *fd, NULL);
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+/**
+ * Block SIGCHLD in the calling thread and watch it through a signalfd in
+ * @param epfd.  A child that exited before this is found by the next
+ * finished() call, the ones after leave the signal pending.
+ * @return 0, or -1 if the children without pidfd have to be waited for
+ */
+static int watch_sigchld(int epfd, struct exec_sigchld *sigchld)
+{
+    struct epoll_event ev = {
+        .events = EPOLLIN,
+        .data.u64 = EXEC_SIGCHLD,
+    };
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if(pthread_sigmask(SIG_BLOCK, &mask, &sigchld->oldmask) != 0){
+        return -1;
+    }
+    sigchld->fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if(sigchld->fd != -1 && epoll_ctl(epfd, EPOLL_CTL_ADD, sigchld->fd, &ev) == -1){
+        close(sigchld->fd);
+        sigchld->fd = -1;
+    }
+    if(sigchld->fd == -1){
+        pthread_sigmask(SIG_SETMASK, &sigchld->oldmask, NULL);
+        return -1;
     }
-    else if(pid == 0){ //child
-        int fd = open(outputfile, O_WRONLY|O_TRUNC|O_CREAT, 0644);
-        if(fd < 0){
+    return 0;
+}
+
+static void unwatch_sigchld(int epfd, struct exec_sigchld *sigchld)
+{
+    if(sigchld->fd != -1){
+        close_fd(epfd, &sigchld->fd);
+        pthread_sigmask(SIG_SETMASK, &sigchld->oldmask, NULL);
+    }
+}
+
+/**
+ * Start @param job, its stdout going through a pipe if it is captured
+ * @return true if the child was started
+ */
+static bool launch(int epfd, struct exec_job *job, struct exec_slot *slot, size_t index,
+                   struct exec_sigchld *sigchld)
+{
+    int pipefd[2] = { -1, -1 };
+    bool piped = job->outputfile != NULL || job->capture;
+
+    slot->pidfd = slot->pipe_rd = slot->out_fd = -1;
+    if(job->outputfile != NULL){
+        slot->out_fd = open(job->outputfile, O_WRONLY|O_TRUNC|O_CREAT|O_CLOEXEC, 0644);
+        if(slot->out_fd == -1){
             perror("open outputfile error");
             return false;
         }
-        if(dup2(fd, 1) < 0){
-            perror("dup2 stdout error");
-            close(fd);
-            return false;
-        }
-        execv(command[0], command);
-        close(fd);
-        perror("execv error");
-        exit(1);
     }
-    else{ //parent
-        int status;
-        pid_t w = wait(&status);
-        if(w == -1){
-            perror("wait error");
-            return false;
+    /* close on exec, so each child only inherits its own pipe as stdout */
+    if(piped && pipe2(pipefd, O_CLOEXEC) == -1){
+        perror("pipe error");
+        close_fd(epfd, &slot->out_fd);
+        return false;
+    }
+    bool started = spawn(&slot->pid, job->argv, NULL, pipefd[1],
+                         sigchld->fd != -1 ? &sigchld->oldmask : NULL);
+    if(piped){
+        close(pipefd[1]);
+        slot->pipe_rd = pipefd[0];
+    }
+    if(!started){
+        close_fd(epfd, &slot->pipe_rd);
+        close_fd(epfd, &slot->out_fd);
+        return false;
+    }
+    if(piped){
+        fcntl(slot->pipe_rd, F_SETFL, O_NONBLOCK);
+        watch(epfd, slot->pipe_rd, index, EXEC_OUTPUT);
+    }
+    /* without pidfd the child is reaped on SIGCHLD, or with a blocking waitpid if that fails too */
+    slot->pidfd = open_pidfd(slot->pid);
+    if(slot->pidfd != -1 && watch(epfd, slot->pidfd, index, EXEC_EXITED) == -1){
+        close_fd(epfd, &slot->pidfd);
+    }
+    if(slot->pidfd == -1 && sigchld->fd == -1){
+        watch_sigchld(epfd, sigchld);
+    }
+    return true;
+}
+
+/**
+ * Move what the child wrote so far to the job output.  An outputfile is
+ * fed with splice, so the data never comes up to user space.
+ * @return true once the child closed its stdout
+ */
+static bool drain(struct exec_job *job, struct exec_slot *slot)
+{
+    ssize_t len;
+
+    for(;;){
+        if(job->outputfile != NULL){
+            len = splice(slot->pipe_rd, NULL, slot->out_fd, NULL, EXEC_READ_SIZE,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if(len == -1 && errno == EINVAL){
+                /* file system without splice support, copy instead */
+                char buf[EXEC_READ_SIZE];
+                len = read(slot->pipe_rd, buf, sizeof(buf));
+                if(len > 0 && write(slot->out_fd, buf, len) != len){
+                    slot->error = errno;
+                    return true;
+                }
+            }
         }
-        if(WEXITSTATUS(status) != 0){
-            perror("child exited without success");
-            return false;
+        else{
+            if(slot->cap - job->output_len < EXEC_READ_SIZE + 1){
+                size_t cap = slot->cap ? slot->cap * 2 : 2 * EXEC_READ_SIZE;
+                char *output = realloc(job->output, cap);
+                if(output == NULL){
+                    slot->error = ENOMEM;
+                    return true;
+                }
+                job->output = output;
+                slot->cap = cap;
+            }
+            len = read(slot->pipe_rd, job->output + job->output_len, EXEC_READ_SIZE);
+            if(len > 0){
+                job->output[job->output_len + len] = '\0';
+            }
+        }
+        if(len > 0){
+            job->output_len += len;
+            continue;
+        }
+        if(len == -1 && errno == EINTR){
+            continue;
+        }
+        if(len == -1 && errno != EAGAIN){
+            slot->error = errno;
         }
+        return !(len == -1 && errno == EAGAIN);
     }
+}
 
-    va_end(args);
+/**
+ * @return true once @param job exited and its output is drained
+ */
+static bool finished(struct exec_job *job, struct exec_slot *slot, struct exec_sigchld *sigchld)
+{
+    pid_t rc;
 
-    return true;
+    if(!slot->exited && slot->pidfd == -1 && sigchld->fd != -1){
+        while((rc = waitpid(slot->pid, &job->status, WNOHANG)) == -1 && errno == EINTR);
+        slot->exited = rc != 0;
+    }
+    else if(!slot->exited && slot->pidfd == -1 && slot->pipe_rd == -1){
+        while(waitpid(slot->pid, &job->status, 0) == -1 && errno == EINTR);
+        slot->exited = true;
+    }
+    return slot->exited && slot->pipe_rd == -1;
+}
+
+/**
+ * Settle @param job once finished: it fails if it exited without success or
+ * its output could not be kept whole
+ * @return the success of the job
+ */
+static bool job_done(int epfd, struct exec_job *job, struct exec_slot *slot)
+{
+    close_fd(epfd, &slot->out_fd);
+    job->success = exit_success(job->status);
+    if(slot->error != 0){
+        errno = slot->error;
+        perror("child output error");
+        job->success = false;
+    }
+    return job->success;
+}
+
+/**
+ * Children are watched through a pidfd each and their stdout pipes, all in
+ * one epoll set, and each is reaped by pid, so other children of the caller
+ * are left alone.  Without pidfd_open, SIGCHLD is blocked in the calling
+ * thread meanwhile and read from a signalfd in the same set.  Another
+ * thread leaving SIGCHLD unblocked may take it, so those children are also
+ * looked at every EXEC_SWEEP_MS.
+ */
+bool do_exec_many(struct exec_job *jobs, size_t count, unsigned int max_parallel)
+{
+    struct epoll_event events[EXEC_MAX_EVENTS];
+    struct exec_slot *slots;
+    struct exec_sigchld sigchld = { .fd = -1 };
+    unsigned int running = 0;
+    bool success = true;
+    size_t next = 0;
+    size_t i;
+    int n;
+
+    if(max_parallel < 1){
+        max_parallel = 1;
+    }
+    for(i = 0; i < count; i++){
+        jobs[i].output = NULL;
+        jobs[i].output_len = 0;
+        jobs[i].status = -1;
+        jobs[i].success = false;
+    }
+    slots = calloc(count ? count : 1, sizeof(*slots));
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(slots == NULL || epfd == -1){
+        perror("do_exec_many setup error");
+        free(slots);
+        if(epfd != -1){
+            close(epfd);
+        }
+        return false;
+    }
+
+    while(next < count || running > 0){
+        while(running < max_parallel && next < count){
+            if(launch(epfd, &jobs[next], &slots[next], next, &sigchld)){
+                running++;
+                if(finished(&jobs[next], &slots[next], &sigchld)){
+                    success = job_done(epfd, &jobs[next], &slots[next]) && success;
+                    running--;
+                }
+            }
+            else{
+                success = false;
+            }
+            next++;
+        }
+        if(running == 0){
+            continue;
+        }
+
+        n = epoll_wait(epfd, events, EXEC_MAX_EVENTS, sigchld.fd != -1 ? EXEC_SWEEP_MS : -1);
+        if(n == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("epoll_wait error");
+            break;
+        }
+        bool sweep = n == 0 && sigchld.fd != -1;
+        for(int e = 0; e < n; e++){
+            if(events[e].data.u64 == EXEC_SIGCHLD){
+                struct signalfd_siginfo info;
+                while(read(sigchld.fd, &info, sizeof(info)) == sizeof(info));
+                sweep = true;
+                continue;
+            }
+            i = events[e].data.u64 >> 1;
+            struct exec_job *job = &jobs[i];
+            struct exec_slot *slot = &slots[i];
+
+            if((events[e].data.u64 & 1) == EXEC_EXITED){
+                while(waitpid(slot->pid, &job->status, 0) == -1 && errno == EINTR);
+                slot->exited = true;
+                close_fd(epfd, &slot->pidfd);
+            }
+            else if(drain(job, slot)){
+                close_fd(epfd, &slot->pipe_rd);
+            }
+            if(finished(job, slot, &sigchld)){
+                success = job_done(epfd, job, slot) && success;
+                running--;
+            }
+        }
+        /* signals merge, so look at every child that has no pidfd */
+        for(i = 0; sweep && i < next; i++){
+            if(slots[i].pid > 0 && slots[i].pidfd == -1 && !slots[i].exited &&
+               finished(&jobs[i], &slots[i], &sigchld)){
+                success = job_done(epfd, &jobs[i], &slots[i]) && success;
+                running--;
+            }
+        }
+    }
+
+    /* only left running if epoll_wait failed, wait for them without the signalfd */
+    unwatch_sigchld(epfd, &sigchld);
+    for(i = 0; i < next; i++){
+        if(!slots[i].exited && slots[i].pid > 0){
+            close_fd(epfd, &slots[i].pipe_rd);
+            close_fd(epfd, &slots[i].pidfd);
+            finished(&jobs[i], &slots[i], &sigchld);
+            success = false;
+        }
+        close_fd(epfd, &slots[i].out_fd);
+    }
+    close(epfd);
+    free(slots);
+    return success;
 }
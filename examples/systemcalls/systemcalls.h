@@ -7,3 +7,43 @@ bool do_system(const char *command);
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+/**
+ * One command for do_exec_many().  The caller fills in argv and how to
+ * capture stdout, do_exec_many() fills in the rest.
+ */
+struct exec_job {
+    /**
+     * Command and arguments, NULL terminated, argv[0] an absolute path as for do_exec()
+     */
+    char **argv;
+    /**
+     * If set, stdout is spliced into this file, truncated first
+     */
+    const char *outputfile;
+    /**
+     * If set and outputfile is not, stdout is collected in output, which the caller frees
+     */
+    bool capture;
+    char *output;
+    /**
+     * Bytes of stdout, collected in output or spliced into outputfile
+     */
+    size_t output_len;
+    /**
+     * waitpid() status of the command, -1 if it could not be launched
+     */
+    int status;
+    /**
+     * Exited with status 0 and stdout was kept whole, false if for instance
+     * output could not grow or outputfile could not be written
+     */
+    bool success;
+};
+
+/**
+ * Run the @param count commands of @param jobs, at most @param max_parallel
+ * at a time, and wait for all of them.
+ * @return true if every command ran and exited with status 0
+ */
+bool do_exec_many(struct exec_job *jobs, size_t count, unsigned int max_parallel);
@@ -0,0 +1,411 @@
+/**
+ * @file lock-bench.c
+ * @brief Contention of the obtain, hold, release pattern of threading.c across lock types
+ *
+ * Every thread loops for the run duration: take the lock, hold it for the
+ * hold time, release it, then stay away for the think time.  The time spent
+ * waiting for each acquisition goes into a per-thread histogram.
+ *
+ * Reported as CSV, one row per lock, thread count and hold time:
+ *  - ops_per_s: acquisitions per second over all threads
+ *  - fairness_cv: standard deviation of the per-thread acquisition counts
+ *    over their mean, 0 when every thread got the lock equally often
+ *  - p50/p99/p999/max_wait_ns: wait for the lock, from the histogram, so
+ *    within 1/8 of the value
+ *
+ * usage: lock-bench [-t threads,...] [-h hold_ns,...] [-w think_ns] [-d duration_ms] [-l lock,...]
+ */
+
+#define _GNU_SOURCE
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_LINE   64
+#define MAX_LIST     16
+/* 8 buckets per power of two, up to 2^63 ns */
+#define HIST_SUB     3
+#define HIST_BUCKETS (64 << HIST_SUB)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax() do { } while(0)
+#endif
+
+/**
+ * Ticket lock: FIFO, every waiter spins on the same serving counter
+ */
+struct ticket_lock {
+    _Alignas(CACHE_LINE) atomic_uint next;
+    _Alignas(CACHE_LINE) atomic_uint serving;
+};
+
+static void ticket_lock(struct ticket_lock *l)
+{
+    unsigned int ticket = atomic_fetch_add_explicit(&l->next, 1, memory_order_relaxed);
+    while(atomic_load_explicit(&l->serving, memory_order_acquire) != ticket){
+        cpu_relax();
+    }
+}
+
+static void ticket_unlock(struct ticket_lock *l)
+{
+    unsigned int serving = atomic_load_explicit(&l->serving, memory_order_relaxed);
+    atomic_store_explicit(&l->serving, serving + 1, memory_order_release);
+}
+
+/**
+ * MCS queue lock: FIFO, every waiter spins on its own node
+ */
+struct mcs_node {
+    _Alignas(CACHE_LINE) _Atomic(struct mcs_node *) next;
+    atomic_bool locked;
+};
+
+struct mcs_lock {
+    _Alignas(CACHE_LINE) _Atomic(struct mcs_node *) tail;
+};
+
+static void mcs_lock(struct mcs_lock *l, struct mcs_node *node)
+{
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&node->locked, true, memory_order_relaxed);
+    struct mcs_node *prev = atomic_exchange_explicit(&l->tail, node, memory_order_acq_rel);
+    if(prev == NULL){
+        return;
+    }
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+    while(atomic_load_explicit(&node->locked, memory_order_acquire)){
+        cpu_relax();
+    }
+}
+
+static void mcs_unlock(struct mcs_lock *l, struct mcs_node *node)
+{
+    struct mcs_node *next = atomic_load_explicit(&node->next, memory_order_acquire);
+    if(next == NULL){
+        struct mcs_node *expected = node;
+        if(atomic_compare_exchange_strong_explicit(&l->tail, &expected, NULL,
+                                                   memory_order_release, memory_order_relaxed)){
+            return;
+        }
+        /* a successor swapped itself in but has not linked up yet */
+        while((next = atomic_load_explicit(&node->next, memory_order_acquire)) == NULL){
+            cpu_relax();
+        }
+    }
+    atomic_store_explicit(&next->locked, false, memory_order_release);
+}
+
+enum lock_kind {
+    LOCK_MUTEX,
+    LOCK_ADAPTIVE,
+    LOCK_SPIN,
+    LOCK_TICKET,
+    LOCK_MCS,
+    LOCK_KINDS,
+};
+
+static const char *lock_names[LOCK_KINDS] = { "mutex", "adaptive", "spin", "ticket", "mcs" };
+
+struct bench_lock {
+    enum lock_kind kind;
+    pthread_mutex_t mutex;
+    pthread_spinlock_t spin;
+    struct ticket_lock ticket;
+    struct mcs_lock mcs;
+    /* plain counter bumped under the lock, ends up short if the lock lets two in */
+    uint64_t inside;
+};
+
+struct worker {
+    _Alignas(CACHE_LINE) pthread_t thread;
+    struct bench_lock *lock;
+    struct mcs_node node;
+    long hold_ns;
+    long think_ns;
+    const atomic_bool *stop;
+    uint64_t acquisitions;
+    uint64_t hist[HIST_BUCKETS];
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void spin_for(long ns)
+{
+    if(ns > 0){
+        uint64_t end = now_ns() + ns;
+        while(now_ns() < end){
+            cpu_relax();
+        }
+    }
+}
+
+static int hist_bucket(uint64_t v)
+{
+    if(v < (1 << HIST_SUB)){
+        return v;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    return ((msb - HIST_SUB + 1) << HIST_SUB) | ((v >> (msb - HIST_SUB)) & ((1 << HIST_SUB) - 1));
+}
+
+/* smallest value of a bucket */
+static uint64_t hist_value(int bucket)
+{
+    if(bucket < (1 << HIST_SUB)){
+        return bucket;
+    }
+    int msb = (bucket >> HIST_SUB) + HIST_SUB - 1;
+    return (1ULL << msb) | ((uint64_t)(bucket & ((1 << HIST_SUB) - 1)) << (msb - HIST_SUB));
+}
+
+static uint64_t hist_percentile(const uint64_t *hist, uint64_t total, double p)
+{
+    uint64_t rank = (uint64_t)ceil(total * p);
+    uint64_t seen = 0;
+    int b;
+
+    for(b = 0; b < HIST_BUCKETS; b++){
+        seen += hist[b];
+        if(seen >= rank && hist[b] > 0){
+            return hist_value(b);
+        }
+    }
+    return 0;
+}
+
+static void lock_init(struct bench_lock *l, enum lock_kind kind)
+{
+    pthread_mutexattr_t attr;
+
+    memset(l, 0, sizeof(*l));
+    l->kind = kind;
+    pthread_mutexattr_init(&attr);
+#ifdef PTHREAD_ADAPTIVE_MUTEX_INITIALIZER_NP
+    if(kind == LOCK_ADAPTIVE){
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+    }
+#endif
+    pthread_mutex_init(&l->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_spin_init(&l->spin, PTHREAD_PROCESS_PRIVATE);
+}
+
+static void lock_destroy(struct bench_lock *l)
+{
+    pthread_mutex_destroy(&l->mutex);
+    pthread_spin_destroy(&l->spin);
+}
+
+static inline void lock_obtain(struct worker *w)
+{
+    switch(w->lock->kind){
+        case LOCK_MUTEX:
+        case LOCK_ADAPTIVE: pthread_mutex_lock(&w->lock->mutex); break;
+        case LOCK_SPIN:     pthread_spin_lock(&w->lock->spin); break;
+        case LOCK_TICKET:   ticket_lock(&w->lock->ticket); break;
+        case LOCK_MCS:      mcs_lock(&w->lock->mcs, &w->node); break;
+        default: break;
+    }
+}
+
+static inline void lock_release(struct worker *w)
+{
+    switch(w->lock->kind){
+        case LOCK_MUTEX:
+        case LOCK_ADAPTIVE: pthread_mutex_unlock(&w->lock->mutex); break;
+        case LOCK_SPIN:     pthread_spin_unlock(&w->lock->spin); break;
+        case LOCK_TICKET:   ticket_unlock(&w->lock->ticket); break;
+        case LOCK_MCS:      mcs_unlock(&w->lock->mcs, &w->node); break;
+        default: break;
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+
+    while(!atomic_load_explicit(w->stop, memory_order_relaxed)){
+        uint64_t t0 = now_ns();
+        lock_obtain(w);
+        uint64_t t1 = now_ns();
+        w->lock->inside++;
+        spin_for(w->hold_ns);
+        lock_release(w);
+        w->hist[hist_bucket(t1 - t0)]++;
+        w->acquisitions++;
+        spin_for(w->think_ns);
+    }
+    return NULL;
+}
+
+static int run(enum lock_kind kind, int nthreads, long hold_ns, long think_ns, int duration_ms)
+{
+    static uint64_t hist[HIST_BUCKETS];
+    struct timespec duration = { duration_ms / 1000, (duration_ms % 1000) * 1000000L };
+    struct bench_lock lock;
+    atomic_bool stop = false;
+    uint64_t total = 0;
+    double sum = 0, sumsq = 0;
+    int i, started;
+
+    struct worker *workers = aligned_alloc(CACHE_LINE, nthreads * sizeof(*workers));
+    if(workers == NULL){
+        return -1;
+    }
+    memset(workers, 0, nthreads * sizeof(*workers));
+    lock_init(&lock, kind);
+
+    uint64_t t0 = now_ns();
+    for(started = 0; started < nthreads; started++){
+        workers[started].lock = &lock;
+        workers[started].hold_ns = hold_ns;
+        workers[started].think_ns = think_ns;
+        workers[started].stop = &stop;
+        if(pthread_create(&workers[started].thread, NULL, worker_main, &workers[started]) != 0){
+            break;
+        }
+    }
+    nanosleep(&duration, NULL);
+    atomic_store(&stop, true);
+    for(i = 0; i < started; i++){
+        pthread_join(workers[i].thread, NULL);
+    }
+    double seconds = (now_ns() - t0) / 1e9;
+
+    memset(hist, 0, sizeof(hist));
+    for(i = 0; i < started; i++){
+        total += workers[i].acquisitions;
+        sum += workers[i].acquisitions;
+        sumsq += (double)workers[i].acquisitions * workers[i].acquisitions;
+        for(int b = 0; b < HIST_BUCKETS; b++){
+            hist[b] += workers[i].hist[b];
+        }
+    }
+    double mean = started ? sum / started : 0;
+    double cv = mean > 0 ? sqrt(fmax(sumsq / started - mean * mean, 0)) / mean : 0;
+    uint64_t max = 0;
+    for(int b = HIST_BUCKETS - 1; b >= 0; b--){
+        if(hist[b] > 0){
+            max = hist_value(b);
+            break;
+        }
+    }
+    if(lock.inside != total){
+        fprintf(stderr, "%s: %llu acquisitions but %llu counted under the lock\n", lock_names[kind],
+                (unsigned long long)total, (unsigned long long)lock.inside);
+    }
+    printf("%s,%d,%ld,%.0f,%.3f,%llu,%llu,%llu,%llu\n", lock_names[kind], started, hold_ns,
+           total / seconds, cv,
+           (unsigned long long)hist_percentile(hist, total, 0.5),
+           (unsigned long long)hist_percentile(hist, total, 0.99),
+           (unsigned long long)hist_percentile(hist, total, 0.999),
+           (unsigned long long)max);
+    fflush(stdout);
+
+    lock_destroy(&lock);
+    free(workers);
+    return started == nthreads ? 0 : -1;
+}
+
+/**
+ * Parse a comma separated list of numbers into @param values
+ * @return the number of values, -1 if malformed
+ */
+static int parse_list(const char *arg, long *values)
+{
+    char *end;
+    int n = 0;
+
+    while(*arg && n < MAX_LIST){
+        values[n++] = strtol(arg, &end, 0);
+        if(end == arg || values[n - 1] < 0){
+            return -1;
+        }
+        arg = (*end == ',') ? end + 1 : end;
+    }
+    return n;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-t threads,...] [-h hold_ns,...] [-w think_ns] [-d duration_ms]"
+            " [-l mutex,adaptive,spin,ticket,mcs]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long threads[MAX_LIST] = { 1, 2, 4, 8 };
+    long holds[MAX_LIST] = { 0, 100, 1000 };
+    bool enabled[LOCK_KINDS] = { true, true, true, true, true };
+    int nthreads = 4, nholds = 3;
+    long think_ns = 100;
+    int duration_ms = 500;
+    int opt, k, t, h;
+
+    while((opt = getopt(argc, argv, "t:h:w:d:l:")) != -1){
+        switch(opt){
+            case 't': nthreads = parse_list(optarg, threads); break;
+            case 'h': nholds = parse_list(optarg, holds); break;
+            case 'w': think_ns = atol(optarg); break;
+            case 'd': duration_ms = atoi(optarg); break;
+            case 'l':
+                memset(enabled, 0, sizeof(enabled));
+                for(k = 0; k < LOCK_KINDS; k++){
+                    char *p = strstr(optarg, lock_names[k]);
+                    size_t len = strlen(lock_names[k]);
+                    enabled[k] = p != NULL && (p == optarg || p[-1] == ',') && (p[len] == ',' || p[len] == '\0');
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if(nthreads < 1 || nholds < 1 || duration_ms < 1 || think_ns < 0){
+        usage(argv[0]);
+        return 1;
+    }
+    for(t = 0; t < nthreads; t++){
+        if(threads[t] < 1){
+            usage(argv[0]);
+            return 1;
+        }
+        if(cpus > 0 && threads[t] > cpus){
+            fprintf(stderr, "note: %ld threads on %ld cpus, spinning locks will wait on preempted holders\n",
+                    threads[t], cpus);
+        }
+    }
+
+    printf("lock,threads,hold_ns,ops_per_s,fairness_cv,p50_wait_ns,p99_wait_ns,p999_wait_ns,max_wait_ns\n");
+    for(k = 0; k < LOCK_KINDS; k++){
+        if(!enabled[k]){
+            continue;
+        }
+        for(t = 0; t < nthreads; t++){
+            for(h = 0; h < nholds; h++){
+                if(run(k, threads[t], holds[h], think_ns, duration_ms) != 0){
+                    fprintf(stderr, "%s with %ld threads could not start all threads\n", lock_names[k], threads[t]);
+                }
+            }
+        }
+    }
+    return 0;
+}
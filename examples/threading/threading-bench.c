@@ -0,0 +1,152 @@
+/**
+ * @file threading-bench.c
+ * @brief Threads and memory of start_thread_obtaining_mutex() against mutex requests on a timer_pool
+ *
+ * Each run starts the given number of requests on one mutex, the obtain
+ * delays spread evenly over -s milliseconds and no hold time, then waits
+ * for all of them.  Runs are done in a child process each so the peak RSS
+ * reported by getrusage belongs to that run only.  peak_threads is sampled
+ * once all requests are started.
+ *
+ * usage: threading-bench [-s spread_ms] [-p pool_threads] [-m max_requests]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "threading.h"
+
+static const int counts[] = { 1000, 10000, 100000 };
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int thread_count(void)
+{
+    char line[128];
+    int threads = -1;
+    FILE *f = fopen("/proc/self/status", "r");
+    if(f == NULL){
+        return -1;
+    }
+    while(fgets(line, sizeof(line), f) != NULL){
+        if(sscanf(line, "Threads: %d", &threads) == 1){
+            break;
+        }
+    }
+    fclose(f);
+    return threads;
+}
+
+static void run_threads(int count, int spread_ms)
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_t *threads = calloc(count, sizeof(*threads));
+    int started, failed = 0;
+
+    double t0 = now_s();
+    for(started = 0; started < count; started++){
+        if(!start_thread_obtaining_mutex(&threads[started], &mutex, started % spread_ms, 0)){
+            break;
+        }
+    }
+    int peak = thread_count();
+    for(int i = 0; i < started; i++){
+        void *ret;
+        pthread_join(threads[i], &ret);
+        struct thread_data *data = ret;
+        failed += !data->thread_complete_success;
+        free(data);
+    }
+    double t1 = now_s();
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("thread,%d,%d,%d,%ld,%.3f,%d\n", count, started, peak, ru.ru_maxrss,
+           t1 - t0, failed + count - started);
+    free(threads);
+}
+
+static void run_pool(int count, int spread_ms, unsigned int pool_threads)
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct mutex_request *requests = calloc(count, sizeof(*requests));
+    struct timer_pool *pool = timer_pool_create(pool_threads);
+    int failed = 0;
+    int i;
+
+    if(requests == NULL || pool == NULL){
+        fprintf(stderr, "pool setup failed\n");
+        exit(1);
+    }
+    double t0 = now_s();
+    for(i = 0; i < count; i++){
+        start_request_obtaining_mutex(pool, &requests[i], &mutex, i % spread_ms, 0, NULL, NULL);
+    }
+    int peak = thread_count();
+    for(i = 0; i < count; i++){
+        failed += !wait_request_obtaining_mutex(&requests[i]);
+    }
+    double t1 = now_s();
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("pool,%d,%d,%d,%ld,%.3f,%d\n", count, count, peak, ru.ru_maxrss, t1 - t0, failed);
+    timer_pool_destroy(pool);
+    free(requests);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int pool_threads = 4;
+    int max_requests = 100000;
+    int spread_ms = 1000;
+    size_t i;
+    int opt;
+
+    while((opt = getopt(argc, argv, "s:p:m:")) != -1){
+        switch(opt){
+            case 's': spread_ms = atoi(optarg); break;
+            case 'p': pool_threads = atoi(optarg); break;
+            case 'm': max_requests = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-s spread_ms] [-p pool_threads] [-m max_requests]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(spread_ms < 1 || pool_threads < 1){
+        fprintf(stderr, "usage: %s [-s spread_ms] [-p pool_threads] [-m max_requests]\n", argv[0]);
+        return 1;
+    }
+
+    printf("mode,requests,started,peak_threads,max_rss_kb,seconds,failed\n");
+    fflush(stdout);
+    for(i = 0; i < sizeof(counts) / sizeof(counts[0]) && counts[i] <= max_requests; i++){
+        for(int mode = 0; mode < 2; mode++){
+            pid_t pid = fork();
+            if(pid == -1){
+                perror("fork");
+                return 1;
+            }
+            if(pid == 0){
+                if(mode == 0){
+                    run_threads(counts[i], spread_ms);
+                }
+                else{
+                    run_pool(counts[i], spread_ms, pool_threads);
+                }
+                fflush(stdout);
+                _exit(0);
+            }
+            waitpid(pid, NULL, 0);
+        }
+    }
+    return 0;
+}
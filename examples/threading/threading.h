@@ -1,5 +1,6 @@
 #include <stdbool.h>
 #include <pthread.h>
+#include "timer_pool.h"
 
 /**
  * This structure should be dynamically allocated and passed as
@@ -41,3 +42,59 @@ struct thread_data{
 * @return true if the thread could be started, false if a failure occurred.
 */
 bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int wait_to_obtain_ms, int wait_to_release_ms);
+
+
+struct mutex_request;
+
+typedef void (*mutex_request_callback)(struct mutex_request *request, void *arg);
+
+/**
+ * The work of start_thread_obtaining_mutex() as steps scheduled on a
+ * timer_pool instead of a thread of its own.  The caller owns the memory,
+ * which needs to stay valid until the request completed.
+ */
+struct mutex_request {
+    struct timer_task task;
+    struct timer_pool *pool;
+    pthread_mutex_t *mutex;
+    int wait_to_obtain_ms;
+    int wait_to_release_ms;
+    bool holding;
+    /**
+     * Place in the line of requests waiting for mutex, and whether the
+     * request sleeps there until the mutex is released rather than polling
+     */
+    TAILQ_ENTRY(mutex_request) waiting;
+    bool queued;
+    bool parked;
+    unsigned int retry_ms;
+    mutex_request_callback callback;
+    void *arg;
+    /**
+     * Set to true if the request completed with success, false
+     * if an error occurred.
+     */
+    bool thread_complete_success;
+    bool complete;
+};
+
+/**
+* Schedule @param request on @param pool: after @param wait_to_obtain_ms milliseconds obtain @param mutex,
+* hold it for @param wait_to_release_ms milliseconds, then release it.  No thread waits in between: requests
+* finding the mutex taken line up in arrival order and the request releasing it schedules the first one,
+* only a mutex held outside the pool is retried, by the first in line, after a growing delay.  The mutex is
+* released by the worker that obtained it.
+* Once done, thread_complete_success is set and @param callback, if not NULL, is called with @param arg
+* on the pool worker after the request is marked complete, so a waiter may already have returned.  The
+* request may be freed from the callback if nobody waits for it, and is not touched after the callback.
+* @return true if the request was scheduled.
+*/
+bool start_request_obtaining_mutex(struct timer_pool *pool, struct mutex_request *request, pthread_mutex_t *mutex,
+                                   int wait_to_obtain_ms, int wait_to_release_ms,
+                                   mutex_request_callback callback, void *arg);
+
+/**
+* Wait until @param request completed, in place of joining the thread of start_thread_obtaining_mutex().
+* @return thread_complete_success of the request
+*/
+bool wait_request_obtaining_mutex(struct mutex_request *request);
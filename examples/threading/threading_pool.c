@@ -0,0 +1,254 @@
+#include "threading.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+
+#define ERROR_LOG(msg,...) printf("threading ERROR: " msg "\n" , ##__VA_ARGS__)
+
+/* completion of mutex requests, shared by all of them since waiting is the rare case */
+static pthread_mutex_t request_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t request_done = PTHREAD_COND_INITIALIZER;
+static unsigned int request_waiters;
+
+/* longest delay between two tries at a mutex held outside the pool */
+#define RETRY_MAX_MS    16
+#define LINE_BUCKETS    64
+
+TAILQ_HEAD(request_list, mutex_request);
+
+/**
+ * The requests waiting for one mutex, in arrival order, and whether a
+ * request of the pool holds it.  Exists while either is the case.
+ */
+struct mutex_line {
+    struct mutex_line *next;    /* in its hash bucket */
+    pthread_mutex_t *mutex;
+    struct request_list waiting;
+    bool held;
+};
+
+/* lines by mutex, all under one lock as they are only touched around lock changes */
+static pthread_mutex_t line_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mutex_line *lines[LINE_BUCKETS];
+
+static struct mutex_line **line_slot(pthread_mutex_t *mutex)
+{
+    struct mutex_line **slot = &lines[((uintptr_t)mutex / sizeof(void *)) % LINE_BUCKETS];
+    while(*slot != NULL && (*slot)->mutex != mutex){
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+/**
+ * @return the line of @param mutex, created if @param create, NULL if there
+ * is none or it could not be allocated.  Caller holds line_lock.
+ */
+static struct mutex_line *find_line(pthread_mutex_t *mutex, bool create)
+{
+    struct mutex_line **slot = line_slot(mutex);
+    if(*slot == NULL && create){
+        *slot = calloc(1, sizeof(**slot));
+        if(*slot != NULL){
+            (*slot)->mutex = mutex;
+            TAILQ_INIT(&(*slot)->waiting);
+        }
+    }
+    return *slot;
+}
+
+/**
+ * Free @param line once nobody holds or waits on it.  Caller holds line_lock.
+ */
+static void put_line(struct mutex_line *line)
+{
+    if(line != NULL && !line->held && TAILQ_EMPTY(&line->waiting)){
+        struct mutex_line **slot = line_slot(line->mutex);
+        *slot = line->next;
+        free(line);
+    }
+}
+
+/**
+ * Let the first request of @param line try again, if it sleeps until the
+ * mutex is released.  Caller holds line_lock.
+ */
+static void wake_line(struct mutex_line *line)
+{
+    struct mutex_request *first = line != NULL ? TAILQ_FIRST(&line->waiting) : NULL;
+    if(first != NULL && first->parked){
+        first->parked = false;
+        timer_pool_schedule(first->pool, &first->task, 0);
+    }
+}
+
+static void complete_request(struct mutex_request *request, bool success)
+{
+    /* a waiter may free the request once it is complete, take what the callback needs first */
+    mutex_request_callback callback = request->callback;
+    void *arg = request->arg;
+
+    request->thread_complete_success = success;
+    pthread_mutex_lock(&request_lock);
+    request->complete = true;
+    if(request_waiters > 0){
+        pthread_cond_broadcast(&request_done);
+    }
+    pthread_mutex_unlock(&request_lock);
+    if(callback != NULL){
+        callback(request, arg);
+    }
+}
+
+/**
+ * Try to obtain the mutex of @param request, in line behind the requests
+ * already waiting for it.  A request that misses it sleeps until the pool
+ * request holding it releases it, or, when it is held outside the pool,
+ * the first one in line tries again after a growing delay.
+ * @return 0 if obtained, EBUSY if the request waits, or the trylock error
+ */
+static int obtain(struct mutex_request *request)
+{
+    struct mutex_line *line;
+    int rc;
+
+    pthread_mutex_lock(&line_lock);
+    line = find_line(request->mutex, false);
+    if(line != NULL && !TAILQ_EMPTY(&line->waiting) && TAILQ_FIRST(&line->waiting) != request){
+        if(!request->queued){
+            TAILQ_INSERT_TAIL(&line->waiting, request, waiting);
+            request->queued = true;
+            request->parked = true;
+        }
+        pthread_mutex_unlock(&line_lock);
+        return EBUSY;
+    }
+    rc = pthread_mutex_trylock(request->mutex);
+    if(rc != EBUSY){
+        if(request->queued){
+            TAILQ_REMOVE(&line->waiting, request, waiting);
+            request->queued = false;
+        }
+        if(rc == 0){
+            /* without a line the next waiter can only poll, as for a holder outside the pool */
+            line = find_line(request->mutex, true);
+            if(line != NULL){
+                line->held = true;
+            }
+        }
+        else{
+            wake_line(line);
+            put_line(line);
+        }
+        request->retry_ms = 0;
+        pthread_mutex_unlock(&line_lock);
+        return rc;
+    }
+    if(line == NULL){
+        line = find_line(request->mutex, true);
+    }
+    if(line != NULL && !request->queued){
+        TAILQ_INSERT_HEAD(&line->waiting, request, waiting);
+        request->queued = true;
+    }
+    if(line != NULL && line->held){
+        request->parked = true;
+    }
+    else{
+        request->retry_ms = line == NULL || request->retry_ms == 0 ? 1 : request->retry_ms * 2;
+        if(request->retry_ms > RETRY_MAX_MS){
+            request->retry_ms = RETRY_MAX_MS;
+        }
+        timer_pool_schedule(request->pool, &request->task, request->retry_ms);
+    }
+    pthread_mutex_unlock(&line_lock);
+    return EBUSY;
+}
+
+/**
+ * Release the mutex of @param request and schedule the next request in line
+ * @return the unlock error, 0 on success
+ */
+static int release(struct mutex_request *request)
+{
+    struct mutex_line *line;
+    int rc;
+
+    /* under line_lock, so held is never seen set for a mutex that is free */
+    pthread_mutex_lock(&line_lock);
+    line = find_line(request->mutex, false);
+    if(line != NULL){
+        line->held = false;
+    }
+    rc = pthread_mutex_unlock(request->mutex);
+    wake_line(line);
+    put_line(line);
+    pthread_mutex_unlock(&line_lock);
+    return rc;
+}
+
+static void request_step(struct timer_task *task)
+{
+    struct mutex_request *request = (struct mutex_request *) task;
+    int rc;
+
+    if(!request->holding){
+        rc = obtain(request);
+        if(rc == EBUSY){
+            return;
+        }
+        if(rc != 0){
+            ERROR_LOG("mutex lock error %d\n", rc);
+            complete_request(request, false);
+            return;
+        }
+        if(request->wait_to_release_ms > 0){
+            request->holding = true;
+            timer_pool_schedule(request->pool, task, request->wait_to_release_ms);
+            return;
+        }
+    }
+    request->holding = false;
+    rc = release(request);
+    if(rc != 0){
+        ERROR_LOG("mutex unlock error %d\n", rc);
+    }
+    complete_request(request, rc == 0);
+}
+
+bool start_request_obtaining_mutex(struct timer_pool *pool, struct mutex_request *request, pthread_mutex_t *mutex,
+                                   int wait_to_obtain_ms, int wait_to_release_ms,
+                                   mutex_request_callback callback, void *arg)
+{
+    if(pool == NULL || wait_to_obtain_ms < 0 || wait_to_release_ms < 0){
+        return false;
+    }
+    timer_task_init(&request->task, request_step);
+    request->pool = pool;
+    request->mutex = mutex;
+    request->wait_to_obtain_ms = wait_to_obtain_ms;
+    request->wait_to_release_ms = wait_to_release_ms;
+    request->holding = false;
+    request->queued = false;
+    request->parked = false;
+    request->retry_ms = 0;
+    request->callback = callback;
+    request->arg = arg;
+    request->thread_complete_success = false;
+    request->complete = false;
+    timer_pool_schedule(pool, &request->task, wait_to_obtain_ms);
+    return true;
+}
+
+bool wait_request_obtaining_mutex(struct mutex_request *request)
+{
+    pthread_mutex_lock(&request_lock);
+    request_waiters++;
+    while(!request->complete){
+        pthread_cond_wait(&request_done, &request_lock);
+    }
+    request_waiters--;
+    pthread_mutex_unlock(&request_lock);
+    return request->thread_complete_success;
+}
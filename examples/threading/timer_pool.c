@@ -0,0 +1,265 @@
+#include "timer_pool.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+
+#define ERROR_LOG(msg,...) printf("timer_pool ERROR: " msg "\n" , ##__VA_ARGS__)
+
+/*
+ * Each wheel level has 64 slots.  Level 0 slots are one tick wide, a slot
+ * of level n covers a whole turn of level n-1, so 4 levels reach 2^24 ms,
+ * about 4.6 hours.  Later deadlines are clamped to that.
+ */
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_RANGE  (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+
+struct timer_worker {
+    struct timer_pool *pool;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /**
+     * Scheduled from other threads, moved into the wheel by the worker, protected by lock
+     */
+    struct timer_list incoming;
+    /**
+     * Only touched by the worker thread
+     */
+    struct timer_list wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t current;       /* next tick to run */
+    size_t pending;         /* tasks in the wheel */
+};
+
+struct timer_pool {
+    struct timespec epoch;
+    unsigned int nworkers;
+    unsigned int next_worker;
+    bool stop;
+    struct timer_worker workers[];
+};
+
+/* the worker running on this thread, NULL outside the pool */
+static __thread struct timer_worker *self;
+
+static uint64_t pool_now(const struct timer_pool *pool)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((now.tv_sec - pool->epoch.tv_sec) * 1000000000LL + (now.tv_nsec - pool->epoch.tv_nsec)) / 1000000;
+}
+
+static void wheel_insert(struct timer_worker *w, struct timer_task *task)
+{
+    uint64_t delta;
+    int level;
+
+    if(task->expires < w->current){
+        task->expires = w->current;
+    }
+    delta = task->expires - w->current;
+    if(delta >= WHEEL_RANGE){
+        delta = WHEEL_RANGE - 1;
+        task->expires = w->current + delta;
+    }
+    for(level = 0; level < WHEEL_LEVELS - 1; level++){
+        if(delta < (1ULL << (WHEEL_BITS * (level + 1)))){
+            break;
+        }
+    }
+    TAILQ_INSERT_TAIL(&w->wheel[level][(task->expires >> (WHEEL_BITS * level)) & WHEEL_MASK], task, link);
+    w->pending++;
+}
+
+/**
+ * Move the tasks of a higher level slot down now that its time span is near
+ */
+static void wheel_cascade(struct timer_worker *w, int level, int slot)
+{
+    struct timer_list list = TAILQ_HEAD_INITIALIZER(list);
+    struct timer_task *task;
+
+    TAILQ_CONCAT(&list, &w->wheel[level][slot], link);
+    while((task = TAILQ_FIRST(&list)) != NULL){
+        TAILQ_REMOVE(&list, task, link);
+        w->pending--;
+        wheel_insert(w, task);
+    }
+}
+
+/**
+ * Run the tasks due at tick w->current and move on to the next tick
+ */
+static void wheel_tick(struct timer_worker *w)
+{
+    struct timer_list due = TAILQ_HEAD_INITIALIZER(due);
+    struct timer_task *task;
+    uint64_t t = w->current;
+    int level;
+
+    if((t & WHEEL_MASK) == 0){
+        for(level = 1; level < WHEEL_LEVELS; level++){
+            int slot = (t >> (WHEEL_BITS * level)) & WHEEL_MASK;
+            wheel_cascade(w, level, slot);
+            if(slot != 0){
+                break;
+            }
+        }
+    }
+    TAILQ_CONCAT(&due, &w->wheel[0][t & WHEEL_MASK], link);
+    /* tasks scheduled by the ones run below land on a later tick */
+    w->current = t + 1;
+    while((task = TAILQ_FIRST(&due)) != NULL){
+        TAILQ_REMOVE(&due, task, link);
+        w->pending--;
+        task->run(task);
+    }
+}
+
+/**
+ * @return the tick to wake up at: the next busy level 0 slot of this turn,
+ * else the start of the next turn, where a cascade may bring tasks down
+ */
+static uint64_t next_wakeup(const struct timer_worker *w)
+{
+    uint64_t t;
+
+    for(t = w->current; (t & WHEEL_MASK) != 0 || t == w->current; t++){
+        if(!TAILQ_EMPTY(&w->wheel[0][t & WHEEL_MASK])){
+            return t;
+        }
+    }
+    return t;
+}
+
+static void *worker_main(void *arg)
+{
+    struct timer_worker *w = arg;
+    struct timer_pool *pool = w->pool;
+    struct timer_list incoming = TAILQ_HEAD_INITIALIZER(incoming);
+    struct timer_task *task;
+    struct timespec deadline;
+
+    self = w;
+    pthread_mutex_lock(&w->lock);
+    while(!__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE)){
+        TAILQ_CONCAT(&incoming, &w->incoming, link);
+        pthread_mutex_unlock(&w->lock);
+
+        uint64_t now = pool_now(pool);
+        if(w->pending == 0 && w->current < now){
+            /* nothing to run on the ticks slept through */
+            w->current = now;
+        }
+        while((task = TAILQ_FIRST(&incoming)) != NULL){
+            TAILQ_REMOVE(&incoming, task, link);
+            wheel_insert(w, task);
+        }
+        while(w->current <= now){
+            wheel_tick(w);
+        }
+
+        pthread_mutex_lock(&w->lock);
+        if(!TAILQ_EMPTY(&w->incoming) || __atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE)){
+            continue;
+        }
+        if(w->pending == 0){
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        else{
+            uint64_t ms = next_wakeup(w);
+            deadline.tv_sec = pool->epoch.tv_sec + ms / 1000;
+            deadline.tv_nsec = pool->epoch.tv_nsec + (ms % 1000) * 1000000;
+            if(deadline.tv_nsec >= 1000000000){
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&w->cond, &w->lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+struct timer_pool *timer_pool_create(unsigned int nthreads)
+{
+    struct timer_pool *pool;
+    pthread_condattr_t attr;
+    unsigned int i;
+    int l, s;
+
+    if(nthreads < 1){
+        nthreads = 1;
+    }
+    pool = calloc(1, sizeof(*pool) + nthreads * sizeof(struct timer_worker));
+    if(pool == NULL){
+        return NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &pool->epoch);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    for(i = 0; i < nthreads; i++){
+        struct timer_worker *w = &pool->workers[i];
+        w->pool = pool;
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->cond, &attr);
+        TAILQ_INIT(&w->incoming);
+        for(l = 0; l < WHEEL_LEVELS; l++){
+            for(s = 0; s < WHEEL_SLOTS; s++){
+                TAILQ_INIT(&w->wheel[l][s]);
+            }
+        }
+        int rc = pthread_create(&w->thread, NULL, worker_main, w);
+        if(rc != 0){
+            ERROR_LOG("pthread create failed with error %d", rc);
+            pthread_condattr_destroy(&attr);
+            pool->nworkers = i;
+            timer_pool_destroy(pool);
+            return NULL;
+        }
+        pool->nworkers = i + 1;
+    }
+    pthread_condattr_destroy(&attr);
+    return pool;
+}
+
+void timer_pool_schedule(struct timer_pool *pool, struct timer_task *task, unsigned int delay_ms)
+{
+    struct timer_worker *w;
+
+    if(task->worker < 0){
+        task->worker = __atomic_fetch_add(&pool->next_worker, 1, __ATOMIC_RELAXED) % pool->nworkers;
+    }
+    w = &pool->workers[task->worker];
+    /* the current tick is partly gone, so round up to never run early */
+    task->expires = pool_now(pool) + delay_ms + (delay_ms > 0);
+    if(self == w){
+        wheel_insert(w, task);
+        return;
+    }
+    pthread_mutex_lock(&w->lock);
+    TAILQ_INSERT_TAIL(&w->incoming, task, link);
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+void timer_pool_destroy(struct timer_pool *pool)
+{
+    unsigned int i;
+
+    __atomic_store_n(&pool->stop, true, __ATOMIC_RELEASE);
+    for(i = 0; i < pool->nworkers; i++){
+        pthread_mutex_lock(&pool->workers[i].lock);
+        pthread_cond_signal(&pool->workers[i].cond);
+        pthread_mutex_unlock(&pool->workers[i].lock);
+    }
+    for(i = 0; i < pool->nworkers; i++){
+        pthread_join(pool->workers[i].thread, NULL);
+        pthread_mutex_destroy(&pool->workers[i].lock);
+        pthread_cond_destroy(&pool->workers[i].cond);
+    }
+    free(pool);
+}
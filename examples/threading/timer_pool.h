@@ -0,0 +1,55 @@
+#ifndef TIMER_POOL_H
+#define TIMER_POOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+/**
+ * A task run by a timer_pool worker once its delay expired.  The caller
+ * owns the memory, the pool only links it into its lists while scheduled.
+ */
+struct timer_task {
+    TAILQ_ENTRY(timer_task) link;
+    /**
+     * Pool tick, in milliseconds, at which the task is due
+     */
+    uint64_t expires;
+    /**
+     * Worker the task runs on, picked when first scheduled and kept after,
+     * so every step of a task runs on the same thread
+     */
+    int worker;
+    void (*run)(struct timer_task *task);
+};
+
+TAILQ_HEAD(timer_list, timer_task);
+
+struct timer_pool;
+
+static inline void timer_task_init(struct timer_task *task, void (*run)(struct timer_task *task))
+{
+    task->worker = -1;
+    task->run = run;
+}
+
+/**
+ * Start a pool of @param nthreads workers, each driving its own
+ * hierarchical timer wheel with a one millisecond tick
+ * @return the pool, or NULL if it could not be started
+ */
+struct timer_pool *timer_pool_create(unsigned int nthreads);
+
+/**
+ * Run @param task on @param pool after @param delay_ms milliseconds.  May be
+ * called from any thread, including from the task itself to schedule its next step.
+ */
+void timer_pool_schedule(struct timer_pool *pool, struct timer_task *task, unsigned int delay_ms);
+
+/**
+ * Stop the workers.  Tasks still scheduled are not run.
+ */
+void timer_pool_destroy(struct timer_pool *pool);
+
+#endif /* TIMER_POOL_H */
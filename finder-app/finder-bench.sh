@@ -0,0 +1,87 @@
+#!/bin/sh
+# Times finder.sh against the native finder on a generated tree
+# usage: finder-bench.sh [numfiles] [benchdir]
+# numfiles are spread over directories of 1000 files, each holding one
+# matching line.  Run from finder-app after make.
+
+set -e
+set -u
+
+NUMFILES=${1:-1000000}
+BENCHDIR=${2:-/tmp/aeld-bench}
+SEARCHSTR=AELD_IS_FUN
+PERDIR=1000
+
+now() {
+	date +%s.%N
+}
+
+elapsed() {
+	awk -v a="$1" -v b="$2" 'BEGIN { printf "%.2f", b - a }'
+}
+
+rm -rf "$BENCHDIR"
+mkdir -p "$BENCHDIR"
+echo "Writing ${NUMFILES} files to ${BENCHDIR}"
+i=0
+while [ $i -lt $(( (NUMFILES + PERDIR - 1) / PERDIR )) ]
+do
+	mkdir "$BENCHDIR/d$i"
+	i=$((i + 1))
+done
+awk -v n="$NUMFILES" -v per="$PERDIR" -v s="$SEARCHSTR" \
+	'BEGIN { for(i = 0; i < n; i++) printf "d%d/f%d.txt\tline %d %s\n", int(i / per), i, i, s }' |
+	./writer -d "$BENCHDIR" -m -
+
+# drop the page cache where allowed so the first run of each starts cold
+sync
+echo 3 > /proc/sys/vm/drop_caches 2> /dev/null || true
+
+for run in cold warm
+do
+	t0=$(now)
+	script=$(./finder.sh "$BENCHDIR" "$SEARCHSTR")
+	t1=$(now)
+	echo "$script"
+	echo "finder.sh $run: $(elapsed "$t0" "$t1") s"
+	[ $run = cold ] && { echo 3 > /proc/sys/vm/drop_caches 2> /dev/null || true; }
+
+	t0=$(now)
+	native=$(./finder "$BENCHDIR" "$SEARCHSTR")
+	t1=$(now)
+	echo "$native"
+	echo "finder $run: $(elapsed "$t0" "$t1") s"
+	if [ "$script" != "$native" ]
+	then
+		echo "results differ"
+		exit 1
+	fi
+done
+
+# the index, built by a first query then used by the next ones
+INDEX="$BENCHDIR.idx"
+RARESTR="line 4242 "
+rm -f "$INDEX"
+# files changed less than 2s before an index is built are read again on every query
+sleep 2
+t0=$(now)
+./finder -i "$INDEX" "$BENCHDIR" "$SEARCHSTR" > /dev/null
+t1=$(now)
+echo "finder -i build: $(elapsed "$t0" "$t1") s, $(wc -c < "$INDEX") bytes"
+for str in "$RARESTR" "$SEARCHSTR"
+do
+	t0=$(now)
+	native=$(./finder "$BENCHDIR" "$str")
+	t1=$(now)
+	indexed=$(./finder -i "$INDEX" "$BENCHDIR" "$str")
+	t2=$(now)
+	echo "$indexed"
+	echo "'$str' finder: $(elapsed "$t0" "$t1") s, finder -i: $(elapsed "$t1" "$t2") s"
+	if [ "$native" != "$indexed" ]
+	then
+		echo "results differ"
+		exit 1
+	fi
+done
+
+rm -rf "$BENCHDIR" "$INDEX"
@@ -53,14 +53,19 @@ fi
 #make clean
 #make
 
+# one writer process for all the files, fed a "path<TAB>string" manifest
 for i in $( seq 1 $NUMFILES)
 do
-#	./writer.sh "$WRITEDIR/${username}$i.txt" "$WRITESTR"
-#	./writer "$WRITEDIR/${username}$i.txt" "$WRITESTR"
-	writer "$WRITEDIR/${username}$i.txt" "$WRITESTR"
-done
+	printf '%s\t%s\n' "${username}$i.txt" "$WRITESTR"
+done | writer -d "$WRITEDIR" -m -
 
-OUTPUTSTRING=$(finder.sh "$WRITEDIR" "$WRITESTR")
+# the native finder walks the tree once, fall back to the script where it is not installed
+if command -v finder > /dev/null 2>&1
+then
+	OUTPUTSTRING=$(finder "$WRITEDIR" "$WRITESTR")
+else
+	OUTPUTSTRING=$(finder.sh "$WRITEDIR" "$WRITESTR")
+fi
 
 #for assignment-4
 writer "/tmp/assignment4-result.txt" "$OUTPUTSTRING"
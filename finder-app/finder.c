@@ -0,0 +1,544 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "trigram_index.h"
+
+/*
+ * finder [-j threads] [-i index] <filesdir> <searchstr>
+ *
+ * Same output as finder.sh: the number of regular files under filesdir and
+ * the number of lines in them containing searchstr, taken literally.
+ * Directories are walked in parallel, each worker taking directories from
+ * its own deque and stealing from the others when it runs dry.
+ *
+ * With -i, the trigram index at that path narrows the files to read down to
+ * the ones holding all trigrams of searchstr.  The walk still stats every
+ * file: those changed since the index was written, or not in it, are read
+ * in full, and the index is then rewritten with them.
+ */
+
+/* files shorter than this are read into a per-thread buffer, mapping costs more than the copy */
+#define MMAP_MIN    (64 * 1024)
+#define READ_BUF    MMAP_MIN
+
+struct deque {
+    pthread_mutex_t lock;
+    char **dirs;
+    size_t head;
+    size_t tail;
+    size_t cap;
+};
+
+struct worker {
+    pthread_t thread;
+    unsigned int id;
+    struct deque queue;
+    char *buf;
+    uint64_t files;
+    uint64_t lines;
+    /**
+     * With an index: the files read again and their trigrams, back to back in the same order
+     */
+    struct trigram_set set;
+    struct trigram_file *changed;
+    size_t nchanged;
+    size_t changed_cap;
+    uint32_t *trigrams;
+    size_t ntrigrams;
+    size_t trigrams_cap;
+    bool failed;            /* out of memory, the index can't be rewritten */
+};
+
+static struct worker *workers;
+static unsigned int nworkers;
+static const char *needle;
+static size_t needle_len;
+/* directories queued or being read, the walk is over when it drops to 0 */
+static size_t pending;
+static size_t root_len;
+
+static bool indexing;
+static struct trigram_index idx;
+/* entries of idx holding all trigrams of the needle */
+static uint8_t *candidate;
+/* entries of idx still fresh, to be kept in the new index */
+static uint8_t *keep;
+
+static bool push(struct deque *q, char *dir)
+{
+    pthread_mutex_lock(&q->lock);
+    if(q->tail == q->cap){
+        if(q->head > 0){
+            memmove(q->dirs, q->dirs + q->head, (q->tail - q->head) * sizeof(char *));
+            q->tail -= q->head;
+            q->head = 0;
+        }
+        if(q->tail == q->cap){
+            size_t cap = q->cap ? q->cap * 2 : 64;
+            char **dirs = realloc(q->dirs, cap * sizeof(char *));
+            if(dirs == NULL){
+                pthread_mutex_unlock(&q->lock);
+                return false;
+            }
+            q->dirs = dirs;
+            q->cap = cap;
+        }
+    }
+    q->dirs[q->tail++] = dir;
+    pthread_mutex_unlock(&q->lock);
+    return true;
+}
+
+/* the owner takes the newest directory, keeping its walk depth first */
+static char *pop(struct deque *q)
+{
+    char *dir = NULL;
+    pthread_mutex_lock(&q->lock);
+    if(q->tail > q->head){
+        dir = q->dirs[--q->tail];
+    }
+    pthread_mutex_unlock(&q->lock);
+    return dir;
+}
+
+/* thieves take the oldest, closest to the root so likely the biggest subtree */
+static char *steal(struct deque *q)
+{
+    char *dir = NULL;
+    if(pthread_mutex_trylock(&q->lock) != 0){
+        return NULL;
+    }
+    if(q->tail > q->head){
+        dir = q->dirs[q->head++];
+    }
+    pthread_mutex_unlock(&q->lock);
+    return dir;
+}
+
+/**
+ * @return the first occurrence of the needle in @param hay, NULL if none.
+ * The vector loop compares the first and the last needle byte at 16
+ * positions at once and only checks the rest where both match.
+ */
+static const char *search(const char *hay, size_t n)
+{
+    size_t m = needle_len;
+    size_t i = 0;
+
+    if(m == 0){
+        return hay;
+    }
+    if(m == 1){
+        return memchr(hay, needle[0], n);
+    }
+    if(n < m){
+        return NULL;
+    }
+#if defined(__SSE2__)
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    for(; i + m - 1 + 16 <= n; i += 16){
+        __m128i block_first = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i block_last = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+                                                            _mm_cmpeq_epi8(last, block_last)));
+        while(mask != 0){
+            unsigned int bit = __builtin_ctz(mask);
+            if(memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0){
+                return hay + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__ARM_NEON)
+    const uint8x16_t first = vdupq_n_u8(needle[0]);
+    const uint8x16_t last = vdupq_n_u8(needle[m - 1]);
+    for(; i + m - 1 + 16 <= n; i += 16){
+        uint8x16_t eq = vandq_u8(vceqq_u8(first, vld1q_u8((const uint8_t *)hay + i)),
+                                 vceqq_u8(last, vld1q_u8((const uint8_t *)hay + i + m - 1)));
+        uint64_t halves[2];
+        /* 4 bits per byte, so the mask fits in 64 bits */
+        uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+        vst1_u8((uint8_t *)halves, narrowed);
+        uint64_t mask = halves[0];
+        while(mask != 0){
+            unsigned int bit = __builtin_ctzll(mask) / 4;
+            if(memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0){
+                return hay + i + bit;
+            }
+            mask &= ~(0xfULL << (bit * 4));
+        }
+    }
+#endif
+    const char *hit = memmem(hay + i, n - i, needle, m);
+    return hit;
+}
+
+/**
+ * @return the number of lines of @param data containing the needle,
+ * a last line without newline included, as grep counts them
+ */
+static uint64_t count_lines(const char *data, size_t len)
+{
+    const char *p = data;
+    const char *end = data + len;
+    uint64_t lines = 0;
+
+    while(p < end){
+        const char *hit = search(p, end - p);
+        if(hit == NULL){
+            break;
+        }
+        lines++;
+        const char *nl = memchr(hit, '\n', end - hit);
+        if(nl == NULL){
+            break;
+        }
+        p = nl + 1;
+    }
+    return lines;
+}
+
+static void scan_data(struct worker *w, const char *data, size_t len, struct trigram_file *file)
+{
+    w->lines += count_lines(data, len);
+    if(file != NULL){
+        size_t start = w->ntrigrams;
+        if(!trigram_set_add(&w->set, data, len, &w->trigrams, &w->ntrigrams, &w->trigrams_cap)){
+            w->failed = true;
+        }
+        trigram_set_reset(&w->set, w->trigrams + start, w->ntrigrams - start);
+        file->ntrigrams = w->ntrigrams - start;
+    }
+}
+
+/**
+ * Count the matching lines of @param name, and collect its trigrams in
+ * @param file if not NULL
+ */
+static void scan_file(struct worker *w, int dirfd, const char *name, struct trigram_file *file)
+{
+    struct stat st;
+    int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if(fd == -1){
+        return;
+    }
+    /* most files fit the buffer, saving the fstat */
+    ssize_t n = read(fd, w->buf, READ_BUF);
+    if(n > 0 && n < READ_BUF){
+        scan_data(w, w->buf, n, file);
+    }
+    else if(n == READ_BUF && fstat(fd, &st) == 0){
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(map != MAP_FAILED){
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            scan_data(w, map, st.st_size, file);
+            munmap(map, st.st_size);
+        }
+    }
+    close(fd);
+}
+
+/**
+ * Keep the index entry of the file @param name in @param path if still
+ * fresh, reading the file only if a candidate, else read it and queue it
+ * for the new index
+ */
+static void index_file(struct worker *w, int dirfd, const char *path, const char *name)
+{
+    const char *prefix = path[root_len] == '/' ? path + root_len + 1 : "";
+    size_t prefix_len = strlen(prefix), name_len = strlen(name);
+    char rel[PATH_MAX];
+    struct stat st;
+
+    if(prefix_len + name_len + 2 > sizeof(rel) || fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0){
+        scan_file(w, dirfd, name, NULL);
+        return;
+    }
+    memcpy(rel, prefix, prefix_len);
+    if(prefix_len > 0){
+        rel[prefix_len++] = '/';
+    }
+    memcpy(rel + prefix_len, name, name_len + 1);
+    int64_t id = trigram_index_lookup(&idx, rel);
+    if(id >= 0 && trigram_index_fresh(&idx, id, &st)){
+        keep[id] = 1;
+        if(candidate[id]){
+            scan_file(w, dirfd, name, NULL);
+        }
+        return;
+    }
+    if(w->nchanged == w->changed_cap){
+        size_t cap = w->changed_cap ? w->changed_cap * 2 : 256;
+        struct trigram_file *changed = realloc(w->changed, cap * sizeof(*changed));
+        if(changed == NULL){
+            w->failed = true;
+            scan_file(w, dirfd, name, NULL);
+            return;
+        }
+        w->changed = changed;
+        w->changed_cap = cap;
+    }
+    char *copy = strdup(rel);
+    if(copy == NULL){
+        w->failed = true;
+        scan_file(w, dirfd, name, NULL);
+        return;
+    }
+    struct trigram_file *file = &w->changed[w->nchanged++];
+    trigram_file_init(file, copy, &st);
+    scan_file(w, dirfd, name, file);
+}
+
+/**
+ * Count the files of @param path and queue its subdirectories
+ */
+static void scan_dir(struct worker *w, char *path)
+{
+    struct dirent *de;
+    DIR *dir = opendir(path);
+    if(dir == NULL){
+        return;
+    }
+    int fd = dirfd(dir);
+    size_t len = strlen(path);
+    while((de = readdir(dir)) != NULL){
+        unsigned char type = de->d_type;
+        if(type == DT_UNKNOWN){
+            struct stat st;
+            if(fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0){
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if(type == DT_REG){
+            w->files++;
+            if(indexing){
+                index_file(w, fd, path, de->d_name);
+            }
+            else{
+                scan_file(w, fd, de->d_name, NULL);
+            }
+        }
+        else if(type == DT_DIR && strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0){
+            size_t name_len = strlen(de->d_name);
+            char *sub = malloc(len + name_len + 2);
+            if(sub == NULL){
+                continue;
+            }
+            memcpy(sub, path, len);
+            sub[len] = '/';
+            memcpy(sub + len + 1, de->d_name, name_len + 1);
+            __atomic_fetch_add(&pending, 1, __ATOMIC_RELAXED);
+            if(!push(&w->queue, sub)){
+                /* out of queue space, walk it right here */
+                scan_dir(w, sub);
+                free(sub);
+                __atomic_fetch_sub(&pending, 1, __ATOMIC_RELEASE);
+            }
+        }
+    }
+    closedir(dir);
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    unsigned int victim = w->id;
+
+    for(;;){
+        char *dir = pop(&w->queue);
+        unsigned int tries;
+        for(tries = 0; dir == NULL && tries < nworkers; tries++){
+            victim = (victim + 1) % nworkers;
+            if(victim != w->id){
+                dir = steal(&workers[victim].queue);
+            }
+        }
+        if(dir == NULL){
+            if(__atomic_load_n(&pending, __ATOMIC_ACQUIRE) == 0){
+                break;
+            }
+            sched_yield();
+            continue;
+        }
+        scan_dir(w, dir);
+        free(dir);
+        __atomic_fetch_sub(&pending, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/**
+ * Rewrite the index if the walk found any file changed, added or removed
+ */
+static void update_index(const char *index_path, const char *root, int64_t started)
+{
+    struct trigram_file *changed = NULL;
+    size_t nchanged = 0, i;
+    bool dirty = false, failed = false;
+    unsigned int n;
+
+    for(i = 0; i < idx.nfiles && !dirty; i++){
+        dirty = !keep[i];
+    }
+    for(n = 0; n < nworkers; n++){
+        nchanged += workers[n].nchanged;
+        failed |= workers[n].failed;
+    }
+    if(!dirty && nchanged == 0){
+        return;
+    }
+    if(!failed){
+        changed = malloc((nchanged + 1) * sizeof(*changed));
+    }
+    if(changed == NULL){
+        fprintf(stderr, "finder: out of memory, index %s not updated\n", index_path);
+        return;
+    }
+    nchanged = 0;
+    for(n = 0; n < nworkers; n++){
+        const uint32_t *trigrams = workers[n].trigrams;
+        for(i = 0; i < workers[n].nchanged; i++){
+            changed[nchanged] = workers[n].changed[i];
+            changed[nchanged++].trigrams = trigrams;
+            trigrams += workers[n].changed[i].ntrigrams;
+        }
+    }
+    if(trigram_index_write(&idx, keep, changed, nchanged, index_path, root, started) != 0){
+        fprintf(stderr, "finder: writing index %s: %s\n", index_path, strerror(errno));
+    }
+    free(changed);
+}
+
+int main(int argc, char *argv[])
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t files = 0, lines = 0;
+    const char *index_path = NULL;
+    char *absroot = NULL;
+    struct timespec started;
+    struct stat st;
+    unsigned int i;
+    int opt;
+
+    nworkers = cpus > 0 ? cpus : 1;
+    while((opt = getopt(argc, argv, "j:i:")) != -1){
+        switch(opt){
+            case 'j': nworkers = atoi(optarg); break;
+            case 'i': index_path = optarg; break;
+            default:
+                printf("usage: %s [-j threads] [-i index] filesdir searchstr\n", argv[0]);
+                return 1;
+        }
+    }
+    if(argc - optind != 2 || nworkers < 1){
+        printf("require only 2 arguments\n");
+        return 1;
+    }
+    const char *filesdir = argv[optind];
+    needle = argv[optind + 1];
+    needle_len = strlen(needle);
+    if(stat(filesdir, &st) != 0 || !S_ISDIR(st.st_mode)){
+        printf("%s not a dir\n", filesdir);
+        return 1;
+    }
+
+    workers = calloc(nworkers, sizeof(*workers));
+    char *root = strdup(filesdir);
+    if(workers == NULL || root == NULL){
+        perror("finder");
+        return 1;
+    }
+    unsigned int allocated = nworkers;
+    if(index_path != NULL){
+        size_t count;
+        absroot = realpath(filesdir, NULL);
+        if(absroot == NULL || !trigram_index_open(&idx, index_path, absroot)){
+            perror("finder");
+            return 1;
+        }
+        uint32_t *ids = trigram_index_candidates(&idx, needle, needle_len, &count);
+        keep = calloc((size_t)idx.nfiles + 1, 1);
+        candidate = calloc((size_t)idx.nfiles + 1, 1);
+        if(ids == NULL || keep == NULL || candidate == NULL){
+            perror("finder");
+            return 1;
+        }
+        for(size_t j = 0; j < count; j++){
+            candidate[ids[j]] = 1;
+        }
+        free(ids);
+        indexing = true;
+        clock_gettime(CLOCK_REALTIME, &started);
+    }
+    for(i = 0; i < nworkers; i++){
+        workers[i].id = i;
+        pthread_mutex_init(&workers[i].queue.lock, NULL);
+        workers[i].buf = malloc(READ_BUF);
+        if(workers[i].buf == NULL || (indexing && !trigram_set_init(&workers[i].set))){
+            perror("finder");
+            return 1;
+        }
+    }
+    root_len = strlen(root);
+    pending = 1;
+    push(&workers[0].queue, root);
+
+    for(i = 1; i < nworkers; i++){
+        if(pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0){
+            /* the workers already started take over its share */
+            nworkers = i;
+            break;
+        }
+    }
+    worker_main(&workers[0]);
+    for(i = 1; i < nworkers; i++){
+        pthread_join(workers[i].thread, NULL);
+    }
+    if(indexing){
+        update_index(index_path, absroot, started.tv_sec * 1000000000LL + started.tv_nsec);
+    }
+    for(i = 0; i < allocated; i++){
+        files += workers[i].files;
+        lines += workers[i].lines;
+        free(workers[i].queue.dirs);
+        free(workers[i].buf);
+        for(size_t j = 0; j < workers[i].nchanged; j++){
+            free(workers[i].changed[j].path);
+        }
+        free(workers[i].changed);
+        free(workers[i].trigrams);
+        trigram_set_free(&workers[i].set);
+    }
+    free(workers);
+    if(indexing){
+        trigram_index_close(&idx);
+        free(keep);
+        free(candidate);
+        free(absroot);
+    }
+
+    printf("The number of files are %llu and the number of matching lines are %llu\n",
+           (unsigned long long)files, (unsigned long long)lines);
+    return 0;
+}
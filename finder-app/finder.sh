@@ -28,6 +28,7 @@ then
     exit 1
 fi
 
-X=$(find $filesdir -type f | wc -l)
-Y=$(grep -r $searchstr $filesdir | wc -l)
+X=$(find "$filesdir" -type f | wc -l)
+# -F and quoting so searchstr is matched as is, spaces and regex characters included
+Y=$(grep -r -F -- "$searchstr" "$filesdir" | wc -l)
 echo "The number of files are $X and the number of matching lines are $Y" 
\ No newline at end of file
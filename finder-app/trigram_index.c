@@ -0,0 +1,564 @@
+#define _GNU_SOURCE
+#include "trigram_index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+ * Layout, all integers in host order:
+ *   header, root path, file entries, paths, posting lists, trigram entries
+ * A posting list is the LEB128 encoded gaps between its ascending file ids,
+ * the first one counted from 0.
+ */
+#define TRIGRAM_MAGIC    "FINDTRI"
+#define TRIGRAM_VERSION  1
+#define TRIGRAMS         (1 << 24)
+/* changes within this long before the index was built may not show in the stat data */
+#define RACY_NS          2000000000LL
+
+struct trigram_index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t nfiles;
+    uint64_t ntrigrams;
+    int64_t started;
+    uint64_t root_len;
+    uint64_t files_off;
+    uint64_t paths_off;
+    uint64_t paths_len;
+    uint64_t postings_off;
+    uint64_t postings_len;
+    uint64_t trigrams_off;
+};
+
+struct trigram_index_entry {
+    uint32_t trigram;
+    uint32_t count;
+    uint64_t offset;        /* of the posting list in the postings */
+};
+
+static uint64_t path_hash(const char *path)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while(*path){
+        h = (h ^ (unsigned char)*path++) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static inline int64_t ts_ns(const struct timespec *ts)
+{
+    return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static inline uint64_t get_varint(const uint8_t **p, const uint8_t *end)
+{
+    uint64_t v = 0;
+    int shift = 0;
+    while(*p < end){
+        uint8_t b = *(*p)++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if((b & 0x80) == 0){
+            break;
+        }
+        shift += 7;
+    }
+    return v;
+}
+
+static inline void put_varint(FILE *f, uint64_t v, uint64_t *written)
+{
+    while(v >= 0x80){
+        putc_unlocked((v & 0x7f) | 0x80, f);
+        v >>= 7;
+        (*written)++;
+    }
+    putc_unlocked(v, f);
+    (*written)++;
+}
+
+static bool valid(const struct trigram_index_header *h, size_t len, const char *root)
+{
+    if(len < sizeof(*h) || memcmp(h->magic, TRIGRAM_MAGIC, sizeof(TRIGRAM_MAGIC)) != 0 ||
+       h->version != TRIGRAM_VERSION){
+        return false;
+    }
+    if(h->root_len != strlen(root) || sizeof(*h) + h->root_len > len ||
+       memcmp((const char *)(h + 1), root, h->root_len) != 0){
+        return false;
+    }
+    return h->files_off + (uint64_t)h->nfiles * sizeof(struct trigram_index_file) <= len &&
+           h->paths_off + h->paths_len <= len && h->postings_off + h->postings_len <= len &&
+           h->trigrams_off + h->ntrigrams * sizeof(struct trigram_index_entry) <= len &&
+           (h->paths_len == 0 || ((const char *)h)[h->paths_off + h->paths_len - 1] == '\0');
+}
+
+bool trigram_index_open(struct trigram_index *idx, const char *path, const char *root)
+{
+    struct stat st;
+    uint32_t i;
+
+    memset(idx, 0, sizeof(*idx));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd != -1){
+        if(fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct trigram_index_header)){
+            void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(map != MAP_FAILED){
+                if(valid(map, st.st_size, root)){
+                    idx->map = map;
+                    idx->map_len = st.st_size;
+                }
+                else{
+                    munmap(map, st.st_size);
+                }
+            }
+        }
+        close(fd);
+    }
+    if(idx->map == NULL){
+        return true;
+    }
+
+    const char *base = idx->map;
+    idx->header = idx->map;
+    idx->nfiles = idx->header->nfiles;
+    idx->files = (const struct trigram_index_file *)(base + idx->header->files_off);
+    idx->paths = base + idx->header->paths_off;
+    idx->ntrigrams = idx->header->ntrigrams;
+    idx->trigrams = (const struct trigram_index_entry *)(base + idx->header->trigrams_off);
+    idx->postings = (const uint8_t *)base + idx->header->postings_off;
+
+    size_t slots = 16;
+    while(slots < (size_t)idx->nfiles * 2){
+        slots *= 2;
+    }
+    idx->table = calloc(slots, sizeof(*idx->table));
+    if(idx->table == NULL){
+        trigram_index_close(idx);
+        return false;
+    }
+    idx->table_mask = slots - 1;
+    for(i = 0; i < idx->nfiles; i++){
+        if(idx->files[i].path >= idx->header->paths_len){
+            /* corrupt, start over */
+            trigram_index_close(idx);
+            return true;
+        }
+        size_t slot = path_hash(trigram_index_path(idx, i)) & idx->table_mask;
+        while(idx->table[slot] != 0){
+            slot = (slot + 1) & idx->table_mask;
+        }
+        idx->table[slot] = i + 1;
+    }
+    return true;
+}
+
+int64_t trigram_index_lookup(const struct trigram_index *idx, const char *relpath)
+{
+    if(idx->table == NULL){
+        return -1;
+    }
+    size_t slot = path_hash(relpath) & idx->table_mask;
+    while(idx->table[slot] != 0){
+        uint32_t id = idx->table[slot] - 1;
+        if(strcmp(trigram_index_path(idx, id), relpath) == 0){
+            return id;
+        }
+        slot = (slot + 1) & idx->table_mask;
+    }
+    return -1;
+}
+
+bool trigram_index_fresh(const struct trigram_index *idx, uint32_t id, const struct stat *st)
+{
+    const struct trigram_index_file *f = &idx->files[id];
+    int64_t ctime_ns = ts_ns(&st->st_ctim);
+    return f->size == (uint64_t)st->st_size && f->ino == st->st_ino &&
+           f->mtime_ns == ts_ns(&st->st_mtim) && f->ctime_ns == ctime_ns &&
+           ctime_ns + RACY_NS <= idx->header->started;
+}
+
+static const struct trigram_index_entry *find_trigram(const struct trigram_index *idx, uint32_t trigram)
+{
+    uint64_t lo = 0, hi = idx->ntrigrams;
+    while(lo < hi){
+        uint64_t mid = lo + (hi - lo) / 2;
+        if(idx->trigrams[mid].trigram < trigram){
+            lo = mid + 1;
+        }
+        else{
+            hi = mid;
+        }
+    }
+    return lo < idx->ntrigrams && idx->trigrams[lo].trigram == trigram ? &idx->trigrams[lo] : NULL;
+}
+
+static int by_count(const void *a, const void *b)
+{
+    const struct trigram_index_entry *x = *(const struct trigram_index_entry * const *)a;
+    const struct trigram_index_entry *y = *(const struct trigram_index_entry * const *)b;
+    return (x->count > y->count) - (x->count < y->count);
+}
+
+uint32_t *trigram_index_candidates(const struct trigram_index *idx, const char *needle, size_t len,
+                                   size_t *count)
+{
+    const uint8_t *end = idx->postings + (idx->header ? idx->header->postings_len : 0);
+    const struct trigram_index_entry **lists;
+    uint32_t *ids;
+    size_t nlists = 0, n = 0, i, j;
+
+    *count = 0;
+    if(len < 3){
+        ids = malloc(((size_t)idx->nfiles + 1) * sizeof(*ids));
+        if(ids != NULL){
+            for(n = 0; n < idx->nfiles; n++){
+                ids[n] = n;
+            }
+            *count = n;
+        }
+        return ids;
+    }
+    lists = malloc((len - 2) * sizeof(*lists));
+    if(lists == NULL){
+        return NULL;
+    }
+    for(i = 0; i + 2 < len; i++){
+        uint32_t t = (uint8_t)needle[i] << 16 | (uint8_t)needle[i + 1] << 8 | (uint8_t)needle[i + 2];
+        const struct trigram_index_entry *e = find_trigram(idx, t);
+        if(e == NULL){
+            /* no file holds this one */
+            free(lists);
+            return malloc(sizeof(*ids));
+        }
+        lists[nlists++] = e;
+    }
+    /* start from the shortest list, the others can only shrink it */
+    qsort(lists, nlists, sizeof(*lists), by_count);
+    ids = malloc(((size_t)lists[0]->count + 1) * sizeof(*ids));
+    if(ids == NULL){
+        free(lists);
+        return NULL;
+    }
+    const uint8_t *p = idx->postings + lists[0]->offset;
+    uint64_t id = 0;
+    for(j = 0; j < lists[0]->count && p < end; j++){
+        id += get_varint(&p, end);
+        ids[n++] = id;
+    }
+    for(i = 1; i < nlists && n > 0; i++){
+        size_t kept = 0, k = 0;
+        p = idx->postings + lists[i]->offset;
+        id = 0;
+        for(j = 0; j < lists[i]->count && p < end && k < n; j++){
+            id += get_varint(&p, end);
+            while(k < n && ids[k] < id){
+                k++;
+            }
+            if(k < n && ids[k] == id){
+                ids[kept++] = id;
+                k++;
+            }
+        }
+        n = kept;
+    }
+    free(lists);
+    *count = n;
+    return ids;
+}
+
+/**
+ * Sort the (trigram << 32 | id) keys of @param keys by trigram, keeping
+ * the order of equal trigrams, @param tmp being as large
+ */
+static void sort_by_trigram(uint64_t *keys, uint64_t *tmp, size_t n)
+{
+    size_t counts[256];
+    int shift;
+    size_t i;
+
+    for(shift = 32; shift < 56; shift += 8){
+        memset(counts, 0, sizeof(counts));
+        for(i = 0; i < n; i++){
+            counts[(keys[i] >> shift) & 0xff]++;
+        }
+        size_t sum = 0;
+        for(i = 0; i < 256; i++){
+            size_t c = counts[i];
+            counts[i] = sum;
+            sum += c;
+        }
+        for(i = 0; i < n; i++){
+            tmp[counts[(keys[i] >> shift) & 0xff]++] = keys[i];
+        }
+        uint64_t *swap = keys;
+        keys = tmp;
+        tmp = swap;
+    }
+    /* after an odd number of passes the sorted keys are in the caller's tmp */
+    memcpy(tmp, keys, n * sizeof(*keys));
+}
+
+static void pad(FILE *f, uint64_t *off)
+{
+    while(*off % 8 != 0){
+        putc_unlocked(0, f);
+        (*off)++;
+    }
+}
+
+int trigram_index_write(const struct trigram_index *old, const uint8_t *keep,
+                        const struct trigram_file *files, size_t nfiles,
+                        const char *path, const char *root, int64_t started)
+{
+    struct trigram_index_header h = { .version = TRIGRAM_VERSION };
+    struct trigram_index_entry *entries = NULL;
+    size_t nentries = 0, entries_cap = 0;
+    uint32_t *remap = NULL;
+    uint64_t *keys = NULL, *tmp = NULL;
+    size_t nkeys = 0, i, j;
+    uint32_t nkept = 0;
+    char tmppath[4096];
+    FILE *f = NULL;
+    int saved;
+
+    if(snprintf(tmppath, sizeof(tmppath), "%s.tmp", path) >= (int)sizeof(tmppath)){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    remap = malloc(((size_t)old->nfiles + 1) * sizeof(*remap));
+    if(remap == NULL){
+        goto err;
+    }
+    for(i = 0; i < old->nfiles; i++){
+        remap[i] = keep[i] ? nkept++ : UINT32_MAX;
+    }
+    if(nkept + nfiles > UINT32_MAX){
+        errno = EOVERFLOW;
+        goto err;
+    }
+    for(i = 0; i < nfiles; i++){
+        nkeys += files[i].ntrigrams;
+    }
+    keys = malloc((nkeys + 1) * sizeof(*keys));
+    tmp = malloc((nkeys + 1) * sizeof(*tmp));
+    if(keys == NULL || tmp == NULL){
+        goto err;
+    }
+    nkeys = 0;
+    for(i = 0; i < nfiles; i++){
+        uint64_t id = nkept + i;
+        for(j = 0; j < files[i].ntrigrams; j++){
+            keys[nkeys++] = (uint64_t)files[i].trigrams[j] << 32 | id;
+        }
+    }
+    sort_by_trigram(keys, tmp, nkeys);
+    free(tmp);
+    tmp = NULL;
+
+    f = fopen(tmppath, "w");
+    if(f == NULL){
+        goto err;
+    }
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+    memcpy(h.magic, TRIGRAM_MAGIC, sizeof(TRIGRAM_MAGIC));
+    h.nfiles = nkept + nfiles;
+    h.started = started;
+    h.root_len = strlen(root);
+    uint64_t off = sizeof(h);
+    fwrite(&h, sizeof(h), 1, f);
+    fwrite(root, h.root_len, 1, f);
+    off += h.root_len;
+    pad(f, &off);
+
+    h.files_off = off;
+    uint64_t path_off = 0;
+    for(i = 0; i < (size_t)old->nfiles + nfiles; i++){
+        struct trigram_index_file e;
+        const char *p;
+        if(i < old->nfiles){
+            if(!keep[i]){
+                continue;
+            }
+            e = old->files[i];
+            p = trigram_index_path(old, i);
+        }
+        else{
+            const struct trigram_file *file = &files[i - old->nfiles];
+            e.size = file->size;
+            e.mtime_ns = file->mtime_ns;
+            e.ctime_ns = file->ctime_ns;
+            e.ino = file->ino;
+            p = file->path;
+        }
+        e.path = path_off;
+        path_off += strlen(p) + 1;
+        fwrite(&e, sizeof(e), 1, f);
+        off += sizeof(e);
+    }
+    h.paths_off = off;
+    for(i = 0; i < (size_t)old->nfiles + nfiles; i++){
+        const char *p;
+        if(i < old->nfiles){
+            if(!keep[i]){
+                continue;
+            }
+            p = trigram_index_path(old, i);
+        }
+        else{
+            p = files[i - old->nfiles].path;
+        }
+        fwrite(p, strlen(p) + 1, 1, f);
+    }
+    h.paths_len = path_off;
+    off += path_off;
+
+    /* merge the old lists, less the dropped files, with the new files which all come after */
+    h.postings_off = off;
+    const uint8_t *end = old->postings + (old->header ? old->header->postings_len : 0);
+    uint64_t written = 0;
+    i = 0;
+    j = 0;
+    while(i < old->ntrigrams || j < nkeys){
+        uint32_t t;
+        if(j == nkeys || (i < old->ntrigrams && old->trigrams[i].trigram <= keys[j] >> 32)){
+            t = old->trigrams[i].trigram;
+        }
+        else{
+            t = keys[j] >> 32;
+        }
+        uint64_t start = written, prev = 0;
+        uint32_t count = 0;
+        if(i < old->ntrigrams && old->trigrams[i].trigram == t){
+            const uint8_t *p = old->postings + old->trigrams[i].offset;
+            uint64_t id = 0;
+            for(uint32_t k = 0; k < old->trigrams[i].count && p < end; k++){
+                id += get_varint(&p, end);
+                if(id < old->nfiles && remap[id] != UINT32_MAX){
+                    put_varint(f, remap[id] - prev, &written);
+                    prev = remap[id];
+                    count++;
+                }
+            }
+            i++;
+        }
+        for(; j < nkeys && keys[j] >> 32 == t; j++){
+            uint32_t id = (uint32_t)keys[j];
+            put_varint(f, id - prev, &written);
+            prev = id;
+            count++;
+        }
+        if(count == 0){
+            continue;
+        }
+        if(nentries == entries_cap){
+            size_t cap = entries_cap ? entries_cap * 2 : 4096;
+            struct trigram_index_entry *grown = realloc(entries, cap * sizeof(*entries));
+            if(grown == NULL){
+                goto err;
+            }
+            entries = grown;
+            entries_cap = cap;
+        }
+        entries[nentries++] = (struct trigram_index_entry){ .trigram = t, .count = count, .offset = start };
+    }
+    h.postings_len = written;
+    off += written;
+    pad(f, &off);
+
+    h.trigrams_off = off;
+    h.ntrigrams = nentries;
+    fwrite(entries, sizeof(*entries), nentries, f);
+    rewind(f);
+    fwrite(&h, sizeof(h), 1, f);
+    if(ferror(f) || fclose(f) != 0){
+        f = NULL;
+        goto err;
+    }
+    f = NULL;
+    if(rename(tmppath, path) != 0){
+        goto err;
+    }
+    free(entries);
+    free(keys);
+    free(remap);
+    return 0;
+
+err:
+    saved = errno;
+    if(f != NULL){
+        fclose(f);
+    }
+    unlink(tmppath);
+    free(entries);
+    free(keys);
+    free(tmp);
+    free(remap);
+    errno = saved;
+    return -1;
+}
+
+void trigram_index_close(struct trigram_index *idx)
+{
+    if(idx->map != NULL){
+        munmap(idx->map, idx->map_len);
+    }
+    free(idx->table);
+    memset(idx, 0, sizeof(*idx));
+}
+
+bool trigram_set_init(struct trigram_set *set)
+{
+    set->seen = calloc(TRIGRAMS / 64, sizeof(*set->seen));
+    return set->seen != NULL;
+}
+
+bool trigram_set_add(struct trigram_set *set, const char *data, size_t len,
+                     uint32_t **out, size_t *count, size_t *cap)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint32_t t;
+    size_t i;
+
+    if(len < 3){
+        return true;
+    }
+    t = p[0] << 8 | p[1];
+    for(i = 2; i < len; i++){
+        t = ((t << 8) | p[i]) & (TRIGRAMS - 1);
+        uint64_t bit = 1ULL << (t & 63);
+        if(set->seen[t >> 6] & bit){
+            continue;
+        }
+        if(*count == *cap){
+            size_t grown_cap = *cap ? *cap * 2 : 1024;
+            uint32_t *grown = realloc(*out, grown_cap * sizeof(**out));
+            if(grown == NULL){
+                return false;
+            }
+            *out = grown;
+            *cap = grown_cap;
+        }
+        set->seen[t >> 6] |= bit;
+        (*out)[(*count)++] = t;
+    }
+    return true;
+}
+
+void trigram_set_reset(struct trigram_set *set, const uint32_t *out, size_t count)
+{
+    size_t i;
+    for(i = 0; i < count; i++){
+        set->seen[out[i] >> 6] = 0;
+    }
+}
+
+void trigram_set_free(struct trigram_set *set)
+{
+    free(set->seen);
+    set->seen = NULL;
+}
@@ -0,0 +1,137 @@
+/*
+ * trigram_index.h
+ *
+ * On disk index of a directory tree for finder: every 3 byte sequence found
+ * in the files maps to the list of files holding it.  A file may only
+ * contain a search string if it holds all of the string's trigrams, so a
+ * query just has to check those candidates.  Entries are kept per file with
+ * the stat data they were built from, for finder to tell which ones are
+ * stale and rewrite the index with just those files read again.
+ */
+
+#ifndef TRIGRAM_INDEX_H
+#define TRIGRAM_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+struct trigram_index_file {
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint64_t ino;
+    uint64_t path;          /* offset of the NUL terminated path, relative to the root */
+};
+
+struct trigram_index {
+    void *map;
+    size_t map_len;
+    const struct trigram_index_header *header;
+    const struct trigram_index_file *files;
+    uint32_t nfiles;
+    const char *paths;
+    const struct trigram_index_entry *trigrams;
+    uint64_t ntrigrams;
+    const uint8_t *postings;
+    /**
+     * Open addressed path hash of file id + 1, 0 for an empty slot
+     */
+    uint32_t *table;
+    size_t table_mask;
+};
+
+/**
+ * A file read again for the new index
+ */
+struct trigram_file {
+    char *path;             /* relative to the root */
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint64_t ino;
+    const uint32_t *trigrams;   /* distinct, in any order */
+    size_t ntrigrams;
+};
+
+static inline void trigram_file_init(struct trigram_file *file, char *path, const struct stat *st)
+{
+    file->path = path;
+    file->size = st->st_size;
+    file->mtime_ns = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+    file->ctime_ns = st->st_ctim.tv_sec * 1000000000LL + st->st_ctim.tv_nsec;
+    file->ino = st->st_ino;
+    file->trigrams = NULL;
+    file->ntrigrams = 0;
+}
+
+/**
+ * Collects the distinct trigrams of a buffer, one per thread
+ */
+struct trigram_set {
+    uint64_t *seen;         /* bitmap of all 2^24 trigrams */
+};
+
+/**
+ * Map the index at @param path if it was built for @param root, else leave
+ * @param idx empty so every file is new to it
+ * @return false only if the path hash could not be allocated
+ */
+extern bool trigram_index_open(struct trigram_index *idx, const char *path, const char *root);
+
+/**
+ * @return the id of the file at @param relpath, -1 if not indexed
+ */
+extern int64_t trigram_index_lookup(const struct trigram_index *idx, const char *relpath);
+
+/**
+ * @return true if the entry @param id still describes a file with stat data
+ * @param st.  Files changed shortly before the index was built are never
+ * trusted, a later write may have kept their size and timestamps.
+ */
+extern bool trigram_index_fresh(const struct trigram_index *idx, uint32_t id, const struct stat *st);
+
+static inline const char *trigram_index_path(const struct trigram_index *idx, uint32_t id)
+{
+    return idx->paths + idx->files[id].path;
+}
+
+/**
+ * Find the files holding every trigram of @param needle.  Needles shorter
+ * than a trigram match every file.
+ * @return the sorted ids in a malloc'ed array of @param count entries, NULL
+ * with *count 0 on allocation failure
+ */
+extern uint32_t *trigram_index_candidates(const struct trigram_index *idx, const char *needle, size_t len,
+                                          size_t *count);
+
+/**
+ * Write the index of @param root to @param path: the files of @param old
+ * flagged in @param keep, then @param nfiles new ones.  The file is replaced
+ * atomically.  @param started is when the walk that checked them began.
+ * @return 0, or -1 with errno set
+ */
+extern int trigram_index_write(const struct trigram_index *old, const uint8_t *keep,
+                               const struct trigram_file *files, size_t nfiles,
+                               const char *path, const char *root, int64_t started);
+
+extern void trigram_index_close(struct trigram_index *idx);
+
+extern bool trigram_set_init(struct trigram_set *set);
+
+/**
+ * Append the trigrams of @param data not yet in @param out, growing it as needed
+ * @return false if out could not grow
+ */
+extern bool trigram_set_add(struct trigram_set *set, const char *data, size_t len,
+                            uint32_t **out, size_t *count, size_t *cap);
+
+/**
+ * Forget the trigrams added since the last reset, @param out holding them
+ */
+extern void trigram_set_reset(struct trigram_set *set, const uint32_t *out, size_t count);
+
+extern void trigram_set_free(struct trigram_set *set);
+
+#endif /* TRIGRAM_INDEX_H */
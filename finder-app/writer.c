@@ -1,18 +1,68 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
 #include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef __has_include
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
 
-int main(int argc, char* argv[])
-{
-    FILE *fp;
-    openlog(NULL, 0, LOG_USER);
+/*
+ * writer <file> <string>
+ *   writes string and a newline to file
+ *
+ * writer [-d dir] [-p] [-q depth] [-s] -m manifest|-
+ *   writes every file of the manifest, one "path<TAB>string" line per file,
+ *   paths relative to dir.  -p preallocates each file, -s skips io_uring,
+ *   -q sets how many operations are queued at once.
+ */
 
-    if(argc != 3){
-        syslog(LOG_ERR, "Invalid number of arguments: %d", argc-1);
-        return 1;
+#define DEFAULT_DEPTH 256
+#define OPEN_FLAGS    (O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC)
+
+struct entry {
+    const char *path;
+    const char *content;    /* followed by its newline in the manifest buffer */
+    size_t len;             /* content and newline */
+    int fd;
+    bool done;              /* written or counted as failed, write_sync() skips it */
+    bool closing;           /* close queued on the ring, fd no longer ours to close */
+};
+
+struct batch {
+    int dirfd;
+    bool preallocate;
+    struct entry *entries;
+    size_t count;
+    size_t failed;
+    size_t bytes;
+    /* first failure, for the summary line */
+    const char *failed_path;
+    int failed_errno;
+};
+
+static void record_failure(struct batch *b, struct entry *e, int err)
+{
+    if(b->failed++ == 0){
+        b->failed_path = e->path;
+        b->failed_errno = err;
     }
+}
+
+static int write_single(const char *writefile, const char *writestr)
+{
+    FILE *fp;
 
-    const char *writefile = argv[1];
-    const char *writestr  = argv[2];
     syslog(LOG_DEBUG, "Writing %s to %s", writestr, writefile);
 
     fp = fopen(writefile, "w");
@@ -27,7 +77,471 @@ int main(int argc, char* argv[])
     }
 
     fclose(fp);
-    closelog();
+    return 0;
+}
+
+/**
+ * Read all of @param fd into a buffer ending with a newline
+ */
+static char *read_manifest(int fd, size_t *len)
+{
+    size_t cap = 1 << 16;
+    char *buf = malloc(cap);
+    ssize_t n;
+
+    *len = 0;
+    while(buf != NULL && (n = read(fd, buf + *len, cap - *len - 1)) > 0){
+        *len += n;
+        if(cap - *len - 1 == 0){
+            char *grown = realloc(buf, cap * 2);
+            if(grown == NULL){
+                free(buf);
+                return NULL;
+            }
+            buf = grown;
+            cap *= 2;
+        }
+    }
+    if(buf != NULL && *len > 0 && buf[*len - 1] != '\n'){
+        buf[(*len)++] = '\n';
+    }
+    return buf;
+}
+
+/**
+ * Split the manifest in place: the tab after each path becomes its
+ * terminator, the content keeps its newline so it is written straight from
+ * the buffer
+ */
+static struct entry *parse_manifest(char *buf, size_t len, size_t *count)
+{
+    size_t cap = 1024;
+    struct entry *entries = malloc(cap * sizeof(*entries));
+    char *p = buf;
+    char *end = buf + len;
+
+    *count = 0;
+    while(entries != NULL && p < end){
+        char *nl = memchr(p, '\n', end - p);
+        char *tab = memchr(p, '\t', nl - p);
+        if(tab == NULL){
+            if(nl > p){
+                syslog(LOG_ERR, "manifest line without tab: %.*s", (int)(nl - p), p);
+            }
+            p = nl + 1;
+            continue;
+        }
+        if(*count == cap){
+            struct entry *grown = realloc(entries, cap * 2 * sizeof(*entries));
+            if(grown == NULL){
+                free(entries);
+                return NULL;
+            }
+            entries = grown;
+            cap *= 2;
+        }
+        *tab = '\0';
+        entries[*count].path = p;
+        entries[*count].content = tab + 1;
+        entries[*count].len = nl + 1 - (tab + 1);
+        entries[*count].fd = -1;
+        entries[*count].done = false;
+        entries[*count].closing = false;
+        (*count)++;
+        p = nl + 1;
+    }
+    return entries;
+}
+
+static void write_sync(struct batch *b, size_t first)
+{
+    size_t i;
+
+    for(i = first; i < b->count; i++){
+        struct entry *e = &b->entries[i];
+        if(e->done){
+            continue;
+        }
+        int fd = openat(b->dirfd, e->path, OPEN_FLAGS, 0644);
+        if(fd == -1){
+            record_failure(b, e, errno);
+            continue;
+        }
+        if(b->preallocate){
+            posix_fallocate(fd, 0, e->len);
+        }
+        ssize_t n = write(fd, e->content, e->len);
+        if(n != (ssize_t)e->len){
+            record_failure(b, e, n == -1 ? errno : EIO);
+        }
+        else{
+            b->bytes += n;
+        }
+        close(fd);
+    }
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * Just enough of io_uring, through the raw system calls, for a batch of
+ * openat, fallocate, write and close
+ */
+struct uring {
+    int fd;
+    unsigned int entries;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_len, cq_ring_len, sqes_len;
+    unsigned int queued;
+};
 
+static int uring_setup(struct uring *r, unsigned int entries)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if(r->fd == -1){
+        return -1;
+    }
+    r->entries = p.sq_entries;
+    r->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP){
+        if(r->cq_ring_len > r->sq_ring_len){
+            r->sq_ring_len = r->cq_ring_len;
+        }
+        r->cq_ring_len = r->sq_ring_len;
+    }
+    r->sq_ring = mmap(NULL, r->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      r->fd, IORING_OFF_SQ_RING);
+    if(r->sq_ring == MAP_FAILED){
+        goto err;
+    }
+    if(p.features & IORING_FEAT_SINGLE_MMAP){
+        r->cq_ring = r->sq_ring;
+    }
+    else{
+        r->cq_ring = mmap(NULL, r->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          r->fd, IORING_OFF_CQ_RING);
+        if(r->cq_ring == MAP_FAILED){
+            munmap(r->sq_ring, r->sq_ring_len);
+            goto err;
+        }
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if(r->sqes == MAP_FAILED){
+        if(r->cq_ring != r->sq_ring){
+            munmap(r->cq_ring, r->cq_ring_len);
+        }
+        munmap(r->sq_ring, r->sq_ring_len);
+        goto err;
+    }
+    r->sq_head = (unsigned int *)((char *)r->sq_ring + p.sq_off.head);
+    r->sq_tail = (unsigned int *)((char *)r->sq_ring + p.sq_off.tail);
+    r->sq_mask = (unsigned int *)((char *)r->sq_ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int *)((char *)r->sq_ring + p.sq_off.array);
+    r->cq_head = (unsigned int *)((char *)r->cq_ring + p.cq_off.head);
+    r->cq_tail = (unsigned int *)((char *)r->cq_ring + p.cq_off.tail);
+    r->cq_mask = (unsigned int *)((char *)r->cq_ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
     return 0;
-}
\ No newline at end of file
+
+err:
+    close(r->fd);
+    return -1;
+}
+
+static void uring_close(struct uring *r)
+{
+    munmap(r->sqes, r->sqes_len);
+    if(r->cq_ring != r->sq_ring){
+        munmap(r->cq_ring, r->cq_ring_len);
+    }
+    munmap(r->sq_ring, r->sq_ring_len);
+    close(r->fd);
+}
+
+/* the caller never queues more than the ring holds, see write_uring() */
+static struct io_uring_sqe *uring_sqe(struct uring *r, unsigned char opcode, int fd, __u64 user_data)
+{
+    unsigned int tail = *r->sq_tail + r->queued++;
+    unsigned int index = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    r->sq_array[index] = index;
+    return sqe;
+}
+
+/**
+ * Submit what was queued and wait for @param wait completions
+ */
+static int uring_submit(struct uring *r, unsigned int wait)
+{
+    unsigned int submit = r->queued;
+
+    __atomic_store_n(r->sq_tail, *r->sq_tail + r->queued, __ATOMIC_RELEASE);
+    r->queued = 0;
+    while(submit > 0 || wait > 0){
+        int n = syscall(__NR_io_uring_enter, r->fd, submit, wait, IORING_ENTER_GETEVENTS, NULL, 0);
+        if(n == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        if(n == 0 && submit > 0){
+            errno = EBUSY;
+            return -1;
+        }
+        submit -= n;
+        wait = 0;
+    }
+    return 0;
+}
+
+/**
+ * Call @param fn for each completion until @param count were seen
+ */
+static int uring_reap(struct uring *r, unsigned int count,
+                      void (*fn)(struct batch *b, __u64 user_data, int res), struct batch *b)
+{
+    while(count > 0){
+        unsigned int head = *r->cq_head;
+        unsigned int tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        if(head == tail){
+            if(syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) == -1
+               && errno != EINTR){
+                return -1;
+            }
+            continue;
+        }
+        while(head != tail && count > 0){
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            fn(b, cqe->user_data, cqe->res);
+            head++;
+            count--;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+enum uring_step { STEP_FALLOCATE, STEP_WRITE, STEP_CLOSE };
+
+static void opened(struct batch *b, __u64 user_data, int res)
+{
+    struct entry *e = &b->entries[user_data];
+    if(res < 0){
+        record_failure(b, e, -res);
+        e->done = true;
+    }
+    else{
+        e->fd = res;
+    }
+}
+
+static void written(struct batch *b, __u64 user_data, int res)
+{
+    struct entry *e = &b->entries[user_data >> 2];
+    switch(user_data & 3){
+        case STEP_WRITE:
+            if(res == (int)e->len){
+                b->bytes += res;
+            }
+            else{
+                record_failure(b, e, res < 0 ? -res : EIO);
+            }
+            e->done = true;
+            break;
+        case STEP_CLOSE:
+            e->fd = -1;
+            e->closing = false;
+            break;
+        default:
+            /* preallocation is a hint, a file system without fallocate still gets the write */
+            break;
+    }
+}
+
+/**
+ * Each round queues the openat of a chunk of files and waits for their
+ * descriptors, then queues a linked fallocate, write and close for each of
+ * them.  Hard links keep the close running even if the write failed.
+ * @return the index of the first entry not handled, where write_sync() picks
+ * up, skipping the entries already done
+ */
+static size_t write_uring(struct batch *b, unsigned int depth)
+{
+    struct uring r;
+    unsigned int steps = b->preallocate ? 3 : 2;
+    size_t first, i;
+
+    if(uring_setup(&r, depth) != 0){
+        return 0;
+    }
+    size_t chunk = r.entries / steps;
+    for(first = 0; first < b->count; first += chunk){
+        size_t last = first + chunk < b->count ? first + chunk : b->count;
+        for(i = first; i < last; i++){
+            struct io_uring_sqe *sqe = uring_sqe(&r, IORING_OP_OPENAT, b->dirfd, i);
+            sqe->addr = (unsigned long)b->entries[i].path;
+            sqe->open_flags = OPEN_FLAGS;
+            sqe->len = 0644;
+        }
+        if(uring_submit(&r, last - first) != 0 || uring_reap(&r, last - first, opened, b) != 0){
+            break;
+        }
+
+        unsigned int expected = 0;
+        for(i = first; i < last; i++){
+            struct entry *e = &b->entries[i];
+            struct io_uring_sqe *sqe;
+            if(e->fd == -1){
+                continue;
+            }
+            if(b->preallocate){
+                sqe = uring_sqe(&r, IORING_OP_FALLOCATE, e->fd, i << 2 | STEP_FALLOCATE);
+                sqe->addr = e->len;
+                sqe->flags = IOSQE_IO_HARDLINK;
+            }
+            sqe = uring_sqe(&r, IORING_OP_WRITE, e->fd, i << 2 | STEP_WRITE);
+            sqe->addr = (unsigned long)e->content;
+            sqe->len = e->len;
+            sqe->flags = IOSQE_IO_HARDLINK;
+            uring_sqe(&r, IORING_OP_CLOSE, e->fd, i << 2 | STEP_CLOSE);
+            e->closing = true;
+            expected += steps;
+        }
+        if(uring_submit(&r, expected) != 0 || uring_reap(&r, expected, written, b) != 0){
+            break;
+        }
+    }
+    uring_close(&r);
+    if(first >= b->count){
+        return b->count;
+    }
+    /*
+     * The ring failed part way: write_sync() redoes the entries of this chunk
+     * not done yet.  Descriptors with a close queued may still be closed by
+     * the kernel, so only the others are closed here.
+     */
+    for(i = first; i < b->count && i < first + chunk; i++){
+        if(b->entries[i].fd != -1 && !b->entries[i].closing){
+            close(b->entries[i].fd);
+        }
+        b->entries[i].fd = -1;
+    }
+    return first;
+}
+#endif
+
+static int write_batch(int argc, char *argv[])
+{
+    const char *manifest = NULL;
+    const char *dir = ".";
+    unsigned int depth = DEFAULT_DEPTH;
+    bool use_uring = true;
+    struct batch b;
+    struct timespec t0, t1;
+    size_t len;
+    int opt;
+
+    memset(&b, 0, sizeof(b));
+    while((opt = getopt(argc, argv, "m:d:pq:s")) != -1){
+        switch(opt){
+            case 'm': manifest = optarg; break;
+            case 'd': dir = optarg; break;
+            case 'p': b.preallocate = true; break;
+            case 'q': depth = atoi(optarg); break;
+            case 's': use_uring = false; break;
+            default:
+                fprintf(stderr, "usage: %s <file> <string>\n"
+                        "       %s [-d dir] [-p] [-q depth] [-s] -m manifest|-\n", argv[0], argv[0]);
+                return 1;
+        }
+    }
+    if(manifest == NULL || optind != argc || depth < 3){
+        fprintf(stderr, "usage: %s <file> <string>\n"
+                "       %s [-d dir] [-p] [-q depth] [-s] -m manifest|-\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int mfd = strcmp(manifest, "-") == 0 ? STDIN_FILENO : open(manifest, O_RDONLY | O_CLOEXEC);
+    if(mfd == -1){
+        syslog(LOG_ERR, "open manifest %s failed", manifest);
+        return 1;
+    }
+    char *buf = read_manifest(mfd, &len);
+    if(mfd != STDIN_FILENO){
+        close(mfd);
+    }
+    b.entries = buf ? parse_manifest(buf, len, &b.count) : NULL;
+    if(b.entries == NULL){
+        syslog(LOG_ERR, "reading manifest %s failed", manifest);
+        free(buf);
+        return 1;
+    }
+    b.dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(b.dirfd == -1){
+        syslog(LOG_ERR, "open directory %s failed", dir);
+        free(b.entries);
+        free(buf);
+        return 1;
+    }
+
+    size_t done = 0;
+#ifdef HAVE_IO_URING
+    if(use_uring){
+        done = write_uring(&b, depth);
+    }
+#endif
+    write_sync(&b, done);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    if(b.failed > 0){
+        syslog(LOG_ERR, "Wrote %zu of %zu files, %zu bytes, to %s in %.3f s, %zu failed, first %s: %s",
+               b.count - b.failed, b.count, b.bytes, dir, seconds, b.failed,
+               b.failed_path, strerror(b.failed_errno));
+    }
+    else{
+        syslog(LOG_DEBUG, "Wrote %zu files, %zu bytes, to %s in %.3f s%s",
+               b.count, b.bytes, dir, seconds, done > 0 ? " with io_uring" : "");
+    }
+    close(b.dirfd);
+    free(b.entries);
+    free(buf);
+    return b.failed > 0;
+}
+
+int main(int argc, char* argv[])
+{
+    int rc;
+    openlog(NULL, 0, LOG_USER);
+
+    if(argc == 3 && argv[1][0] != '-'){
+        rc = write_single(argv[1], argv[2]);
+    }
+    else if(argc > 1 && argv[1][0] == '-'){
+        rc = write_batch(argc, argv);
+    }
+    else{
+        syslog(LOG_ERR, "Invalid number of arguments: %d", argc-1);
+        rc = 1;
+    }
+
+    closelog();
+    return rc;
+}
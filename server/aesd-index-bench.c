@@ -0,0 +1,118 @@
+/**
+ * @file aesd-index-bench.c
+ * @brief Startup recovery time of a large aesdsocket data file
+ *
+ * Fills the file with newline terminated records unless it already has the
+ * requested size, then rebuilds the record index with 1, 2, 4 ... threads.
+ * With -c the file is dropped from the page cache before each run, which
+ * is what a restart after a reboot sees.
+ *
+ * usage: aesd-index-bench [-s megabytes] [-l record_bytes] [-j max_threads] [-c] file
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "aesd_index.h"
+
+static int generate(const char *path, off_t size, size_t record_bytes)
+{
+    char buf[1 << 16];
+    off_t written = 0;
+    size_t i;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(fd == -1) {
+        perror(path);
+        return -1;
+    }
+    for(i = 0; i < sizeof(buf); i++) {
+        buf[i] = (i % record_bytes == record_bytes - 1) ? '\n' : 'a' + i % 26;
+    }
+    /* whole records only, so the buffer is cut at a record boundary */
+    size_t chunk = sizeof(buf) - sizeof(buf) % record_bytes;
+    while(written < size) {
+        size_t n = (size - written < (off_t)chunk) ? (size_t)(size - written) : chunk;
+        if(write(fd, buf, n) != (ssize_t)n) {
+            perror("write");
+            close(fd);
+            return -1;
+        }
+        written += n;
+    }
+    fsync(fd);
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct aesd_recover_stats stats;
+    struct aesd_index idx;
+    struct stat st;
+    long megabytes = 1024;
+    size_t record_bytes = 64;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = cpus > 0 ? cpus : 1;
+    bool cold = false;
+    int threads;
+    int opt;
+
+    while((opt = getopt(argc, argv, "s:l:j:c")) != -1) {
+        switch(opt) {
+            case 's': megabytes = atol(optarg); break;
+            case 'l': record_bytes = strtoul(optarg, NULL, 0); break;
+            case 'j': max_threads = atoi(optarg); break;
+            case 'c': cold = true; break;
+            default:
+                fprintf(stderr, "usage: %s [-s megabytes] [-l record_bytes] [-j max_threads] [-c] file\n", argv[0]);
+                return 1;
+        }
+    }
+    if(optind != argc - 1 || megabytes < 1 || record_bytes < 1 || max_threads < 1) {
+        fprintf(stderr, "usage: %s [-s megabytes] [-l record_bytes] [-j max_threads] [-c] file\n", argv[0]);
+        return 1;
+    }
+    const char *path = argv[optind];
+    off_t size = (off_t)megabytes << 20;
+    size -= size % record_bytes;
+
+    if(stat(path, &st) != 0 || st.st_size != size) {
+        if(generate(path, size, record_bytes) != 0) {
+            return 1;
+        }
+    }
+
+    printf("threads,cold,seconds,gb_per_s,records\n");
+    for(threads = 1; ; threads *= 2) {
+        if(threads > max_threads) {
+            threads = max_threads;
+        }
+        int fd = open(path, O_RDWR);
+        if(fd == -1) {
+            perror(path);
+            return 1;
+        }
+        if(cold) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+        if(aesd_index_recover(&idx, fd, threads, &stats) != 0) {
+            perror("recover");
+            return 1;
+        }
+        close(fd);
+        printf("%d,%d,%.3f,%.2f,%zu\n", threads, cold, stats.seconds,
+               size / stats.seconds / 1e9, idx.count);
+        aesd_index_free(&idx);
+        if(threads == max_threads) {
+            break;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,462 @@
+/**
+ * @file aesd-transport-bench.c
+ * @brief Records per second and commit latency of the aesdsocket transports
+ *
+ * tcp and unix run the socket protocol, one connection per record, the
+ * latency taken until the reply ends with that record.  The reply is the
+ * whole data, so these slow down as it grows: run against a fresh file
+ * backend store, and with -t 0 so no timestamp lands after a record, e.g.
+ * "aesdsocket -t 0 -u /tmp/aesdsocket.sock -U 9000".
+ * shm writes each record to a ring and waits for the server to commit it,
+ * shm-stream writes them all and waits once at the end.  udp sends a
+ * datagram per record, 64 to a sendmmsg(), udp-gso 64 records per send
+ * with UDP_SEGMENT.  Nothing acknowledges those, so they are timed until
+ * the file backend store in -d stops growing, and records it never got
+ * are counted as lost.
+ *
+ * -c runs that many producers at once, each on a channel of its own, or
+ * all on the default channel with -S, and adds a line with their aggregate
+ * rate.  The udp modes can't tell the records of producers sharing a
+ * channel apart, so don't use them with -S.
+ *
+ * usage: aesd-transport-bench [-p port] [-u local_socket_path] [-n records]
+ *                             [-l record_bytes] [-s ring_bytes] [-d data_dir]
+ *                             [-c producers [-S]] [-m modes]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "aesd_shm.h"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#define UDP_SEND_BATCH 64
+/* how long the store has to stay the same size for the udp records to be all in */
+#define SETTLE_SECONDS 0.5
+
+/* the line naming this producer's channel, empty for the default one */
+static char preamble[64];
+static int preamble_len;
+static char store_dir[256];
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int by_value(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void make_record(char *rec, int len, const char *mode, int seq)
+{
+    int n = snprintf(rec, len, "%s %d %d ", mode, (int)getpid(), seq);
+    memset(rec + n, 'x', len - n - 1);
+    rec[len - 1] = '\n';
+}
+
+static int connect_to(const char *mode, const char *port, const char *path)
+{
+    int fd;
+    bool udp = strncmp(mode, "udp", 3) == 0;
+
+    if(strcmp(mode, "unix") == 0) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd != -1 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = udp ? SOCK_DGRAM : SOCK_STREAM };
+        struct addrinfo *ai;
+        if(getaddrinfo("127.0.0.1", port, &hints, &ai) != 0) {
+            return -1;
+        }
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if(fd != -1 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(ai);
+    }
+    if(fd != -1) {
+        struct timeval tv = { .tv_sec = 5 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+    return fd;
+}
+
+/**
+ * @return bytes in the files of @param dir, which a channel only gets with
+ * its first record
+ */
+static long long store_bytes(const char *dir)
+{
+    DIR *d = opendir(dir);
+    struct dirent *ent;
+    struct stat st;
+    long long total = 0;
+
+    if(d == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    while((ent = readdir(d)) != NULL) {
+        if(fstatat(dirfd(d), ent->d_name, &st, 0) == 0 && S_ISREG(st.st_mode)) {
+            total += st.st_size;
+        }
+    }
+    closedir(d);
+    return total;
+}
+
+/**
+ * Send @param records datagrams, @param len bytes each
+ */
+static int send_udp(int fd, const char *mode, int records, int len)
+{
+    bool gso = strcmp(mode, "udp-gso") == 0;
+    int size = preamble_len + len;
+    char *buf = malloc((size_t)UDP_SEND_BATCH * size);
+    struct mmsghdr msgs[UDP_SEND_BATCH];
+    struct iovec iov[UDP_SEND_BATCH];
+    int i, j, ret = -1;
+
+    if(buf == NULL) {
+        return -1;
+    }
+    memset(msgs, 0, sizeof(msgs));
+    for(i = 0; i < records; i += UDP_SEND_BATCH) {
+        int n = records - i < UDP_SEND_BATCH ? records - i : UDP_SEND_BATCH;
+        for(j = 0; j < n; j++) {
+            char *datagram = buf + (size_t)j * size;
+            memcpy(datagram, preamble, preamble_len);
+            make_record(datagram + preamble_len, len, mode, i + j);
+            iov[j].iov_base = datagram;
+            iov[j].iov_len = size;
+            msgs[j].msg_hdr.msg_iov = &iov[j];
+            msgs[j].msg_hdr.msg_iovlen = 1;
+        }
+        if(gso) {
+            /* one send, the kernel cuts it in equally sized datagrams */
+            char control[CMSG_SPACE(sizeof(uint16_t))] = { 0 };
+            struct iovec all = { .iov_base = buf, .iov_len = (size_t)n * size };
+            struct msghdr msg = {
+                .msg_iov = &all,
+                .msg_iovlen = 1,
+                .msg_control = control,
+                .msg_controllen = sizeof(control),
+            };
+            struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+            uint16_t segment = size;
+            c->cmsg_level = SOL_UDP;
+            c->cmsg_type = UDP_SEGMENT;
+            c->cmsg_len = CMSG_LEN(sizeof(segment));
+            memcpy(CMSG_DATA(c), &segment, sizeof(segment));
+            if(sendmsg(fd, &msg, 0) == -1) {
+                goto out;
+            }
+        } else {
+            for(j = 0; j < n; ) {
+                int sent = sendmmsg(fd, msgs + j, n - j, 0);
+                if(sent == -1) {
+                    goto out;
+                }
+                j += sent;
+            }
+        }
+    }
+    ret = 0;
+out:
+    free(buf);
+    return ret;
+}
+
+/**
+ * Time @param records datagrams until the store in @param dir has them all
+ * or stopped growing
+ */
+static int run_udp(const char *mode, const char *port, const char *dir, int records, int len)
+{
+    long long base = store_bytes(dir);
+    long long want, size, last;
+    double t0, grown, now;
+    int fd;
+
+    if(base == -1) {
+        fprintf(stderr, "%s: %s: %s\n", mode, dir, strerror(errno));
+        return -1;
+    }
+    fd = connect_to(mode, port, NULL);
+    if(fd == -1) {
+        fprintf(stderr, "%s: connect: %s\n", mode, strerror(errno));
+        return -1;
+    }
+    t0 = now_s();
+    if(send_udp(fd, mode, records, len) != 0) {
+        fprintf(stderr, "%s: send: %s\n", mode, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    want = base + (long long)records * len;
+    last = base;
+    grown = now = now_s();
+    while((size = store_bytes(dir)) < want && now - grown < SETTLE_SECONDS) {
+        usleep(200);
+        now = now_s();
+        if(size != last) {
+            last = size;
+            grown = now;
+        }
+    }
+    if(size >= want) {
+        grown = now_s();
+    } else {
+        size = last;
+    }
+    int stored = (size - base) / len;
+    printf("%s,%d,%d,%.3f,%.0f,,,%d\n", mode, records, len, grown - t0, stored / (grown - t0),
+           records - stored);
+    fflush(stdout);
+    return 0;
+}
+
+/**
+ * Send @param msg, the record @param rec after the preamble, and read the
+ * reply up to its copy of the record
+ */
+static int round_trip(int fd, const char *msg, const char *rec, int len)
+{
+    static char buf[64 * 1024];
+    char *window = calloc(1, len);
+    int ret = -1;
+
+    if(window == NULL || send(fd, msg, preamble_len + len, MSG_NOSIGNAL) != preamble_len + len) {
+        goto out;
+    }
+    for(;;) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if(n <= 0) {
+            goto out;
+        }
+        if(n >= len) {
+            memcpy(window, buf + n - len, len);
+        } else {
+            memmove(window, window + n, len - n);
+            memcpy(window + len - n, buf, n);
+        }
+        if(memcmp(window, rec, len) == 0) {
+            ret = 0;
+            break;
+        }
+    }
+out:
+    free(window);
+    return ret;
+}
+
+static void report(const char *mode, int records, int len, double seconds, double *lat)
+{
+    if(lat != NULL) {
+        qsort(lat, records, sizeof(*lat), by_value);
+        printf("%s,%d,%d,%.3f,%.0f,%.1f,%.1f,0\n", mode, records, len, seconds, records / seconds,
+               lat[records / 2] * 1e6, lat[(int)(records * 0.99)] * 1e6);
+    } else {
+        printf("%s,%d,%d,%.3f,%.0f,,,0\n", mode, records, len, seconds, records / seconds);
+    }
+    fflush(stdout);
+}
+
+static int run(const char *mode, const char *port, const char *path, int records, int len, size_t ring)
+{
+    char *msg = malloc(preamble_len + len);
+    char *rec = msg + preamble_len;
+    double *lat = calloc(records, sizeof(*lat));
+    struct aesd_shm shm;
+    bool use_shm = strncmp(mode, "shm", 3) == 0;
+    bool stream = strcmp(mode, "shm-stream") == 0;
+    int i, ret = -1;
+
+    if(msg == NULL || lat == NULL) {
+        goto out;
+    }
+    memcpy(msg, preamble, preamble_len);
+    if(use_shm && aesd_shm_connect(&shm, path, preamble_len ? preamble : NULL, ring) != 0) {
+        fprintf(stderr, "%s: ring from %s: %s\n", mode, path, strerror(errno));
+        goto out;
+    }
+    double t0 = now_s();
+    for(i = 0; i < records; i++) {
+        make_record(rec, len, mode, i);
+        double start = now_s();
+        if(use_shm) {
+            if(aesd_shm_write(&shm, rec, len) != 0 || (!stream && aesd_shm_flush(&shm) != 0)) {
+                fprintf(stderr, "%s: ring write: %s\n", mode, strerror(errno));
+                goto close;
+            }
+        } else {
+            int fd = connect_to(mode, port, path);
+            if(fd == -1 || round_trip(fd, msg, rec, len) != 0) {
+                fprintf(stderr, "%s: record %d: %s\n", mode, i, strerror(errno));
+                if(fd != -1) {
+                    close(fd);
+                }
+                goto out;
+            }
+            close(fd);
+        }
+        lat[i] = now_s() - start;
+    }
+    if(stream && aesd_shm_flush(&shm) != 0) {
+        fprintf(stderr, "%s: ring flush: %s\n", mode, strerror(errno));
+        goto close;
+    }
+    report(mode, records, len, now_s() - t0, stream ? NULL : lat);
+    ret = 0;
+close:
+    if(use_shm) {
+        aesd_shm_close(&shm);
+    }
+out:
+    free(msg);
+    free(lat);
+    return ret;
+}
+
+/**
+ * Point this producer at channel @param name, the default one if NULL.  The
+ * server keeps a channel's data next to the default one in @param dir, the
+ * ".d" suffix after the name.
+ */
+static void set_channel(const char *name, const char *dir)
+{
+    size_t base = strlen(dir);
+
+    if(name == NULL) {
+        preamble_len = 0;
+        snprintf(store_dir, sizeof(store_dir), "%s", dir);
+        return;
+    }
+    preamble_len = snprintf(preamble, sizeof(preamble), "CHANNEL:%s\n", name);
+    if(base > 2 && strcmp(dir + base - 2, ".d") == 0) {
+        base -= 2;
+    }
+    snprintf(store_dir, sizeof(store_dir), "%.*s.%s.d", (int)base, dir, name);
+}
+
+static int run_mode(const char *mode, const char *port, const char *path, int records, int len, size_t ring)
+{
+    return strncmp(mode, "udp", 3) == 0 ? run_udp(mode, port, store_dir, records, len)
+                                         : run(mode, port, path, records, len, ring);
+}
+
+/**
+ * Run @param producers processes at once, each on channel bench<i> or all on
+ * the default one if @param shared, and report their aggregate rate
+ */
+static int run_producers(const char *mode, int producers, bool shared, const char *dir,
+                         const char *port, const char *path, int records, int len, size_t ring)
+{
+    char name[32];
+    int i, status, failed = 0;
+
+    fflush(stdout);
+    double t0 = now_s();
+    for(i = 0; i < producers; i++) {
+        pid_t pid = fork();
+        if(pid == -1) {
+            perror("fork");
+            failed++;
+            break;
+        }
+        if(pid == 0) {
+            snprintf(name, sizeof(name), "bench%d", i);
+            set_channel(shared ? NULL : name, dir);
+            exit(run_mode(mode, port, path, records, len, ring) == 0 ? 0 : 1);
+        }
+    }
+    while(wait(&status) > 0) {
+        if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed++;
+        }
+    }
+    if(failed > 0) {
+        return -1;
+    }
+    double seconds = now_s() - t0;
+    printf("%s/%d%s,%d,%d,%.3f,%.0f,,,\n", mode, producers, shared ? "shared" : "channels",
+           producers * records, len, seconds, producers * records / seconds);
+    fflush(stdout);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *port = "9000";
+    const char *path = "/tmp/aesdsocket.sock";
+    const char *dir = "/var/tmp/aesdsocketdata.d";
+    char modes[256] = "tcp,unix,shm,shm-stream,udp,udp-gso";
+    int records = 1000;
+    int len = 64;
+    size_t ring = 1024 * 1024;
+    int producers = 0;
+    bool shared = false;
+    int opt;
+
+    while((opt = getopt(argc, argv, "p:u:n:l:s:d:c:Sm:")) != -1) {
+        switch(opt) {
+            case 'p': port = optarg; break;
+            case 'u': path = optarg; break;
+            case 'n': records = atoi(optarg); break;
+            case 'l': len = atoi(optarg); break;
+            case 's': ring = strtoull(optarg, NULL, 0); break;
+            case 'd': dir = optarg; break;
+            case 'c': producers = atoi(optarg); break;
+            case 'S': shared = true; break;
+            case 'm': snprintf(modes, sizeof(modes), "%s", optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-p port] [-u local_socket_path] [-n records] [-l record_bytes]"
+                        " [-s ring_bytes] [-d data_dir] [-c producers [-S]] [-m tcp,unix,shm,shm-stream,udp,udp-gso]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+    if(records < 1 || len < 32) {
+        fprintf(stderr, "need at least 1 record of at least 32 bytes\n");
+        return 1;
+    }
+
+    set_channel(NULL, dir);
+    printf("mode,records,record_bytes,seconds,records_per_s,p50_us,p99_us,lost\n");
+    for(char *save, *mode = strtok_r(modes, ",", &save); mode != NULL; mode = strtok_r(NULL, ",", &save)) {
+        int rc = producers > 0 ? run_producers(mode, producers, shared, dir, port, path, records, len, ring)
+                               : run_mode(mode, port, path, records, len, ring);
+        if(rc != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
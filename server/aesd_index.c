@@ -0,0 +1,178 @@
+/**
+ * @file aesd_index.c
+ * @brief Record index of the aesdsocket data file and startup recovery
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "aesd_index.h"
+
+/* Below this much data per thread the threads cost more than they save */
+#define MIN_CHUNK (4 * 1024 * 1024)
+
+struct scan_chunk {
+    pthread_t thread;
+    int started;
+    const char *map;
+    off_t start;
+    off_t end;
+    struct aesd_index found;
+    int err;
+};
+
+static int index_push(struct aesd_index *idx, off_t end)
+{
+    if(idx->count == idx->cap) {
+        size_t cap = idx->cap ? idx->cap * 2 : 1024;
+        off_t *ends = realloc(idx->ends, cap * sizeof(off_t));
+        if(ends == NULL) {
+            return -1;
+        }
+        idx->ends = ends;
+        idx->cap = cap;
+    }
+    idx->ends[idx->count++] = end;
+    return 0;
+}
+
+int aesd_index_append(struct aesd_index *idx, const char *buf, size_t len)
+{
+    const char *p = buf;
+    const char *nl;
+
+    while((nl = memchr(p, '\n', buf + len - p)) != NULL) {
+        if(index_push(idx, idx->size + (nl - buf) + 1) != 0) {
+            return -1;
+        }
+        p = nl + 1;
+    }
+    idx->size += len;
+    return 0;
+}
+
+static void *scan_chunk(void *arg)
+{
+    struct scan_chunk *c = arg;
+    const char *p = c->map + c->start;
+    const char *end = c->map + c->end;
+    const char *nl;
+
+    while((nl = memchr(p, '\n', end - p)) != NULL) {
+        if(index_push(&c->found, nl - c->map + 1) != 0) {
+            c->err = ENOMEM;
+            break;
+        }
+        p = nl + 1;
+    }
+    return NULL;
+}
+
+int aesd_index_recover(struct aesd_index *idx, int fd, int threads, struct aesd_recover_stats *stats)
+{
+    struct timespec t0, t1;
+    struct scan_chunk *chunks;
+    struct stat st;
+    off_t chunk_size;
+    size_t total = 0;
+    char *map;
+    int err = 0;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    memset(idx, 0, sizeof(*idx));
+    memset(stats, 0, sizeof(*stats));
+    if(fstat(fd, &st) != 0) {
+        return -1;
+    }
+    if(st.st_size == 0) {
+        return 0;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) {
+        return -1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    madvise(map, st.st_size, MADV_WILLNEED);
+
+    if(threads < 1) {
+        threads = 1;
+    }
+    if(st.st_size / threads < MIN_CHUNK) {
+        threads = st.st_size / MIN_CHUNK + 1;
+    }
+    chunks = calloc(threads, sizeof(*chunks));
+    if(chunks == NULL) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+    chunk_size = (st.st_size + threads - 1) / threads;
+    for(i = 0; i < threads; i++) {
+        chunks[i].map = map;
+        chunks[i].start = i * chunk_size;
+        chunks[i].end = (i == threads - 1) ? st.st_size : (i + 1) * chunk_size;
+        /* the first chunk runs here, the others on their own threads */
+        if(i > 0) {
+            chunks[i].started = pthread_create(&chunks[i].thread, NULL, scan_chunk, &chunks[i]) == 0;
+            if(!chunks[i].started) {
+                scan_chunk(&chunks[i]);
+            }
+        }
+    }
+    scan_chunk(&chunks[0]);
+    for(i = 1; i < threads; i++) {
+        if(chunks[i].started) {
+            pthread_join(chunks[i].thread, NULL);
+        }
+    }
+
+    for(i = 0; i < threads; i++) {
+        err = err ? err : chunks[i].err;
+        total += chunks[i].found.count;
+    }
+    if(err == 0 && total > 0) {
+        idx->ends = malloc(total * sizeof(off_t));
+        if(idx->ends == NULL) {
+            err = ENOMEM;
+        }
+    }
+    for(i = 0; i < threads; i++) {
+        if(err == 0) {
+            memcpy(idx->ends + idx->count, chunks[i].found.ends, chunks[i].found.count * sizeof(off_t));
+            idx->count += chunks[i].found.count;
+        }
+        free(chunks[i].found.ends);
+    }
+    free(chunks);
+    munmap(map, st.st_size);
+    if(err) {
+        aesd_index_free(idx);
+        errno = err;
+        return -1;
+    }
+    idx->cap = idx->count;
+    idx->size = aesd_index_committed(idx);
+
+    if(st.st_size > idx->size) {
+        if(ftruncate(fd, idx->size) != 0) {
+            return -1;
+        }
+        stats->torn = st.st_size - idx->size;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    stats->seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    return 0;
+}
+
+void aesd_index_free(struct aesd_index *idx)
+{
+    free(idx->ends);
+    memset(idx, 0, sizeof(*idx));
+}
@@ -0,0 +1,57 @@
+/*
+ * aesd_index.h
+ *
+ * In memory index of the newline terminated records in the aesdsocket data
+ * file, and its reconstruction from the file at startup.
+ */
+
+#ifndef AESD_INDEX_H
+#define AESD_INDEX_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct aesd_index {
+    /**
+     * File offset just past the newline of each record, oldest first
+     */
+    off_t *ends;
+    size_t count;
+    size_t cap;
+    /**
+     * Bytes in the file, a trailing record still waiting for its newline included
+     */
+    off_t size;
+};
+
+struct aesd_recover_stats {
+    off_t torn;           /* bytes of a trailing record without newline that were cut off */
+    double seconds;
+};
+
+/**
+ * @return the number of bytes taken by complete records
+ */
+static inline off_t aesd_index_committed(const struct aesd_index *idx)
+{
+    return idx->count ? idx->ends[idx->count - 1] : 0;
+}
+
+/**
+ * Account for @param len bytes of @param buf appended to the file
+ * @return 0, or -1 if the index could not grow
+ */
+extern int aesd_index_append(struct aesd_index *idx, const char *buf, size_t len);
+
+/**
+ * Rebuild @param idx from the file open for writing on @param fd.  The file
+ * is mmap'ed and split in @param threads chunks scanned for newlines in
+ * parallel.  A trailing partial record, left by a crash in the middle of a
+ * write, is truncated away.
+ * @return 0, or -1 with errno set
+ */
+extern int aesd_index_recover(struct aesd_index *idx, int fd, int threads, struct aesd_recover_stats *stats);
+
+extern void aesd_index_free(struct aesd_index *idx);
+
+#endif /* AESD_INDEX_H */
@@ -0,0 +1,470 @@
+/**
+ * @file aesd_log.c
+ * @brief Segmented storage of the aesdsocket data
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "aesd_log.h"
+
+#define SEGMENT_SUFFIX ".seg"
+#define IOV_BATCH      64
+#define COPY_SIZE      (64 * 1024)
+
+struct recover_job {
+    pthread_t thread;
+    int started;
+    struct aesd_segment **segs;
+    size_t nsegs;
+    size_t first;
+    size_t stride;
+    int threads;
+    off_t torn;
+    int err;
+};
+
+static void segment_path(const struct aesd_log *log, off_t base, char *path, size_t len)
+{
+    snprintf(path, len, "%s/%020lld" SEGMENT_SUFFIX, log->dir, (long long)base);
+}
+
+static void map_segment(const struct aesd_log *log, struct aesd_segment *seg)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    size_t len = log->limits.segment_bytes;
+
+    /* mapped past the end of file, so appends show up without remapping */
+    while(len < (size_t)seg->index.size) {
+        len *= 2;
+    }
+    len = (len + page - 1) / page * page;
+    seg->map = mmap(NULL, len, PROT_READ, MAP_SHARED, seg->fd, 0);
+    if(seg->map == MAP_FAILED) {
+        /* not fatal, the segment is sent with sendfile instead */
+        seg->map = NULL;
+        return;
+    }
+    seg->map_len = len;
+}
+
+static void unmap_segment(struct aesd_segment *seg)
+{
+    if(seg->map != NULL) {
+        munmap(seg->map, seg->map_len);
+        seg->map = NULL;
+        seg->map_len = 0;
+    }
+}
+
+static void free_segment(struct aesd_segment *seg)
+{
+    unmap_segment(seg);
+    if(seg->fd != -1) {
+        close(seg->fd);
+    }
+    aesd_index_free(&seg->index);
+    free(seg);
+}
+
+/**
+ * Start a new segment at @param base and make it the active one
+ */
+static int new_segment(struct aesd_log *log, off_t base)
+{
+    char path[PATH_MAX];
+    struct aesd_segment *seg = calloc(1, sizeof(*seg));
+    if(seg == NULL) {
+        return -1;
+    }
+    segment_path(log, base, path, sizeof(path));
+    seg->fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if(seg->fd == -1) {
+        free(seg);
+        return -1;
+    }
+    seg->base = base;
+    seg->last_write = time(NULL);
+    if(log->limits.mapped_segments > 0) {
+        map_segment(log, seg);
+    }
+    TAILQ_INSERT_TAIL(&log->segments, seg, link);
+    log->nsegments++;
+
+    /* the segment that just fell out of the mapped window */
+    unsigned int i;
+    struct aesd_segment *old = seg;
+    for(i = 0; i < log->limits.mapped_segments && old != NULL; i++) {
+        old = TAILQ_PREV(old, aesd_segment_list, link);
+    }
+    if(old != NULL) {
+        unmap_segment(old);
+    }
+    return 0;
+}
+
+static void drop_segment(struct aesd_log *log, struct aesd_segment *seg, bool remove)
+{
+    char path[PATH_MAX];
+
+    TAILQ_REMOVE(&log->segments, seg, link);
+    log->nsegments--;
+    log->bytes -= seg->index.size;
+    log->records -= seg->index.count;
+    if(remove) {
+        segment_path(log, seg->base, path, sizeof(path));
+        unlink(path);
+    }
+    free_segment(seg);
+}
+
+/**
+ * Drop segments from the old end while over a limit, never the active one
+ */
+static void retain(struct aesd_log *log, time_t now)
+{
+    struct aesd_segment *seg;
+
+    while((seg = TAILQ_FIRST(&log->segments)) != TAILQ_LAST(&log->segments, aesd_segment_list)) {
+        bool over_bytes = log->limits.retain_bytes > 0 && log->bytes > log->limits.retain_bytes;
+        bool over_age = log->limits.retain_seconds > 0 && now - seg->last_write > log->limits.retain_seconds;
+        if(!over_bytes && !over_age) {
+            break;
+        }
+        drop_segment(log, seg, true);
+    }
+}
+
+static int is_segment(const struct dirent *de)
+{
+    size_t len = strlen(de->d_name);
+    size_t suffix = strlen(SEGMENT_SUFFIX);
+    return len > suffix && strcmp(de->d_name + len - suffix, SEGMENT_SUFFIX) == 0;
+}
+
+static void *recover_segments(void *arg)
+{
+    struct recover_job *job = arg;
+    struct aesd_recover_stats stats;
+    size_t i;
+
+    for(i = job->first; i < job->nsegs && job->err == 0; i += job->stride) {
+        if(aesd_index_recover(&job->segs[i]->index, job->segs[i]->fd, job->threads, &stats) != 0) {
+            job->err = errno;
+        }
+        job->torn += stats.torn;
+    }
+    return NULL;
+}
+
+/**
+ * Index the segments on @param threads threads, each taking every
+ * threads-th segment.  With fewer segments than threads the spare threads
+ * go to scanning inside each segment.
+ */
+static int recover(struct aesd_log *log, int threads, struct aesd_recover_stats *stats)
+{
+    struct aesd_segment **segs;
+    struct recover_job *jobs;
+    struct aesd_segment *seg;
+    size_t i = 0;
+    int inner;
+    int err = 0;
+    int j;
+
+    if(log->nsegments == 0) {
+        return 0;
+    }
+    segs = calloc(log->nsegments, sizeof(*segs));
+    if(threads < 1) {
+        threads = 1;
+    }
+    inner = threads / log->nsegments > 1 ? threads / log->nsegments : 1;
+    if((size_t)threads > log->nsegments) {
+        threads = log->nsegments;
+    }
+    jobs = calloc(threads, sizeof(*jobs));
+    if(segs == NULL || jobs == NULL) {
+        free(segs);
+        free(jobs);
+        errno = ENOMEM;
+        return -1;
+    }
+    TAILQ_FOREACH(seg, &log->segments, link) {
+        segs[i++] = seg;
+    }
+    for(j = 0; j < threads; j++) {
+        jobs[j].segs = segs;
+        jobs[j].nsegs = log->nsegments;
+        jobs[j].first = j;
+        jobs[j].stride = threads;
+        jobs[j].threads = inner;
+        if(j > 0) {
+            jobs[j].started = pthread_create(&jobs[j].thread, NULL, recover_segments, &jobs[j]) == 0;
+            if(!jobs[j].started) {
+                recover_segments(&jobs[j]);
+            }
+        }
+    }
+    recover_segments(&jobs[0]);
+    for(j = 0; j < threads; j++) {
+        if(jobs[j].started) {
+            pthread_join(jobs[j].thread, NULL);
+        }
+        err = err ? err : jobs[j].err;
+        stats->torn += jobs[j].torn;
+    }
+    free(jobs);
+    free(segs);
+    if(err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int aesd_log_open(struct aesd_log *log, const char *dir, const struct aesd_log_limits *limits,
+                  int threads, struct aesd_recover_stats *stats)
+{
+    struct timespec t0, t1;
+    struct dirent **names = NULL;
+    struct aesd_segment *seg;
+    char path[PATH_MAX];
+    bool failed = false;
+    struct stat st;
+    int n;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    memset(log, 0, sizeof(*log));
+    memset(stats, 0, sizeof(*stats));
+    TAILQ_INIT(&log->segments);
+    log->limits = *limits;
+    if(log->limits.segment_bytes < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    log->dir = strdup(dir);
+    if(log->dir == NULL) {
+        return -1;
+    }
+    if(mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        goto err;
+    }
+
+    /* zero padded names, so alphabetical is oldest first */
+    n = scandir(dir, &names, is_segment, alphasort);
+    if(n == -1) {
+        goto err;
+    }
+    for(i = 0; i < n && !failed; i++) {
+        seg = calloc(1, sizeof(*seg));
+        if(seg == NULL) {
+            failed = true;
+            break;
+        }
+        seg->base = strtoll(names[i]->d_name, NULL, 10);
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]->d_name);
+        seg->fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC);
+        if(seg->fd == -1 || fstat(seg->fd, &st) != 0) {
+            free_segment(seg);
+            failed = true;
+            break;
+        }
+        seg->last_write = st.st_mtime;
+        TAILQ_INSERT_TAIL(&log->segments, seg, link);
+        log->nsegments++;
+    }
+    for(i = 0; i < n; i++) {
+        free(names[i]);
+    }
+    free(names);
+    if(failed) {
+        goto err;
+    }
+
+    if(recover(log, threads, stats) != 0) {
+        goto err;
+    }
+    TAILQ_FOREACH(seg, &log->segments, link) {
+        log->bytes += seg->index.size;
+        log->records += seg->index.count;
+    }
+    if(log->nsegments == 0 && new_segment(log, 0) != 0) {
+        goto err;
+    }
+
+    /* map the newest segments, newest first */
+    i = 0;
+    TAILQ_FOREACH_REVERSE(seg, &log->segments, aesd_segment_list, link) {
+        if((unsigned int)i++ >= log->limits.mapped_segments) {
+            break;
+        }
+        if(seg->map == NULL) {
+            map_segment(log, seg);
+        }
+    }
+    retain(log, time(NULL));
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    stats->seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    return 0;
+
+err:
+    n = errno;
+    aesd_log_close(log, false);
+    errno = n;
+    return -1;
+}
+
+ssize_t aesd_log_append(struct aesd_log *log, const char *buf, size_t len)
+{
+    struct iovec iov = { .iov_base = (char *)buf, .iov_len = len };
+    return aesd_log_appendv(log, &iov, 1);
+}
+
+ssize_t aesd_log_appendv(struct aesd_log *log, const struct iovec *iov, int count)
+{
+    struct aesd_segment *seg = TAILQ_LAST(&log->segments, aesd_segment_list);
+    size_t records = seg->index.count;
+    time_t now = time(NULL);
+    int i;
+
+    ssize_t ret = writev(seg->fd, iov, count);
+    if(ret <= 0) {
+        return ret;
+    }
+    size_t left = ret;
+    for(i = 0; i < count && left > 0; i++) {
+        size_t n = iov[i].iov_len < left ? iov[i].iov_len : left;
+        if(aesd_index_append(&seg->index, iov[i].iov_base, n) != 0) {
+            errno = ENOMEM;
+            return -1;
+        }
+        left -= n;
+    }
+    log->bytes += ret;
+    log->records += seg->index.count - records;
+    seg->last_write = now;
+
+    if(seg->index.count == records || aesd_index_committed(&seg->index) != seg->index.size) {
+        return ret;
+    }
+    /* rotate between records only, so a record never spans two segments */
+    if(seg->index.size >= log->limits.segment_bytes) {
+        /* on failure keep appending to the current segment */
+        new_segment(log, seg->base + seg->index.size);
+    }
+    retain(log, now);
+    return ret;
+}
+
+/**
+ * writev all of @param iov, picking up after partial writes
+ */
+static int send_iov(int sockfd, struct iovec *iov, int count)
+{
+    while(count > 0) {
+        ssize_t sent = writev(sockfd, iov, count);
+        if(sent == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while(count > 0 && (size_t)sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0) {
+            iov->iov_base = (char *)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Send a segment that is not mapped, letting the kernel splice it if it can
+ */
+static int send_file(int sockfd, const struct aesd_segment *seg)
+{
+    off_t off = 0;
+    ssize_t sent = 0;
+
+    while(off < seg->index.size && (sent = sendfile(sockfd, seg->fd, &off, seg->index.size - off)) > 0);
+    if(sent == -1 && (errno == EINVAL || errno == ENOSYS)) {
+        char buf[COPY_SIZE];
+        ssize_t len;
+        while(off < seg->index.size && (len = pread(seg->fd, buf, sizeof(buf), off)) > 0) {
+            struct iovec iov = { .iov_base = buf, .iov_len = len };
+            if(send_iov(sockfd, &iov, 1) != 0) {
+                return -1;
+            }
+            off += len;
+        }
+    }
+    return off < seg->index.size ? -1 : 0;
+}
+
+int aesd_log_send(struct aesd_log *log, int sockfd)
+{
+    struct iovec iov[IOV_BATCH];
+    struct aesd_segment *seg;
+    int count = 0;
+
+    TAILQ_FOREACH(seg, &log->segments, link) {
+        if(seg->index.size == 0) {
+            continue;
+        }
+        if(seg->map != NULL && (size_t)seg->index.size > seg->map_len) {
+            /* a single record larger than the mapping */
+            unmap_segment(seg);
+            map_segment(log, seg);
+        }
+        if(seg->map == NULL) {
+            if(send_iov(sockfd, iov, count) != 0 || send_file(sockfd, seg) != 0) {
+                return -1;
+            }
+            count = 0;
+            continue;
+        }
+        if(count == IOV_BATCH) {
+            if(send_iov(sockfd, iov, count) != 0) {
+                return -1;
+            }
+            count = 0;
+        }
+        iov[count].iov_base = seg->map;
+        iov[count].iov_len = seg->index.size;
+        count++;
+    }
+    return send_iov(sockfd, iov, count);
+}
+
+void aesd_log_close(struct aesd_log *log, bool remove)
+{
+    struct aesd_segment *seg;
+
+    while((seg = TAILQ_FIRST(&log->segments)) != NULL) {
+        drop_segment(log, seg, remove);
+    }
+    if(remove && log->dir != NULL) {
+        rmdir(log->dir);
+    }
+    free(log->dir);
+    log->dir = NULL;
+}
@@ -0,0 +1,97 @@
+/*
+ * aesd_log.h
+ *
+ * The aesdsocket data stored as a directory of segment files.  The newest
+ * segment takes appends; once it holds at least segment_bytes and ends on a
+ * record boundary a new one is started.  Retention drops whole segments from
+ * the old end.  The newest segments stay mmap'ed so a reply is a writev over
+ * the mappings, older ones are handed to sendfile.
+ */
+
+#ifndef AESD_LOG_H
+#define AESD_LOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/queue.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "aesd_index.h"
+
+struct aesd_log_limits {
+    off_t segment_bytes;          /* rotate once the active segment reaches this */
+    off_t retain_bytes;           /* 0 keeps everything */
+    time_t retain_seconds;        /* drop segments last written longer ago, 0 keeps everything */
+    unsigned int mapped_segments; /* newest segments kept mmap'ed for replies */
+};
+
+struct aesd_segment {
+    TAILQ_ENTRY(aesd_segment) link;
+    int fd;
+    /**
+     * Offset of the first byte in the whole log, also the file name, so
+     * names keep increasing after old segments are dropped
+     */
+    off_t base;
+    /**
+     * Records of this segment, offsets relative to the segment file
+     */
+    struct aesd_index index;
+    time_t last_write;
+    /**
+     * Read only mapping of the file, NULL when the segment is not mapped
+     */
+    char *map;
+    size_t map_len;
+};
+
+TAILQ_HEAD(aesd_segment_list, aesd_segment);
+
+struct aesd_log {
+    char *dir;
+    struct aesd_log_limits limits;
+    /**
+     * Oldest first, the last one takes appends
+     */
+    struct aesd_segment_list segments;
+    size_t nsegments;
+    size_t records;
+    off_t bytes;
+};
+
+/**
+ * Open the log in @param dir, creating it if needed.  Existing segments are
+ * indexed on up to @param threads threads and a record torn by a crash is cut
+ * off the newest one, see aesd_index_recover().
+ * @return 0, or -1 with errno set
+ */
+extern int aesd_log_open(struct aesd_log *log, const char *dir, const struct aesd_log_limits *limits,
+                         int threads, struct aesd_recover_stats *stats);
+
+/**
+ * Append @param len bytes of @param buf, then rotate and apply retention
+ * if the append completed a record
+ * @return bytes written, or -1 with errno set
+ */
+extern ssize_t aesd_log_append(struct aesd_log *log, const char *buf, size_t len);
+
+/**
+ * aesd_log_append() of the @param count buffers in @param iov as one write,
+ * at most IOV_MAX of them
+ */
+extern ssize_t aesd_log_appendv(struct aesd_log *log, const struct iovec *iov, int count);
+
+/**
+ * Send the whole retained log to @param sockfd
+ * @return 0, or -1 with errno set
+ */
+extern int aesd_log_send(struct aesd_log *log, int sockfd);
+
+/**
+ * Release the log, deleting the segments and the directory if @param remove
+ */
+extern void aesd_log_close(struct aesd_log *log, bool remove);
+
+#endif /* AESD_LOG_H */
@@ -0,0 +1,348 @@
+#define _GNU_SOURCE
+#include "aesd_shm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define AESD_SHM_MAGIC 0x61657364   /* "aesd" */
+
+size_t aesd_shm_hello(const char *buf, size_t len)
+{
+    size_t prefix = strlen(AESD_SHM_HELLO);
+    const char *nl = memchr(buf, '\n', len);
+    unsigned long long size;
+
+    if(len <= prefix || memcmp(buf, AESD_SHM_HELLO, prefix) != 0 || nl == NULL) {
+        return 0;
+    }
+    size = strtoull(buf + prefix, NULL, 10);
+    if(size < AESD_SHM_MIN_SIZE) {
+        size = AESD_SHM_MIN_SIZE;
+    }
+    if(size > AESD_SHM_MAX_SIZE) {
+        size = AESD_SHM_MAX_SIZE;
+    }
+    return size;
+}
+
+static void wake(int efd)
+{
+    uint64_t one = 1;
+    if(write(efd, &one, sizeof(one)) == -1) {
+        /* the counter is only drained by the sleeper, it can't fill up */
+    }
+}
+
+int aesd_shm_accept(struct aesd_shm *shm, int sockfd, size_t size)
+{
+    size_t pow2 = AESD_SHM_MIN_SIZE;
+    int memfd, saved;
+
+    while(pow2 < size && pow2 < AESD_SHM_MAX_SIZE) {
+        pow2 *= 2;
+    }
+    memset(shm, 0, sizeof(*shm));
+    shm->data_efd = shm->space_efd = shm->sockfd = -1;
+    shm->map_len = sizeof(struct aesd_shm_ring) + pow2;
+
+    memfd = memfd_create("aesdsocket-ring", MFD_CLOEXEC);
+    if(memfd == -1) {
+        return -1;
+    }
+    if(ftruncate(memfd, shm->map_len) != 0) {
+        goto err;
+    }
+    shm->ring = mmap(NULL, shm->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if(shm->ring == MAP_FAILED) {
+        shm->ring = NULL;
+        goto err;
+    }
+    shm->ring->magic = AESD_SHM_MAGIC;
+    shm->ring->size = pow2;
+    shm->size = pow2;
+    shm->tail = 0;
+    /* the consumer polls data_efd and drains it without blocking */
+    shm->data_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    shm->space_efd = eventfd(0, EFD_CLOEXEC);
+    if(shm->data_efd == -1 || shm->space_efd == -1) {
+        goto err;
+    }
+
+    int fds[3] = { memfd, shm->data_efd, shm->space_efd };
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { .iov_base = "OK\n", .iov_len = 3 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if(sendmsg(sockfd, &msg, MSG_NOSIGNAL) == -1) {
+        goto err;
+    }
+    close(memfd);
+    return 0;
+
+err:
+    saved = errno;
+    close(memfd);
+    aesd_shm_close(shm);
+    errno = saved;
+    return -1;
+}
+
+size_t aesd_shm_peek(struct aesd_shm *shm, struct iovec iov[2])
+{
+    struct aesd_shm_ring *ring = shm->ring;
+
+    /* head is the client's to write, trust nothing but our own size and tail */
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t len = head - shm->tail;
+    size_t off = shm->tail & (shm->size - 1);
+
+    if(len > shm->size) {
+        /* the producer broke the ring, take what it could have held */
+        len = shm->size;
+    }
+    iov[0].iov_base = ring->data + off;
+    iov[0].iov_len = len < shm->size - off ? len : shm->size - off;
+    iov[1].iov_base = ring->data;
+    iov[1].iov_len = len - iov[0].iov_len;
+    return len;
+}
+
+void aesd_shm_consume(struct aesd_shm *shm, size_t len)
+{
+    struct aesd_shm_ring *ring = shm->ring;
+
+    shm->tail += len;
+    /* published for the producer only, never read back */
+    __atomic_store_n(&ring->tail, shm->tail, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&ring->producer_sleeping, __ATOMIC_SEQ_CST)) {
+        wake(shm->space_efd);
+    }
+}
+
+bool aesd_shm_wait(struct aesd_shm *shm, int sockfd)
+{
+    struct aesd_shm_ring *ring = shm->ring;
+    struct pollfd fds[2] = {
+        { .fd = shm->data_efd, .events = POLLIN },
+        { .fd = sockfd, .events = POLLIN },
+    };
+    char buf[64];
+    uint64_t count;
+
+    for(;;) {
+        /* say we sleep before the last look, the producer checks in the opposite order */
+        __atomic_store_n(&ring->consumer_sleeping, 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != shm->tail) {
+            break;
+        }
+        if(poll(fds, 2, -1) == -1 && errno != EINTR) {
+            break;
+        }
+        if(fds[0].revents & POLLIN) {
+            if(read(shm->data_efd, &count, sizeof(count)) == -1) {
+                /* raced with another drain, nothing to clear */
+            }
+        }
+        if(fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = recv(sockfd, buf, sizeof(buf), MSG_DONTWAIT);
+            if(n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+                __atomic_store_n(&ring->consumer_sleeping, 0, __ATOMIC_RELAXED);
+                return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != shm->tail;
+            }
+        }
+        if(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != shm->tail) {
+            break;
+        }
+    }
+    __atomic_store_n(&ring->consumer_sleeping, 0, __ATOMIC_RELAXED);
+    return true;
+}
+
+int aesd_shm_connect(struct aesd_shm *shm, const char *path, const char *preamble, size_t size)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fds[3] = { -1, -1, -1 };
+    char control[CMSG_SPACE(sizeof(fds))];
+    char hello[64], reply[8];
+    struct stat st;
+    int saved;
+
+    memset(shm, 0, sizeof(*shm));
+    shm->data_efd = shm->space_efd = -1;
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    shm->sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(shm->sockfd == -1) {
+        return -1;
+    }
+    if(connect(shm->sockfd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        goto err;
+    }
+    if(preamble != NULL && send(shm->sockfd, preamble, strlen(preamble), MSG_NOSIGNAL) != (ssize_t)strlen(preamble)) {
+        goto err;
+    }
+    int len = snprintf(hello, sizeof(hello), AESD_SHM_HELLO "%zu\n", size);
+    if(send(shm->sockfd, hello, len, MSG_NOSIGNAL) != len) {
+        goto err;
+    }
+
+    struct iovec iov = { .iov_base = reply, .iov_len = sizeof(reply) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    ssize_t got = recvmsg(shm->sockfd, &msg, MSG_CMSG_CLOEXEC);
+    if(got <= 0) {
+        if(got == 0) {
+            errno = ECONNRESET;
+        }
+        goto err;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+       cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        /* an aesdsocket without rings took the hello for data */
+        errno = EPROTO;
+        goto err;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    shm->data_efd = fds[1];
+    shm->space_efd = fds[2];
+    if(fstat(fds[0], &st) != 0) {
+        goto err;
+    }
+    shm->map_len = st.st_size;
+    shm->ring = mmap(NULL, shm->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if(shm->ring == MAP_FAILED) {
+        shm->ring = NULL;
+        goto err;
+    }
+    close(fds[0]);
+    fds[0] = -1;
+    if(shm->ring->magic != AESD_SHM_MAGIC ||
+       sizeof(struct aesd_shm_ring) + (size_t)shm->ring->size != shm->map_len) {
+        errno = EPROTO;
+        goto err;
+    }
+    shm->size = shm->ring->size;
+    return 0;
+
+err:
+    saved = errno;
+    if(fds[0] != -1) {
+        close(fds[0]);
+    }
+    aesd_shm_close(shm);
+    errno = saved;
+    return -1;
+}
+
+/**
+ * Wait until the consumer has committed the bytes up to @param target
+ */
+static int wait_tail(struct aesd_shm *shm, uint64_t target)
+{
+    struct aesd_shm_ring *ring = shm->ring;
+    struct pollfd fds[2] = {
+        { .fd = shm->space_efd, .events = POLLIN },
+        { .fd = shm->sockfd, .events = POLLIN },
+    };
+    uint64_t count;
+
+    for(;;) {
+        __atomic_store_n(&ring->producer_sleeping, 1, __ATOMIC_SEQ_CST);
+        if((int64_t)(__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) - target) >= 0) {
+            break;
+        }
+        if(poll(fds, 2, -1) == -1 && errno != EINTR) {
+            return -1;
+        }
+        if(fds[0].revents & POLLIN) {
+            if(read(shm->space_efd, &count, sizeof(count)) == -1) {
+                return -1;
+            }
+        }
+        else if(fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            /* the server sends nothing after the ring, this is it going away */
+            __atomic_store_n(&ring->producer_sleeping, 0, __ATOMIC_RELAXED);
+            errno = EPIPE;
+            return -1;
+        }
+    }
+    __atomic_store_n(&ring->producer_sleeping, 0, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int aesd_shm_write(struct aesd_shm *shm, const void *buf, size_t len)
+{
+    struct aesd_shm_ring *ring = shm->ring;
+    const char *p = buf;
+
+    while(len > 0) {
+        uint64_t head = ring->head;
+        size_t room = shm->size - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+        if(room == 0) {
+            if(wait_tail(shm, head - shm->size + 1) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        size_t n = len < room ? len : room;
+        size_t off = head & (shm->size - 1);
+        size_t first = n < shm->size - off ? n : shm->size - off;
+        memcpy(ring->data + off, p, first);
+        memcpy(ring->data, p + first, n - first);
+        __atomic_store_n(&ring->head, head + n, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&ring->consumer_sleeping, __ATOMIC_SEQ_CST)) {
+            wake(shm->data_efd);
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int aesd_shm_flush(struct aesd_shm *shm)
+{
+    return wait_tail(shm, shm->ring->head);
+}
+
+void aesd_shm_close(struct aesd_shm *shm)
+{
+    if(shm->ring != NULL) {
+        munmap(shm->ring, shm->map_len);
+    }
+    if(shm->data_efd != -1) {
+        close(shm->data_efd);
+    }
+    if(shm->space_efd != -1) {
+        close(shm->space_efd);
+    }
+    if(shm->sockfd != -1) {
+        close(shm->sockfd);
+    }
+    memset(shm, 0, sizeof(*shm));
+    shm->data_efd = shm->space_efd = shm->sockfd = -1;
+}
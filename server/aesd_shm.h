@@ -0,0 +1,112 @@
+/*
+ * aesd_shm.h
+ *
+ * Shared memory ring for producers on the same host as aesdsocket.  A
+ * producer connects to the local socket and sends AESD_SHM_HELLO with the
+ * ring size it wants, followed by a newline.  The server answers with a
+ * memfd holding the ring and two eventfds, then commits whatever bytes the
+ * producer puts in the ring as if they were received on a socket.  There is
+ * no reply, the producer closes the socket once done.
+ *
+ * Each side only signals its eventfd when the other one said it was going
+ * to sleep, so a busy ring costs no system calls.
+ */
+
+#ifndef AESD_SHM_H
+#define AESD_SHM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define AESD_SHM_HELLO     "AESDSHM:"
+#define AESD_SHM_MIN_SIZE  4096
+#define AESD_SHM_MAX_SIZE  (64 * 1024 * 1024)
+
+struct aesd_shm_ring {
+    uint32_t magic;
+    uint32_t size;              /* bytes of data, a power of 2 */
+    /**
+     * Written by the producer: bytes put in the ring so far, and whether it
+     * waits on space_efd for the consumer to make room
+     */
+    _Alignas(64) uint64_t head;
+    uint32_t producer_sleeping;
+    /**
+     * Written by the consumer: bytes committed so far, and whether it waits
+     * on data_efd
+     */
+    _Alignas(64) uint64_t tail;
+    uint32_t consumer_sleeping;
+    _Alignas(64) char data[];
+};
+
+struct aesd_shm {
+    struct aesd_shm_ring *ring;
+    size_t map_len;
+    /**
+     * The ring size and, for the consumer, its tail, kept out of the shared
+     * page where the other side could change them under us
+     */
+    size_t size;
+    uint64_t tail;
+    int data_efd;               /* producer -> consumer */
+    int space_efd;              /* consumer -> producer */
+    int sockfd;                 /* producer side only */
+};
+
+/**
+ * @return the ring size asked for by the hello line in @param buf, 0 if
+ * @param len bytes are not a complete hello
+ */
+extern size_t aesd_shm_hello(const char *buf, size_t len);
+
+/**
+ * Server side: create a ring of @param size bytes, rounded to a power of 2,
+ * and pass it to the producer on @param sockfd
+ * @return 0, or -1 with errno set
+ */
+extern int aesd_shm_accept(struct aesd_shm *shm, int sockfd, size_t size);
+
+/**
+ * Server side: point @param iov at the bytes waiting in the ring, in up to 2 pieces
+ * @return their total length
+ */
+extern size_t aesd_shm_peek(struct aesd_shm *shm, struct iovec iov[2]);
+
+/**
+ * Server side: release @param len bytes returned by aesd_shm_peek()
+ */
+extern void aesd_shm_consume(struct aesd_shm *shm, size_t len);
+
+/**
+ * Server side: sleep until the ring has data
+ * @return false once the producer closed @param sockfd and the ring is empty
+ */
+extern bool aesd_shm_wait(struct aesd_shm *shm, int sockfd);
+
+/**
+ * Producer side: ask the server on the local socket at @param path for a
+ * ring of @param size bytes.  @param preamble, if not NULL, is sent ahead of
+ * the hello, such as the line naming a channel.
+ * @return 0, or -1 with errno set
+ */
+extern int aesd_shm_connect(struct aesd_shm *shm, const char *path, const char *preamble, size_t size);
+
+/**
+ * Producer side: copy @param len bytes into the ring, waiting for room as needed
+ * @return 0, or -1 with errno set
+ */
+extern int aesd_shm_write(struct aesd_shm *shm, const void *buf, size_t len);
+
+/**
+ * Producer side: wait until the server committed everything written
+ * @return 0, or -1 with errno set
+ */
+extern int aesd_shm_flush(struct aesd_shm *shm);
+
+extern void aesd_shm_close(struct aesd_shm *shm);
+
+#endif /* AESD_SHM_H */
@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+#include "aesd_udp.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+/* room for the SO_RXQ_OVFL and UDP_GRO messages */
+#define CONTROL_SIZE (CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(int)))
+
+static char newline[] = "\n";
+
+static int bind_udp(const char *port)
+{
+    struct addrinfo hints = {
+        .ai_flags = AI_PASSIVE,
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_DGRAM,
+    };
+    struct addrinfo *ai;
+    int rc, fd;
+
+    if((rc = getaddrinfo(NULL, port, &hints, &ai)) != 0) {
+        errno = rc == EAI_SYSTEM ? errno : EINVAL;
+        return -1;
+    }
+    fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+    if(fd != -1 && bind(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+        int saved = errno;
+        close(fd);
+        fd = -1;
+        errno = saved;
+    }
+    freeaddrinfo(ai);
+    return fd;
+}
+
+int aesd_udp_open(struct aesd_udp *udp, const char *port, unsigned int batch, int rcvbuf, bool gro)
+{
+    socklen_t optlen = sizeof(udp->rcvbuf);
+    unsigned int i;
+
+    memset(udp, 0, sizeof(*udp));
+    udp->batch = batch < 1 ? 1 : batch > AESD_UDP_MAX_BATCH ? AESD_UDP_MAX_BATCH : batch;
+    udp->fd = bind_udp(port);
+    if(udp->fd == -1) {
+        return -1;
+    }
+    /* past net.core.rmem_max only with CAP_NET_ADMIN */
+    if(rcvbuf > 0 && setsockopt(udp->fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) != 0 &&
+       setsockopt(udp->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) != 0) {
+        goto err;
+    }
+    getsockopt(udp->fd, SOL_SOCKET, SO_RCVBUF, &udp->rcvbuf, &optlen);
+    if(setsockopt(udp->fd, SOL_SOCKET, SO_RXQ_OVFL, &(int){1}, sizeof(int)) != 0) {
+        goto err;
+    }
+    udp->gro = gro && setsockopt(udp->fd, SOL_UDP, UDP_GRO, &(int){1}, sizeof(int)) == 0;
+
+    udp->msgs = calloc(udp->batch, sizeof(*udp->msgs));
+    udp->slots = calloc(udp->batch, sizeof(*udp->slots));
+    udp->bufs = malloc((size_t)udp->batch * AESD_UDP_MAX);
+    udp->control = calloc(udp->batch, CONTROL_SIZE);
+    if(udp->msgs == NULL || udp->slots == NULL || udp->bufs == NULL || udp->control == NULL) {
+        errno = ENOMEM;
+        goto err;
+    }
+    for(i = 0; i < udp->batch; i++) {
+        udp->slots[i].iov_base = udp->bufs + (size_t)i * AESD_UDP_MAX;
+        udp->msgs[i].msg_hdr.msg_iov = &udp->slots[i];
+        udp->msgs[i].msg_hdr.msg_iovlen = 1;
+        udp->msgs[i].msg_hdr.msg_control = udp->control + (size_t)i * CONTROL_SIZE;
+    }
+    return 0;
+
+err:
+    {
+        int saved = errno;
+        aesd_udp_close(udp);
+        errno = saved;
+    }
+    return -1;
+}
+
+static bool add_iov(struct aesd_udp *udp, size_t *count, char *base, size_t len)
+{
+    if(*count == udp->iov_cap) {
+        size_t cap = udp->iov_cap ? udp->iov_cap * 2 : 4 * udp->batch;
+        struct iovec *iov = realloc(udp->iov, cap * sizeof(*iov));
+        if(iov == NULL) {
+            return false;
+        }
+        udp->iov = iov;
+        udp->iov_cap = cap;
+    }
+    udp->iov[*count].iov_base = base;
+    udp->iov[*count].iov_len = len;
+    (*count)++;
+    return true;
+}
+
+static bool add_start(struct aesd_udp *udp, size_t records, size_t start)
+{
+    if(records == udp->starts_cap) {
+        size_t cap = udp->starts_cap ? udp->starts_cap * 2 : 2 * udp->batch;
+        size_t *starts = realloc(udp->starts, cap * sizeof(*starts));
+        if(starts == NULL) {
+            return false;
+        }
+        udp->starts = starts;
+        udp->starts_cap = cap;
+    }
+    udp->starts[records] = start;
+    return true;
+}
+
+/**
+ * Add the records of message @param i, split at the GRO segment size, after
+ * the @param first already in the batch
+ * @return the number of records
+ */
+static int add_message(struct aesd_udp *udp, unsigned int i, size_t first, size_t *count)
+{
+    struct msghdr *hdr = &udp->msgs[i].msg_hdr;
+    char *data = udp->slots[i].iov_base;
+    size_t len = udp->msgs[i].msg_len;
+    size_t segment = len;
+    size_t off;
+    int records = 0;
+
+    for(struct cmsghdr *c = CMSG_FIRSTHDR(hdr); c != NULL; c = CMSG_NXTHDR(hdr, c)) {
+        if(c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL) {
+            uint32_t dropped;
+            memcpy(&dropped, CMSG_DATA(c), sizeof(dropped));
+            /* counts every drop since the socket was created */
+            udp->stats.dropped = dropped;
+        } else if(c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO) {
+            int gso;
+            memcpy(&gso, CMSG_DATA(c), sizeof(gso));
+            if(gso > 0) {
+                segment = gso;
+            }
+        }
+    }
+    if(hdr->msg_flags & MSG_TRUNC) {
+        udp->stats.truncated++;
+    }
+    for(off = 0; off < len; off += segment) {
+        size_t n = len - off < segment ? len - off : segment;
+        if(!add_start(udp, first + records, *count) || !add_iov(udp, count, data + off, n) ||
+           (data[off + n - 1] != '\n' && !add_iov(udp, count, newline, 1))) {
+            return -1;
+        }
+        records++;
+    }
+    udp->stats.bytes += len;
+    return records;
+}
+
+int aesd_udp_recv(struct aesd_udp *udp, const struct iovec **iov, size_t *count)
+{
+    unsigned int i;
+    int n, records = 0;
+
+    for(i = 0; i < udp->batch; i++) {
+        udp->slots[i].iov_len = AESD_UDP_MAX;
+        udp->msgs[i].msg_hdr.msg_controllen = CONTROL_SIZE;
+        udp->msgs[i].msg_hdr.msg_flags = 0;
+    }
+    /* block for the first datagram only, then take what is already queued */
+    n = recvmmsg(udp->fd, udp->msgs, udp->batch, MSG_WAITFORONE, NULL);
+    if(n == -1) {
+        return -1;
+    }
+    *count = 0;
+    for(i = 0; i < (unsigned int)n; i++) {
+        int added = add_message(udp, i, records, count);
+        if(added == -1) {
+            errno = ENOMEM;
+            return -1;
+        }
+        records += added;
+    }
+    udp->stats.batches++;
+    udp->stats.records += records;
+    *iov = udp->iov;
+    return records;
+}
+
+void aesd_udp_close(struct aesd_udp *udp)
+{
+    if(udp->fd != -1) {
+        close(udp->fd);
+    }
+    free(udp->msgs);
+    free(udp->slots);
+    free(udp->bufs);
+    free(udp->control);
+    free(udp->iov);
+    free(udp->starts);
+    udp->fd = -1;
+    udp->msgs = NULL;
+    udp->slots = NULL;
+    udp->bufs = NULL;
+    udp->control = NULL;
+    udp->iov = NULL;
+    udp->starts = NULL;
+}
@@ -0,0 +1,70 @@
+/*
+ * aesd_udp.h
+ *
+ * UDP ingest for producers that need no reply: every datagram is one
+ * record, a newline is added to the ones not ending with one and empty ones
+ * are ignored.  Datagrams are taken a batch at a time with recvmmsg() so a
+ * busy socket costs one system call per batch, and with GRO the kernel may
+ * hand over several equally sized records in one buffer.
+ */
+
+#ifndef AESD_UDP_H
+#define AESD_UDP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/* largest datagram kept whole, and largest buffer GRO fills */
+#define AESD_UDP_MAX        (64 * 1024)
+#define AESD_UDP_MAX_BATCH  512
+
+struct aesd_udp_stats {
+    uint64_t batches;       /* recvmmsg() calls that returned data */
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t dropped;       /* by the kernel with the socket buffer full */
+    uint64_t truncated;     /* longer than AESD_UDP_MAX, stored cut */
+};
+
+struct aesd_udp {
+    int fd;
+    unsigned int batch;     /* datagrams per recvmmsg() */
+    bool gro;
+    int rcvbuf;             /* socket buffer bytes the kernel granted */
+    struct mmsghdr *msgs;
+    struct iovec *slots;    /* AESD_UDP_MAX bytes of bufs per message */
+    char *bufs;
+    char *control;
+    /**
+     * Records of the last batch, each followed by a newline entry if it
+     * lacks one, and where in iov each record starts
+     */
+    struct iovec *iov;
+    size_t iov_cap;
+    size_t *starts;
+    size_t starts_cap;
+    struct aesd_udp_stats stats;
+};
+
+/**
+ * Bind a UDP socket to @param port taking @param batch datagrams per call.
+ * @param rcvbuf sizes the socket buffer if not 0, beyond the system limit
+ * when the process may.  @param gro asks for coalesced receives, udp->gro
+ * tells whether the kernel agreed.
+ * @return 0, or -1 with errno set
+ */
+extern int aesd_udp_open(struct aesd_udp *udp, const char *port, unsigned int batch, int rcvbuf, bool gro);
+
+/**
+ * Wait for datagrams and take as many as are queued, up to a batch
+ * @return the number of records, pointed at by @param iov in @param count
+ * entries, or -1 with errno set.  Record i starts at iov[udp->starts[i]].
+ */
+extern int aesd_udp_recv(struct aesd_udp *udp, const struct iovec **iov, size_t *count);
+
+extern void aesd_udp_close(struct aesd_udp *udp);
+
+#endif /* AESD_UDP_H */
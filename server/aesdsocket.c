@@ -15,32 +15,98 @@
 #include <pthread.h>
 #include <sys/queue.h>
 #include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/sendfile.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <ctype.h>
 
+#include "aesd_log.h"
+#include "aesd_shm.h"
+#include "aesd_udp.h"
 
+
+#ifndef USE_AESD_CHAR_DEVICE
 #define USE_AESD_CHAR_DEVICE 1
+#endif
 
 #if (USE_AESD_CHAR_DEVICE == 1)
-#include <sys/ioctl.h>
+#include "../aesd-char-driver/aesd_ioctl.h"
 #define OUTPUT_FILE        "/dev/aesdchar"
-#define AESD_IOC_MAGIC 0x16
-#define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+/* shard minors of aesd_nr_devs, 0 being the default channel */
+#define CHANNEL_DEVICE     "/dev/aesdchar%u"
+#define SEEKREAD_SIZE      (64 * 1024)
 #else
-#define OUTPUT_FILE        "/var/tmp/aesdsocketdata"
+#define OUTPUT_DIR         "/var/tmp/aesdsocketdata.d"
+#define CHANNEL_DIR        "/var/tmp/aesdsocketdata.%s.d"
+#define SEGMENT_BYTES      (1024 * 1024)
+#define MAPPED_SEGMENTS    8
 #endif
 
 #define PORT               "9000"
+#define UDP_BATCH          64
+#define UDP_IOV_MAX        1024    /* IOV_MAX on Linux, iovecs per write of a batch */
+#define UDP_BACKOFF_MAX_MS 1000    /* longest wait between failing receives */
 #define BACKLOG            10
 #define BUF_SIZE           1024
+#define SENDFILE_CHUNK     (1024 * 1024)
+/* default seconds between timestamps, 0 disables them unless -t is given */
+#if (USE_AESD_CHAR_DEVICE == 1)
+#define TIMESTAMP_INTERVAL 0
+#else
 #define TIMESTAMP_INTERVAL 10
+#endif
+#define TIMESTAMP_MAX      128
+/* how often the main loop retries a timestamp while a client holds the mutex */
+#define TIMESTAMP_RETRY_MS 100
+/* a connection or datagram may start with this line to pick a channel */
+#define CHANNEL_PREFIX     "CHANNEL:"
+#define CHANNEL_NAME_MAX   32
+#define CHANNEL_BUCKETS    256
+#define CHANNEL_MAX        1024
 
-struct timestamp_data {
-    pthread_mutex_t *mutex;
+/**
+ * The next timestamp record, written by whoever next holds the default
+ * channel mutex between two client records: the main loop when it is free,
+ * otherwise the client thread right after its own record.
+ */
+struct timestamp_state {
+    pthread_mutex_t lock;
+    char pending[TIMESTAMP_MAX];
+    size_t pending_len;
+    /* "timestamp:<date> HH:MM:" and " <zone>\n" for the minute starting at minute */
+    time_t minute;
+    char prefix[TIMESTAMP_MAX];
+    char suffix[16];
+};
+
+/**
+ * A separate stream of records with its own data, lock and reply.  Clients
+ * not naming one get the default channel, the only one with timestamps.
+ * With the driver each named channel has a shard minor of its own, handed
+ * out in the order the channels are first used.
+ */
+struct channel {
+    struct channel *next;       /* in its hash bucket */
+    pthread_mutex_t mutex;      /* the data mutex of this channel */
+#if (USE_AESD_CHAR_DEVICE == 1)
+    int fd;                     /* kept open for writing, -1 to open per use */
+    char device[sizeof(CHANNEL_DEVICE) + 10];
+#else
+    struct aesd_log log;
+#endif
+    size_t name_len;
+    char name[CHANNEL_NAME_MAX + 1];
 };
 
 struct thread_data {
     int sockfd;
-    pthread_mutex_t *mutex;
+    struct channel *channel;
     bool complete;
+    bool local;         /* accepted on the AF_UNIX listener, may ask for a ring */
 };
 
 struct thread_node {
@@ -49,19 +115,256 @@ struct thread_node {
     LIST_ENTRY(thread_node) node;
 };
 
-struct aesd_seekto {
-    /**
-     * The zero referenced write command to seek into
-     */
-    uint32_t write_cmd;
-    /**
-     * The zero referenced offset within the write
-     */
-    uint32_t write_cmd_offset;
-};
-
 LIST_HEAD(listhead, thread_node) head;
 bool caught_signal = false;
+static struct timestamp_state timestamp = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .minute = -1,
+};
+/* segments in OUTPUT_DIR for the file backend */
+static struct channel default_channel = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+#if (USE_AESD_CHAR_DEVICE == 1)
+    .fd = -1,
+    .device = OUTPUT_FILE,
+#endif
+};
+/**
+ * Named channels.  A bucket only ever gets a fully set up channel pushed on
+ * its head, and channels live until exit, so lookups take no lock.  lock
+ * serializes adding them.
+ */
+static struct {
+    pthread_mutex_t lock;
+    struct channel *buckets[CHANNEL_BUCKETS];
+    size_t count;
+} channels = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+#if (USE_AESD_CHAR_DEVICE == 0)
+static struct aesd_log_limits log_limits = {
+    .segment_bytes = SEGMENT_BYTES,
+    .mapped_segments = MAPPED_SEGMENTS,
+};
+#endif
+/* the -U listener, read only by its thread until that is joined */
+static struct aesd_udp udp_ingest = { .fd = -1 };
+/* records naming a channel they can't have */
+static uint64_t udp_refused;
+
+/**
+ * @return a descriptor to store() to @param ch through, the file backend
+ * keeps its own
+ */
+static int open_store(struct channel *ch)
+{
+#if (USE_AESD_CHAR_DEVICE == 1)
+    if(ch->fd != -1) {
+        return ch->fd;
+    }
+    return open(ch->device, O_WRONLY | O_APPEND | O_CREAT, 0666);
+#else
+    return 0;
+#endif
+}
+
+static void close_store(struct channel *ch, int wd)
+{
+#if (USE_AESD_CHAR_DEVICE == 1)
+    if(wd != ch->fd) {
+        close(wd);
+    }
+#endif
+}
+
+/**
+ * Append @param len bytes to the data of @param ch through @param wd.  Caller
+ * holds the channel mutex.
+ */
+static ssize_t store(struct channel *ch, int wd, const char *buf, size_t len)
+{
+#if (USE_AESD_CHAR_DEVICE == 1)
+    return write(wd, buf, len);
+#else
+    return aesd_log_append(&ch->log, buf, len);
+#endif
+}
+
+/**
+ * Append the records in @param buf, possibly ending with a partial one.  The
+ * device keeps one entry per write ending in a newline, so it gets a write
+ * per record.  Caller holds the channel mutex.
+ * @return false if a write failed
+ */
+static bool store_records(struct channel *ch, int wd, const char *buf, size_t len)
+{
+#if (USE_AESD_CHAR_DEVICE == 1)
+    const char *end = buf + len;
+    while(buf < end) {
+        const char *nl = memchr(buf, '\n', end - buf);
+        size_t n = nl ? (size_t)(nl - buf + 1) : (size_t)(end - buf);
+        if(store(ch, wd, buf, n) == -1) {
+            return false;
+        }
+        buf += n;
+    }
+    return true;
+#else
+    return store(ch, wd, buf, len) != -1;
+#endif
+}
+
+/**
+ * Append the records of a UDP batch, as one write to the file backend.
+ * Caller holds the channel mutex.
+ * @return false if a write failed
+ */
+static bool store_batch(struct channel *ch, int wd, const struct iovec *iov, size_t count)
+{
+#if (USE_AESD_CHAR_DEVICE == 1)
+    size_t i;
+    for(i = 0; i < count; i++) {
+        if(!store_records(ch, wd, iov[i].iov_base, iov[i].iov_len)) {
+            return false;
+        }
+    }
+    return true;
+#else
+    while(count > 0) {
+        int n = count < UDP_IOV_MAX ? count : UDP_IOV_MAX;
+        if(aesd_log_appendv(&ch->log, iov, n) == -1) {
+            return false;
+        }
+        iov += n;
+        count -= n;
+    }
+    return true;
+#endif
+}
+
+static uint32_t channel_hash(const char *name, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    while(len-- > 0) {
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    }
+    return hash;
+}
+
+static struct channel *find_channel(const char *name, size_t len, uint32_t hash)
+{
+    struct channel *ch = __atomic_load_n(&channels.buckets[hash % CHANNEL_BUCKETS], __ATOMIC_ACQUIRE);
+    for(; ch != NULL; ch = ch->next) {
+        if(ch->name_len == len && memcmp(ch->name, name, len) == 0) {
+            return ch;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Open the data of a new channel: the next free shard minor of the driver,
+ * or the segments of the file backend, recovering what an earlier run left
+ * with -p.  Caller holds channels.lock.
+ */
+static struct channel *add_channel(const char *name, size_t len, uint32_t hash)
+{
+#if (USE_AESD_CHAR_DEVICE == 0)
+    struct aesd_recover_stats stats;
+    char dir[sizeof(CHANNEL_DIR) + CHANNEL_NAME_MAX];
+#endif
+    struct channel *ch;
+
+    if(channels.count == CHANNEL_MAX) {
+        errno = ENOSPC;
+        return NULL;
+    }
+    ch = calloc(1, sizeof(*ch));
+    if(ch == NULL) {
+        return NULL;
+    }
+    memcpy(ch->name, name, len);
+    ch->name_len = len;
+#if (USE_AESD_CHAR_DEVICE == 1)
+    snprintf(ch->device, sizeof(ch->device), CHANNEL_DEVICE, (unsigned int)channels.count + 1);
+    ch->fd = open(ch->device, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if(ch->fd == -1) {
+        /* the load script makes aesd_nr_devs minors, the default channel has the first */
+        if(errno == ENOENT) {
+            errno = ENOSPC;
+        }
+        free(ch);
+        return NULL;
+    }
+#else
+    snprintf(dir, sizeof(dir), CHANNEL_DIR, ch->name);
+    if(aesd_log_open(&ch->log, dir, &log_limits, 1, &stats) != 0) {
+        free(ch);
+        return NULL;
+    }
+#endif
+    pthread_mutex_init(&ch->mutex, NULL);
+    ch->next = channels.buckets[hash % CHANNEL_BUCKETS];
+    __atomic_store_n(&channels.buckets[hash % CHANNEL_BUCKETS], ch, __ATOMIC_RELEASE);
+    channels.count++;
+#if (USE_AESD_CHAR_DEVICE == 1)
+    syslog(LOG_INFO, "opened channel %s on %s", ch->name, ch->device);
+#else
+    syslog(LOG_INFO, "opened channel %s, %zu records recovered", ch->name, ch->log.records);
+#endif
+    return ch;
+}
+
+/**
+ * @return the channel called @param name, opened on first use, the default
+ * one if @param len is 0, or NULL with errno set
+ */
+static struct channel *get_channel(const char *name, size_t len)
+{
+    size_t i;
+
+    if(len == 0) {
+        return &default_channel;
+    }
+    /* the name ends up in a directory name */
+    for(i = 0; i < len; i++) {
+        if(!isalnum((unsigned char)name[i]) && name[i] != '-' && name[i] != '_') {
+            break;
+        }
+    }
+    if(len > CHANNEL_NAME_MAX || i < len) {
+        errno = EINVAL;
+        return NULL;
+    }
+    uint32_t hash = channel_hash(name, len);
+    struct channel *ch = find_channel(name, len, hash);
+    if(ch != NULL) {
+        return ch;
+    }
+    pthread_mutex_lock(&channels.lock);
+    ch = find_channel(name, len, hash);
+    if(ch == NULL) {
+        ch = add_channel(name, len, hash);
+    }
+    pthread_mutex_unlock(&channels.lock);
+    return ch;
+}
+
+/**
+ * @return the length of the CHANNEL_PREFIX line starting @param buf, 0 if
+ * there is none in its @param len bytes
+ */
+static size_t channel_line(const char *buf, size_t len)
+{
+    size_t prefix = strlen(CHANNEL_PREFIX);
+    const char *nl;
+
+    if(len <= prefix || memcmp(buf, CHANNEL_PREFIX, prefix) != 0) {
+        return 0;
+    }
+    nl = memchr(buf + prefix, '\n', len - prefix);
+    return nl ? (size_t)(nl - buf + 1) : 0;
+}
 
 static void signal_handler(int signal_number)
 {
@@ -88,68 +391,337 @@ bool setting_signal()
     return true;
 }
 
+/**
+ * Queue the timestamp record for @param now.  Only the seconds are formatted
+ * each time, the rest comes from the cached minute.
+ */
+static void queue_timestamp(time_t now)
+{
+    struct tm tm_info;
+
+    pthread_mutex_lock(&timestamp.lock);
+    if(timestamp.minute == -1 || now < timestamp.minute || now >= timestamp.minute + 60) {
+        localtime_r(&now, &tm_info);
+        strftime(timestamp.prefix, sizeof(timestamp.prefix), "timestamp:%a, %d %b %Y %H:%M:", &tm_info);
+        strftime(timestamp.suffix, sizeof(timestamp.suffix), " %z\n", &tm_info);
+        timestamp.minute = now - tm_info.tm_sec;
+    }
+    timestamp.pending_len = snprintf(timestamp.pending, sizeof(timestamp.pending), "%s%02d%s",
+            timestamp.prefix, (int)(now - timestamp.minute), timestamp.suffix);
+    pthread_mutex_unlock(&timestamp.lock);
+}
+
+static bool timestamp_pending(void)
+{
+    bool pending;
+
+    pthread_mutex_lock(&timestamp.lock);
+    pending = timestamp.pending_len > 0;
+    pthread_mutex_unlock(&timestamp.lock);
+    return pending;
+}
+
+/**
+ * Write the queued timestamp, if any, to @param wd when @param ch is the
+ * default channel.  Caller holds the channel mutex and is between two records.
+ */
+static void flush_timestamp(struct channel *ch, int wd)
+{
+    if(ch != &default_channel) {
+        return;
+    }
+    pthread_mutex_lock(&timestamp.lock);
+    if(timestamp.pending_len > 0) {
+        if(store(ch, wd, timestamp.pending, timestamp.pending_len) == -1) {
+            syslog(LOG_ERR, "write timestamp failed");
+        }
+        timestamp.pending_len = 0;
+    }
+    pthread_mutex_unlock(&timestamp.lock);
+}
+
+/**
+ * @return a timerfd firing every @param interval seconds on wall clock multiples of the
+ * interval.  The deadlines are absolute, so a late wakeup does not push back the next one.
+ * @param deadline gets the nanosecond deadline before the first, to be advanced by the
+ * interval for each expiration read.
+ */
+static int timestamp_timer(double interval, long long *deadline)
+{
+    struct itimerspec its;
+    struct timespec now;
+    long long step = interval * 1e9;
+    long long next;
+
+    int tfd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC);
+    if(tfd == -1) {
+        return -1;
+    }
+    clock_gettime(CLOCK_REALTIME, &now);
+    next = ((now.tv_sec * 1000000000LL + now.tv_nsec) / step + 1) * step;
+    its.it_value.tv_sec = next / 1000000000LL;
+    its.it_value.tv_nsec = next % 1000000000LL;
+    its.it_interval.tv_sec = step / 1000000000LL;
+    its.it_interval.tv_nsec = step % 1000000000LL;
+    if(timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) != 0) {
+        close(tfd);
+        return -1;
+    }
+    *deadline = next - step;
+    return tfd;
+}
+
+/**
+ * Write a queued timestamp if no client is in the middle of a record
+ */
+static void try_flush_timestamp(void)
+{
+    if(pthread_mutex_trylock(&default_channel.mutex) != 0) {
+        return;
+    }
+    int wd = open_store(&default_channel);
+    if(wd == -1) {
+        syslog(LOG_ERR, "file open create write failed");
+    } else {
+        flush_timestamp(&default_channel, wd);
+        close_store(&default_channel, wd);
+    }
+    pthread_mutex_unlock(&default_channel.mutex);
+}
+
+/**
+ * Move @param data to the channel named by a CHANNEL_PREFIX line opening
+ * the connection, if there is one.  A line split across reads is taken a
+ * byte at a time, and if it turns out to be data after all the bytes read
+ * are left in @param buf for the caller to store, their count in @param carried.
+ * @return false if the connection names a channel it can't have
+ */
+static bool read_channel(struct thread_data *data, char *buf, int *carried)
+{
+    size_t prefix = strlen(CHANNEL_PREFIX);
+    size_t max = prefix + CHANNEL_NAME_MAX + 1;
+    size_t len;
+
+    *carried = 0;
+    ssize_t n = recv(data->sockfd, buf, max, MSG_PEEK);
+    if(n <= 0 || memcmp(buf, CHANNEL_PREFIX, (size_t)n < prefix ? (size_t)n : prefix) != 0) {
+        return true;
+    }
+    len = channel_line(buf, n);
+    if(len > 0) {
+        if(recv(data->sockfd, buf, len, 0) != (ssize_t)len) {
+            return false;
+        }
+    } else {
+        while(len < max) {
+            if(recv(data->sockfd, buf + len, 1, 0) != 1) {
+                *carried = len;
+                return true;
+            }
+            len++;
+            if(len <= prefix && buf[len - 1] != CHANNEL_PREFIX[len - 1]) {
+                *carried = len;
+                return true;
+            }
+            if(buf[len - 1] == '\n') {
+                break;
+            }
+        }
+        if(buf[len - 1] != '\n') {
+            syslog(LOG_ERR, "channel name too long");
+            return false;
+        }
+    }
+    data->channel = get_channel(buf + prefix, len - prefix - 1);
+    if(data->channel == NULL) {
+        syslog(LOG_ERR, "channel %.*s: %s", (int)(len - prefix - 1), buf + prefix, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Take over a local connection opening with AESD_SHM_HELLO: hand the
+ * producer a ring, then commit what it puts there until it hangs up.  The
+ * channel mutex is held from the first byte of a record to its newline, as
+ * for a socket client, but a drain takes every record waiting in the ring.
+ * @return false if this is a plain connection
+ */
+static bool serve_shm(struct thread_data *data)
+{
+    struct channel *ch = data->channel;
+    char hello[64];
+    struct aesd_shm shm;
+    struct iovec iov[2];
+    bool locked = false;
+    int wd = -1;
+    int i;
+
+    ssize_t len = recv(data->sockfd, hello, sizeof(hello), MSG_PEEK);
+    size_t size = len > 0 ? aesd_shm_hello(hello, len) : 0;
+    if(size == 0) {
+        return false;
+    }
+    /* drop the hello line, the ring carries everything after it */
+    if(recv(data->sockfd, hello, (char *)memchr(hello, '\n', len) - hello + 1, 0) <= 0 ||
+       aesd_shm_accept(&shm, data->sockfd, size) != 0) {
+        syslog(LOG_ERR, "shared memory ring setup failed: %s", strerror(errno));
+        return true;
+    }
+    syslog(LOG_DEBUG, "Serving a %zu byte shared memory ring", shm.size);
+
+    for(;;) {
+        size_t n = aesd_shm_peek(&shm, iov);
+        if(n == 0) {
+            if(!aesd_shm_wait(&shm, data->sockfd)) {
+                break;
+            }
+            continue;
+        }
+        if(!locked) {
+            pthread_mutex_lock(&ch->mutex);
+            wd = open_store(ch);
+            if(wd == -1) {
+                syslog(LOG_ERR, "file open create write failed");
+                pthread_mutex_unlock(&ch->mutex);
+                break;
+            }
+            locked = true;
+        }
+        for(i = 0; i < 2; i++) {
+            if(iov[i].iov_len > 0 && !store_records(ch, wd, iov[i].iov_base, iov[i].iov_len)) {
+                break;
+            }
+        }
+        if(i < 2) {
+            /* leave the records unconsumed and drop the session, the producer sees EPIPE */
+            syslog(LOG_ERR, "write file failed: %s", strerror(errno));
+            shutdown(data->sockfd, SHUT_RDWR);
+            break;
+        }
+        const struct iovec *last = iov[1].iov_len > 0 ? &iov[1] : &iov[0];
+        if(((char *)last->iov_base)[last->iov_len - 1] == '\n') {
+            flush_timestamp(ch, wd);
+            close_store(ch, wd);
+            pthread_mutex_unlock(&ch->mutex);
+            locked = false;
+        }
+        aesd_shm_consume(&shm, n);
+    }
+    if(locked) {
+        close_store(ch, wd);
+        pthread_mutex_unlock(&ch->mutex);
+    }
+    aesd_shm_close(&shm);
+    return true;
+}
+
 void* data_handler(void* thread_param)
 {
     struct thread_data* data = (struct thread_data *) thread_param;
     char buf[BUF_SIZE];
+    int ret_len;
 
-    int rc = pthread_mutex_lock(data->mutex);
+    if(!read_channel(data, buf, &ret_len)) {
+        /* no reply, and the socket is only closed once the main loop reaps this thread */
+        shutdown(data->sockfd, SHUT_RDWR);
+        data->complete = true;
+        return thread_param;
+    }
+    if(data->local && ret_len == 0 && serve_shm(data)) {
+        data->complete = true;
+        return thread_param;
+    }
+
+    struct channel *ch = data->channel;
+    int rc = pthread_mutex_lock(&ch->mutex);
     if(rc != 0) {
         printf("lock mutex error %d\n", rc);
         data->complete = true;
         return thread_param;
     }
 
-    int wd = open(OUTPUT_FILE, O_WRONLY | O_APPEND | O_CREAT, 0666);
+    int wd = open_store(ch);
     if(wd == -1) {
         syslog(LOG_ERR, "file open create write failed");
         return thread_param;
     }
-    int ret_len;
+#if (USE_AESD_CHAR_DEVICE == 1)
     struct aesd_seekto seekto;
     bool found = false;
-    while((ret_len = recv(data->sockfd, buf, BUF_SIZE, 0)) > 0) {
+#endif
+    /* bytes read_channel() took for a channel line are the first data */
+    while(ret_len > 0 || (ret_len = recv(data->sockfd, buf, BUF_SIZE, 0)) > 0) {
 #if (USE_AESD_CHAR_DEVICE == 1)
         if(sscanf(buf, "AESDCHAR_IOCSEEKTO:%d,%d", &seekto.write_cmd, &seekto.write_cmd_offset) == 2) {
             found = true;
             break;
         } else {
 #endif
-            int len = write(wd, buf, ret_len);
+            int len = store(ch, wd, buf, ret_len);
             if(len == -1) {
                 syslog(LOG_ERR, "write file failed");
-                close(wd);
+                close_store(ch, wd);
                 data->complete = true;
                 return thread_param;
             }
             if(buf[ret_len-1]=='\n') {
+                flush_timestamp(ch, wd);
                 break;
             }
+            ret_len = 0;
 #if (USE_AESD_CHAR_DEVICE == 1)
         }
 #endif
     }
-    close(wd);
+    close_store(ch, wd);
 
-    int rd = open(OUTPUT_FILE, O_RDONLY);
+#if (USE_AESD_CHAR_DEVICE == 0)
+    /* writev straight from the mapped segments, sendfile for older ones */
+    if(aesd_log_send(&ch->log, data->sockfd) != 0) {
+        syslog(LOG_ERR, "send data failed: %s", strerror(errno));
+    }
+#else
+    int rd = open(ch->device, O_RDONLY);
     if(rd == -1) {
         syslog(LOG_ERR, "file open read failed");
         data->complete = true;
         return thread_param;
     }
 
-#if (USE_AESD_CHAR_DEVICE == 1)
     if(found) {
-        ioctl(rd, AESDCHAR_IOCSEEKTO, &seekto);
+        /* resolve the seek and copy the reply in one call, read() only picks up any overflow */
+        char *reply = malloc(SEEKREAD_SIZE);
+        struct aesd_seekread seekread = {
+            .write_cmd = seekto.write_cmd,
+            .write_cmd_offset = seekto.write_cmd_offset,
+            .buf = (uintptr_t)reply,
+            .len = SEEKREAD_SIZE,
+        };
+        int copied = reply ? ioctl(rd, AESDCHAR_IOCSEEKREAD, &seekread) : -1;
+        if(copied > 0) {
+            send(data->sockfd, reply, copied, 0);
+        }
+        free(reply);
+        if(copied >= 0 && copied < SEEKREAD_SIZE) {
+            close(rd);
+            goto unlock;
+        }
     }
-#endif
 
-    while((ret_len = read(rd, buf, BUF_SIZE)) > 0){
-        send(data->sockfd, buf, ret_len, 0);
+    /* let the kernel splice the reply into the socket, fall back to copying if it can't */
+    ssize_t sent;
+    while((sent = sendfile(data->sockfd, rd, NULL, SENDFILE_CHUNK)) > 0);
+    if(sent == -1 && (errno == EINVAL || errno == ENOSYS)) {
+        while((ret_len = read(rd, buf, BUF_SIZE)) > 0){
+            send(data->sockfd, buf, ret_len, 0);
+        }
     }
     close(rd);
 
-    rc = pthread_mutex_unlock(data->mutex);
+unlock:
+#endif
+    rc = pthread_mutex_unlock(&ch->mutex);
     if(rc != 0){
         printf("mutex unlock error %d\n", rc);
     }
@@ -158,60 +730,385 @@ void* data_handler(void* thread_param)
     return thread_param;
 }
 
-void* timestamp_handler(void* thread_param)
+/**
+ * Append a UDP batch to @param ch, the mutex taken once for all of it
+ */
+static void commit_batch(struct channel *ch, const struct iovec *iov, size_t count)
 {
-    struct timestamp_data* data = (struct timestamp_data *)thread_param;
-    char buffer[100];
-    char str[BUF_SIZE];
-    struct timespec ts;
+    pthread_mutex_lock(&ch->mutex);
+    int wd = open_store(ch);
+    if(wd == -1) {
+        syslog(LOG_ERR, "file open create write failed");
+    } else {
+        if(!store_batch(ch, wd, iov, count)) {
+            syslog(LOG_ERR, "write file failed");
+        }
+        flush_timestamp(ch, wd);
+        close_store(ch, wd);
+    }
+    pthread_mutex_unlock(&ch->mutex);
+}
 
-    ts.tv_sec = TIMESTAMP_INTERVAL;
-    ts.tv_nsec = 0;
+/**
+ * Where a record of a UDP batch naming channels goes
+ */
+struct udp_route {
+    struct channel *channel;    /* NULL once committed or if the channel is refused */
+    size_t skip;                /* length of the channel line */
+};
 
-    while(!caught_signal) {
-        int rc = clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
-        if(rc != 0){
-            printf("clock_nanosleep error %d\n", rc);
-            return thread_param;
-        }
-        time_t now;
-        struct tm *tm_info;
-        time(&now);
-        tm_info = localtime(&now);
-        strftime(buffer, sizeof(buffer), "%a, %d %b %Y %T %z", tm_info);
-        sprintf(str, "timestamp:%s\n", buffer);
-
-        rc = pthread_mutex_lock(data->mutex);
-        if(rc != 0) {
-            printf("lock mutex error %d\n", rc);
-            return thread_param;
-        }
-
-        int wd = open(OUTPUT_FILE, O_WRONLY | O_APPEND | O_CREAT, 0666);
-        if(wd == -1) {
-            syslog(LOG_ERR, "file open create write failed");
-            return thread_param;
-        }
-        
-        int len = write(wd, str, strlen(str));
-        if(len == -1) {
-            syslog(LOG_ERR, "file open create write failed");
+struct udp_routes {
+    struct udp_route *records;
+    size_t records_cap;
+    struct iovec *group;        /* the records of one channel */
+    size_t group_cap;
+};
+
+static bool grow(void **array, size_t *cap, size_t want, size_t size)
+{
+    if(want <= *cap) {
+        return true;
+    }
+    void *p = realloc(*array, want * size);
+    if(p == NULL) {
+        return false;
+    }
+    *array = p;
+    *cap = want;
+    return true;
+}
+
+/**
+ * Commit a batch some of whose records start with a CHANNEL_PREFIX line,
+ * each channel's records in one write, in the order they came in
+ * @return the number of records refused
+ */
+static size_t route_batch(struct udp_routes *r, const struct iovec *iov, size_t count, int records)
+{
+    const size_t *starts = udp_ingest.starts;
+    size_t prefix = strlen(CHANNEL_PREFIX);
+    size_t refused = 0;
+    int i, j;
+
+    if(!grow((void **)&r->records, &r->records_cap, records, sizeof(*r->records)) ||
+       !grow((void **)&r->group, &r->group_cap, count, sizeof(*r->group))) {
+        syslog(LOG_ERR, "udp batch of %d records dropped, out of memory", records);
+        return records;
+    }
+    for(i = 0; i < records; i++) {
+        struct udp_route *route = &r->records[i];
+        const struct iovec *first = &iov[starts[i]];
+        size_t end = i + 1 < records ? starts[i + 1] : count;
+        route->skip = channel_line(first->iov_base, first->iov_len);
+        route->channel = route->skip ? get_channel((char *)first->iov_base + prefix, route->skip - prefix - 1)
+                                     : &default_channel;
+        if(route->channel == NULL) {
+            refused++;
+        } else if(route->skip == first->iov_len && end == starts[i] + 1) {
+            /* a channel line and nothing else */
+            route->channel = NULL;
         }
-        close(wd);
+    }
+    for(i = 0; i < records; i++) {
+        struct channel *ch = r->records[i].channel;
+        size_t n = 0;
+        if(ch == NULL) {
+            continue;
+        }
+        for(j = i; j < records; j++) {
+            size_t k, end = j + 1 < records ? starts[j + 1] : count;
+            if(r->records[j].channel != ch) {
+                continue;
+            }
+            for(k = starts[j]; k < end; k++) {
+                r->group[n] = iov[k];
+                if(k == starts[j]) {
+                    r->group[n].iov_base = (char *)r->group[n].iov_base + r->records[j].skip;
+                    r->group[n].iov_len -= r->records[j].skip;
+                }
+                if(r->group[n].iov_len > 0) {
+                    n++;
+                }
+            }
+            r->records[j].channel = NULL;
+        }
+        commit_batch(ch, r->group, n);
+    }
+    return refused;
+}
+
+static void free_routes(void *arg)
+{
+    struct udp_routes *r = arg;
+    free(r->records);
+    free(r->group);
+}
+
+/**
+ * Commit UDP records a batch at a time until cancelled.  Cancellation is
+ * held off from the end of a receive to the next one, so the main loop can
+ * stop the thread at any time without it holding a channel mutex.  Failing
+ * receives are retried with a growing delay, and stop the listener when they
+ * come from the socket itself.
+ */
+static void* udp_handler(void* thread_param)
+{
+    struct udp_routes routes = { 0 };
+    const struct iovec *iov;
+    size_t count;
+    uint64_t dropped = 0;
+    time_t warned = 0;
+    time_t failed = 0;
+    long backoff_ms = 0;
+    unsigned int failures = 0;
+    int records, state, i;
+
+    pthread_cleanup_push(free_routes, &routes);
+    for(;;) {
+        if((records = aesd_udp_recv(&udp_ingest, &iov, &count)) == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno == EBADF || errno == ENOTSOCK || errno == EINVAL || errno == EFAULT) {
+                syslog(LOG_ERR, "udp receive failed, stopping the udp listener: %s", strerror(errno));
+                break;
+            }
+            failures++;
+            if(time(NULL) != failed) {
+                syslog(LOG_ERR, "udp receive failed %u times: %s", failures, strerror(errno));
+                failures = 0;
+                failed = time(NULL);
+            }
+            /* ENOMEM and the like may clear, don't spin on them meanwhile */
+            backoff_ms = backoff_ms == 0 ? 1 : backoff_ms * 2;
+            if(backoff_ms > UDP_BACKOFF_MAX_MS) {
+                backoff_ms = UDP_BACKOFF_MAX_MS;
+            }
+            nanosleep(&(struct timespec){ backoff_ms / 1000, backoff_ms % 1000 * 1000000L }, NULL);
+            continue;
+        }
+        backoff_ms = 0;
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+        /* datagrams from producers not using channels go out as one write */
+        for(i = 0; i < records; i++) {
+            const struct iovec *first = &iov[udp_ingest.starts[i]];
+            if(first->iov_len > strlen(CHANNEL_PREFIX) &&
+               memcmp(first->iov_base, CHANNEL_PREFIX, strlen(CHANNEL_PREFIX)) == 0) {
+                break;
+            }
+        }
+        if(i == records) {
+            commit_batch(&default_channel, iov, count);
+        } else {
+            udp_refused += route_batch(&routes, iov, count, records);
+        }
+        pthread_setcancelstate(state, NULL);
 
-        rc = pthread_mutex_unlock(data->mutex);
-        if(rc != 0){
-            printf("mutex unlock error %d\n", rc);
-            return thread_param;
+        if(udp_ingest.stats.dropped != dropped && time(NULL) != warned) {
+            syslog(LOG_WARNING, "udp socket buffer full, %llu datagrams dropped so far",
+                    (unsigned long long)udp_ingest.stats.dropped);
+            dropped = udp_ingest.stats.dropped;
+            warned = time(NULL);
         }
     }
-    return thread_param;
+    pthread_cleanup_pop(1);
+    return NULL;
+}
+
+/**
+ * Accept a connection on @param sd and start its handler thread
+ * @return false if the thread could not be started
+ */
+static bool accept_client(int sd, bool local, struct listhead *list)
+{
+    struct sockaddr client;
+    socklen_t client_len = sizeof(struct sockaddr);
+    int sockfd = accept(sd, &client, &client_len);
+    if(sockfd == -1) {
+        syslog(LOG_ERR, "accept failed");
+        return true;
+    }
+
+    if(local) {
+        syslog(LOG_DEBUG, "Accepted local connection");
+    } else {
+        struct sockaddr_in *addr_in = (struct sockaddr_in *)&client;
+        char* ip = inet_ntoa(addr_in->sin_addr);
+        syslog(LOG_DEBUG, "Accepted connection from %s", ip);
+    }
+
+    struct thread_data* data = malloc(sizeof(struct thread_data));
+    data->sockfd = sockfd;
+    data->channel = &default_channel;
+    data->complete = false;
+    data->local = local;
+    struct thread_node* t = malloc(sizeof(struct thread_node));
+    t->data = data;
+    int rc = pthread_create(&t->thread, NULL, data_handler, data);
+    if(rc != 0) {
+        printf("error pthread_create\n");
+        close(sockfd);
+        free(data);
+        free(t);
+        return false;
+    }
+    LIST_INSERT_HEAD(list, t, node);
+    return true;
+}
+
+/**
+ * @return a socket bound to @param path, replacing a socket left there by an earlier run
+ */
+static int local_socket(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct stat st;
+
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    int ud = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(ud == -1) {
+        return -1;
+    }
+    if(bind(ud, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(ud);
+        return -1;
+    }
+    return ud;
+}
+
+/**
+ * Release the named channels, their data kept only if @param persistent
+ */
+static void close_channels(bool persistent)
+{
+    size_t i;
+
+    for(i = 0; i < CHANNEL_BUCKETS; i++) {
+        struct channel *ch = channels.buckets[i], *next;
+        for(; ch != NULL; ch = next) {
+            next = ch->next;
+#if (USE_AESD_CHAR_DEVICE == 1)
+            close(ch->fd);
+#else
+            aesd_log_close(&ch->log, !persistent);
+#endif
+            pthread_mutex_destroy(&ch->mutex);
+            free(ch);
+        }
+        channels.buckets[i] = NULL;
+    }
+    channels.count = 0;
 }
 
+#if (USE_AESD_CHAR_DEVICE == 0)
+/**
+ * Open the segments already in OUTPUT_DIR, indexing their records and
+ * cutting off a record torn by a crash
+ */
+static bool recover_data(const struct aesd_log_limits *limits)
+{
+    struct aesd_recover_stats stats;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(aesd_log_open(&default_channel.log, OUTPUT_DIR, limits, cpus > 0 ? cpus : 1, &stats) != 0) {
+        syslog(LOG_ERR, "recovering %s failed: %s", OUTPUT_DIR, strerror(errno));
+        return false;
+    }
+    syslog(LOG_INFO, "recovered %zu records, %lld bytes in %zu segments in %.1f ms, cut %lld torn bytes",
+            default_channel.log.records, (long long)default_channel.log.bytes, default_channel.log.nsegments,
+            stats.seconds * 1e3, (long long)stats.torn);
+    return true;
+}
+#endif
+
 int main(int argc, char* argv[])
 {
+    bool daemonize = false;
+    bool persistent = false;
+    double timestamp_interval = TIMESTAMP_INTERVAL;
+    const char *local_path = NULL;
+    int ud = -1;
+    const char *udp_port = NULL;
+    unsigned int udp_batch = UDP_BATCH;
+    int udp_rcvbuf = 0;
+    bool udp_gro = false;
+    bool udp_running = false;
+    pthread_t udp_thread;
+    int opt;
+
     openlog(NULL, 0, LOG_USER);
 
+    while((opt = getopt(argc, argv, "dpt:u:U:b:B:Gs:r:a:")) != -1) {
+        switch(opt) {
+            case 'd':
+                daemonize = true;
+                break;
+            case 'p':
+                persistent = true;
+                break;
+            case 't':
+                timestamp_interval = strtod(optarg, NULL);
+                break;
+            case 'u':
+                local_path = optarg;
+                break;
+            case 'U':
+                udp_port = optarg;
+                break;
+            case 'b':
+                udp_batch = strtoul(optarg, NULL, 0);
+                break;
+            case 'B':
+                udp_rcvbuf = strtol(optarg, NULL, 0);
+                break;
+            case 'G':
+                udp_gro = true;
+                break;
+#if (USE_AESD_CHAR_DEVICE == 0)
+            case 's':
+                log_limits.segment_bytes = strtoll(optarg, NULL, 0);
+                break;
+            case 'r':
+                log_limits.retain_bytes = strtoll(optarg, NULL, 0);
+                break;
+            case 'a':
+                log_limits.retain_seconds = strtoll(optarg, NULL, 0);
+                break;
+#endif
+            default:
+                fprintf(stderr, "usage: %s [-d] [-p] [-t timestamp_interval_seconds] [-u local_socket_path]"
+                        " [-U udp_port] [-b udp_batch] [-B udp_rcvbuf_bytes] [-G]"
+#if (USE_AESD_CHAR_DEVICE == 0)
+                        " [-s segment_bytes] [-r retain_bytes] [-a retain_seconds]"
+#endif
+                        "\n", argv[0]);
+                closelog();
+                return -1;
+        }
+    }
+    if(timestamp_interval != 0 && timestamp_interval < 0.001) {
+        fprintf(stderr, "timestamp interval must be 0 or at least 0.001 seconds\n");
+        closelog();
+        return -1;
+    }
+#if (USE_AESD_CHAR_DEVICE == 0)
+    if(!recover_data(&log_limits)) {
+        closelog();
+        return -1;
+    }
+#else
+    if(persistent) {
+        fprintf(stderr, "-p only applies to the file backend, the device keeps its own data\n");
+    }
+#endif
+
     if(!setting_signal()) {
         goto err1;
     }
@@ -246,9 +1143,29 @@ int main(int argc, char* argv[])
         goto err2;
     }
     freeaddrinfo(servinfo);
+    servinfo = NULL;
+
+    /* same protocol for producers on this host, without the TCP stack */
+    if(local_path != NULL) {
+        ud = local_socket(local_path);
+        if(ud == -1) {
+            syslog(LOG_ERR, "local socket %s bind failed: %s", local_path, strerror(errno));
+            goto err2;
+        }
+    }
+
+    /* fire and forget records, one per datagram, without a reply */
+    if(udp_port != NULL) {
+        if(aesd_udp_open(&udp_ingest, udp_port, udp_batch, udp_rcvbuf, udp_gro) != 0) {
+            syslog(LOG_ERR, "udp port %s setup failed: %s", udp_port, strerror(errno));
+            goto err2;
+        }
+        syslog(LOG_INFO, "udp port %s: %u datagrams per batch, %d byte socket buffer%s", udp_port,
+                udp_ingest.batch, udp_ingest.rcvbuf, udp_ingest.gro ? ", gro" : udp_gro ? ", gro unsupported" : "");
+    }
 
     pid_t pid;
-    if(argc>1 && strcmp(argv[1], "d")) {
+    if(daemonize) {
         switch(pid = fork()) {
             case -1:
                 syslog(LOG_ERR, "fork failed");
@@ -262,53 +1179,70 @@ int main(int argc, char* argv[])
         }
     }
 
-    if(listen(sd, BACKLOG) != 0) {
+    if(listen(sd, BACKLOG) != 0 || (ud != -1 && listen(ud, BACKLOG) != 0)) {
         syslog(LOG_ERR, "listen failed");
         goto err2;
     }
 
     struct listhead list_head = LIST_HEAD_INITIALIZER(head);
     LIST_INIT(&list_head);
-    pthread_mutex_t mutex;
-    pthread_mutex_init(&mutex, NULL);
-#if (USE_AESD_CHAR_DEVICE == 0)
-    struct timestamp_data time_data;
-    time_data.mutex = &mutex;
-    pthread_t timestamp_thread;
-    ret = pthread_create(&timestamp_thread, NULL, timestamp_handler, &time_data);
-    if(ret != 0) {
-        printf("error pthread_create for timestamp\n");
-        goto err3;
+
+    /* the listening sockets and the timestamp timer share one poll loop, -1 for the ones not used */
+    struct pollfd fds[3];
+    int tfd = -1;
+    long long deadline = 0;
+    long long step = timestamp_interval * 1e9;
+    fds[0].fd = sd;
+    fds[0].events = POLLIN;
+    fds[1].fd = -1;
+    fds[1].events = POLLIN;
+    fds[2].fd = ud;
+    fds[2].events = POLLIN;
+    if(timestamp_interval > 0) {
+        tfd = timestamp_timer(timestamp_interval, &deadline);
+        if(tfd == -1) {
+            syslog(LOG_ERR, "timestamp timer setup failed");
+            goto err2;
+        }
+        fds[1].fd = tfd;
+    }
+    /* after the fork, threads don't survive it */
+    if(udp_ingest.fd != -1) {
+        if(pthread_create(&udp_thread, NULL, udp_handler, NULL) != 0) {
+            syslog(LOG_ERR, "udp thread start failed");
+            goto err2;
+        }
+        udp_running = true;
     }
-#endif
 
     struct thread_node *cur, *next;
     while(!caught_signal) {
-        struct sockaddr client;
-        socklen_t client_len = sizeof(struct sockaddr);
-        int sockfd = accept(sd, &client, &client_len);
-        if(sockfd == -1) {
-            syslog(LOG_ERR, "accept failed");
+        if(poll(fds, 3, timestamp_pending() ? TIMESTAMP_RETRY_MS : -1) == -1) {
+            if(errno != EINTR) {
+                syslog(LOG_ERR, "poll failed");
+            }
             continue;
         }
-
-        struct sockaddr_in *addr_in = (struct sockaddr_in *)&client;
-        char* ip = inet_ntoa(addr_in->sin_addr);
-        syslog(LOG_DEBUG, "Accepted connection from %s", ip);
-
-        struct thread_data* data = malloc(sizeof(struct thread_data));
-        data->sockfd = sockfd;
-        data->mutex = &mutex;
-        data->complete = false;
-        struct thread_node* t = malloc(sizeof(struct thread_node));
-        t->data = data;
-        int rc = pthread_create(&t->thread, NULL, data_handler, data);
-        if(rc != 0) {
-            printf("error pthread_create\n");
-            close(sockfd);
+        if(fds[1].revents & POLLIN) {
+            uint64_t expirations;
+            if(read(tfd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+                /* stamp the deadline that fired, time() reads a clock that may still lag it */
+                deadline += (long long)expirations * step;
+                queue_timestamp(deadline / 1000000000LL);
+            }
+        }
+        if(timestamp_pending()) {
+            try_flush_timestamp();
+        }
+        if(!(fds[0].revents & POLLIN) && !(fds[2].revents & POLLIN)) {
+            continue;
+        }
+        if((fds[0].revents & POLLIN) && !accept_client(sd, false, &list_head)) {
+            break;
+        }
+        if((fds[2].revents & POLLIN) && !accept_client(ud, true, &list_head)) {
             break;
         }
-        LIST_INSERT_HEAD(&list_head, t, node);
 
         for(cur=LIST_FIRST(&list_head);cur!=NULL;cur=next) {
             next = LIST_NEXT(cur, node);
@@ -332,31 +1266,44 @@ int main(int argc, char* argv[])
         free(cur);
     }
 
-#if (USE_AESD_CHAR_DEVICE == 0)
-    pthread_cancel(timestamp_thread);
-    pthread_join(timestamp_thread, NULL);
-#endif
-    
-    pthread_mutex_destroy(&mutex);
+    if(udp_running) {
+        pthread_cancel(udp_thread);
+        pthread_join(udp_thread, NULL);
+        syslog(LOG_INFO, "udp: %llu records, %llu bytes in %llu batches, %llu dropped, %llu truncated, "
+                "%llu refused a channel",
+                (unsigned long long)udp_ingest.stats.records, (unsigned long long)udp_ingest.stats.bytes,
+                (unsigned long long)udp_ingest.stats.batches, (unsigned long long)udp_ingest.stats.dropped,
+                (unsigned long long)udp_ingest.stats.truncated, (unsigned long long)udp_refused);
+    }
+    aesd_udp_close(&udp_ingest);
+    if(tfd != -1) {
+        close(tfd);
+    }
     close(sd);
+    if(ud != -1) {
+        close(ud);
+        unlink(local_path);
+    }
     closelog();
+    close_channels(persistent);
 #if (USE_AESD_CHAR_DEVICE == 0)
-    remove(OUTPUT_FILE);
+    aesd_log_close(&default_channel.log, !persistent);
 #endif
 
     return 0;
 
-#if (USE_AESD_CHAR_DEVICE == 0)
-err3:
-    pthread_mutex_destroy(&mutex);
-#endif
 err2:
     close(sd);
+    aesd_udp_close(&udp_ingest);
+    if(ud != -1) {
+        close(ud);
+        unlink(local_path);
+    }
 err1:
     freeaddrinfo(servinfo);
     closelog();
 #if (USE_AESD_CHAR_DEVICE == 0)
-    remove(OUTPUT_FILE);
+    aesd_log_close(&default_channel.log, !persistent);
 #endif
 
     return -1;